@@ -0,0 +1,7 @@
+#include "Allocator.h"
+// static members have to be defined in exactly one translation unit
+std::mutex CachingAllocator::mutex;
+std::unordered_map<std::size_t,std::vector<void*>> CachingAllocator::free_lists;
+CachingAllocator::Stats CachingAllocator::stats_{};
+CachingAllocator::Hook* CachingAllocator::hook = nullptr;
+std::unordered_map<void*,CachingAllocator::Served> CachingAllocator::served;
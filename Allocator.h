@@ -0,0 +1,265 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// Caching allocator which sits behind the storage of every Matrix
+// a training step frees and reallocates buffers with the exact same
+// shapes on the next step, so instead of giving the memory back to the
+// system the freed blocks are kept in per-size free lists and handed out
+// again on the next request of the same (rounded) size
+class CachingAllocator
+{
+    public:
+        // 64 bytes so that a buffer always starts on a cache line
+        // and can be used with aligned AVX / AVX-512 loads
+        static constexpr std::size_t alignment = 64;
+
+        struct Stats
+        {
+            std::size_t allocations = 0; // number of allocate calls
+            std::size_t hits = 0;        // served from a free list
+            std::size_t misses = 0;      // had to go to the system
+            std::size_t bytes_in_use = 0;
+            std::size_t bytes_cached = 0;   // sitting in the free lists
+            std::size_t peak_bytes_in_use = 0; // high-water mark of bytes_in_use
+            std::size_t peak_bytes_reserved = 0; // high-water mark of in use + cached
+
+            double hit_rate() const
+            {
+                return allocations == 0 ? 0.0 : static_cast<double>(hits) / allocations;
+            }
+        };
+
+        // lets something like the MemoryPlanner look at (and serve) the
+        // allocations, every method is called while the allocator lock is held
+        class Hook
+        {
+            public:
+                virtual ~Hook() = default;
+                // return a block to serve the allocation from, nullptr for the normal path
+                virtual void* on_allocate(std::size_t bucket) = 0;
+                // called for blocks which came from the normal path
+                virtual void on_allocated(void* block,std::size_t bucket) = 0;
+                virtual void on_free(void* block) = 0;
+                // a block which on_allocate served is freed, this goes to the
+                // hook which served it even if it is not installed anymore
+                virtual void on_return(void* block) = 0;
+        };
+
+    private:
+        struct Served
+        {
+            Hook* owner;
+            std::size_t bucket;
+        };
+
+        static std::mutex mutex;
+        static Hook* hook;
+        static std::unordered_map<std::size_t,std::vector<void*>> free_lists;
+        // blocks served by a hook which are still in use, a buffer can
+        // outlive the replay it was allocated in
+        static std::unordered_map<void*,Served> served;
+        static Stats stats_;
+
+        // every bucket is a multiple of the alignment, std::aligned_alloc
+        // requires the size to be a multiple of the alignment anyway
+        static std::size_t bucket_size(std::size_t bytes)
+        {
+            if(bytes == 0) return alignment;
+            return (bytes + alignment - 1) & ~(alignment - 1);
+        }
+
+    public:
+        static void* allocate_bytes(std::size_t bytes)
+        {
+            std::size_t bucket = bucket_size(bytes);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(hook != nullptr)
+                {
+                    if(void* block = hook->on_allocate(bucket))
+                    {
+                        served[block] = Served{hook,bucket};
+                        return block;
+                    }
+                }
+                stats_.allocations++;
+                auto it = free_lists.find(bucket);
+                if(it != free_lists.end() && !it->second.empty())
+                {
+                    void* block = it->second.back();
+                    it->second.pop_back();
+                    stats_.hits++;
+                    stats_.bytes_cached -= bucket;
+                    stats_.bytes_in_use += bucket;
+                    if(stats_.bytes_in_use > stats_.peak_bytes_in_use)
+                        stats_.peak_bytes_in_use = stats_.bytes_in_use;
+                    if(hook != nullptr) hook->on_allocated(block,bucket);
+                    return block;
+                }
+                stats_.misses++;
+            }
+
+            // going to the system is done outside of the lock
+            void* block = std::aligned_alloc(alignment,bucket);
+            if(block == nullptr)
+            {
+                // the cached blocks might be of other sizes so give them back
+                // to the system and try once more before failing
+                empty_cache();
+                block = std::aligned_alloc(alignment,bucket);
+                if(block == nullptr)
+                {
+                    throw std::bad_alloc();
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            stats_.bytes_in_use += bucket;
+            if(stats_.bytes_in_use > stats_.peak_bytes_in_use)
+                stats_.peak_bytes_in_use = stats_.bytes_in_use;
+            if(stats_.bytes_in_use + stats_.bytes_cached > stats_.peak_bytes_reserved)
+                stats_.peak_bytes_reserved = stats_.bytes_in_use + stats_.bytes_cached;
+            if(hook != nullptr) hook->on_allocated(block,bucket);
+            return block;
+        }
+
+        // the block is not given back to the system, it goes to the
+        // free list of its size and waits for the next allocation
+        static void free_bytes(void* block,std::size_t bytes)
+        {
+            if(block == nullptr) return;
+            std::size_t bucket = bucket_size(bytes);
+            std::lock_guard<std::mutex> lock(mutex);
+            if(!served.empty())
+            {
+                auto it = served.find(block);
+                if(it != served.end())
+                {
+                    Hook* owner = it->second.owner;
+                    served.erase(it);
+                    owner->on_return(block);
+                    return;
+                }
+            }
+            if(hook != nullptr) hook->on_free(block);
+            free_lists[bucket].push_back(block);
+            stats_.bytes_in_use -= bucket;
+            stats_.bytes_cached += bucket;
+        }
+
+        // storage for n elements of T, every element is default constructed
+        // like new T[n] does and destroyed again before the block is cached
+        template<typename T>
+        static std::shared_ptr<T[]> allocate(std::size_t n)
+        {
+            static_assert(alignof(T) <= alignment, "Type needs a bigger alignment than the allocator gives");
+            std::size_t bytes = n * sizeof(T);
+            T* ptr = static_cast<T*>(allocate_bytes(bytes));
+            std::size_t constructed = 0;
+            try
+            {
+                for(;constructed < n;constructed++)
+                {
+                    ::new (static_cast<void*>(ptr + constructed)) T();
+                }
+            }
+            catch(...)
+            {
+                std::destroy_n(ptr,constructed);
+                free_bytes(ptr,bytes);
+                throw;
+            }
+
+            return std::shared_ptr<T[]>(ptr,[n,bytes](T* p){
+                if constexpr(!std::is_trivially_destructible_v<T>)
+                {
+                    std::destroy_n(p,n);
+                }
+                CachingAllocator::free_bytes(p,bytes);
+            });
+        }
+
+        // gives all the cached (free) blocks back to the system
+        // the blocks which are still in use are not touched
+        static void empty_cache()
+        {
+            std::unordered_map<std::size_t,std::vector<void*>> to_free;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                to_free.swap(free_lists);
+                stats_.bytes_cached = 0;
+            }
+            for(auto& [bucket,blocks] : to_free)
+            {
+                for(void* block : blocks)
+                {
+                    std::free(block);
+                }
+            }
+        }
+
+        static void set_hook(Hook* new_hook)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            hook = new_hook;
+        }
+
+        static Hook* get_hook()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return hook;
+        }
+
+        // the blocks the hook served which are still in use become blocks
+        // of the allocator and are cached when they are freed, returns them
+        // so that the hook does not give them back to the system
+        static std::vector<void*> disown(Hook* owner)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<void*> blocks;
+            for(auto it = served.begin();it != served.end();)
+            {
+                if(it->second.owner != owner)
+                {
+                    ++it;
+                    continue;
+                }
+                blocks.push_back(it->first);
+                stats_.bytes_in_use += it->second.bucket;
+                if(stats_.bytes_in_use > stats_.peak_bytes_in_use)
+                    stats_.peak_bytes_in_use = stats_.bytes_in_use;
+                it = served.erase(it);
+            }
+            return blocks;
+        }
+
+        static Stats stats()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return stats_;
+        }
+
+        // resets the counters and the high-water marks
+        // but keeps the amount of memory which is in use and cached
+        static void reset_stats()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Stats fresh{};
+            fresh.bytes_in_use = stats_.bytes_in_use;
+            fresh.bytes_cached = stats_.bytes_cached;
+            fresh.peak_bytes_in_use = stats_.bytes_in_use;
+            fresh.peak_bytes_reserved = stats_.bytes_in_use + stats_.bytes_cached;
+            stats_ = fresh;
+        }
+};
+
+#endif
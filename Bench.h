@@ -0,0 +1,227 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "GraphMemory.h"
+#include "PerfCounters.h"
+
+// Micro benchmark harness
+//
+// a case is warmed up, then repeated until it has run for min_seconds and at
+// least min_reps times. Every repetition is timed on its own, the median is
+// the number to compare (it ignores the odd slow run), p99 shows the tail.
+// The work of a repetition is given as ops (elements, nodes, ...) and flops,
+// which turns the median into ns/op and GFLOP/s. Untimed setup runs before
+// every repetition, for example to build the graph a backward pass consumes.
+// The autograd nodes a repetition creates and the ones which are still alive
+// after it (a leak, the count grows from one repetition to the next) are
+// recorded as well, so a memory regression fails the comparison like a slow one.
+// With perf on, the hardware counters (cycles, instructions, cache and branch
+// misses, see PerfCounters.h) are read around every repetition, outside the
+// timed region, and averaged per repetition
+struct BenchOptions
+{
+    int warmup_reps = 3;
+    int min_reps = 10;
+    int max_reps = 10000;
+    double min_seconds = 0.25;
+    bool perf = true;
+};
+
+struct BenchResult
+{
+    std::string name;
+    int reps = 0;
+    double ops = 1.0;   // per repetition
+    double flops = 0.0; // per repetition
+    double min_ns = 0.0;
+    double median_ns = 0.0;
+    double mean_ns = 0.0;
+    double p99_ns = 0.0;
+    double stddev_ns = 0.0;
+    double nodes = 0.0;        // created by fn per repetition
+    double leaked_nodes = 0.0; // growth of the live nodes per repetition
+    int64_t peak_nodes = 0;    // above what was alive before the case
+    PerfSample perf;           // per repetition, empty without counters
+
+    double ns_per_op() const { return median_ns / ops; }
+    double gflops() const { return flops > 0.0 ? flops / median_ns : 0.0; }
+};
+
+// keeps the compiler from removing a computation whose result is unused
+template<typename T>
+inline void do_not_optimize(T const& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class Bench
+{
+    BenchOptions options;
+    std::string filter;
+    std::vector<BenchResult> results_;
+
+    public:
+        explicit Bench(BenchOptions options = {},std::string filter = "")
+            : options(options),filter(std::move(filter)) {}
+
+        // false if the case does not match the filter
+        bool run(const std::string& name,double ops,double flops,
+            const std::function<void()>& setup,const std::function<void()>& fn)
+        {
+            if(!filter.empty() && name.find(filter) == std::string::npos) return false;
+            using Clock = std::chrono::steady_clock;
+
+            for(int i = 0;i < options.warmup_reps;i++)
+            {
+                if(setup) setup();
+                fn();
+            }
+
+            std::vector<double> times;
+            double total = 0.0;
+            GraphMemory::reset_peak();
+            GraphMemory::Snapshot before = GraphMemory::snapshot();
+            uint64_t created = 0;
+            int64_t live_after_first = 0;
+            PerfCounters* counters = options.perf && PerfCounters::thread().available() ? &PerfCounters::thread() : nullptr;
+            PerfSample perf_total;
+            while(static_cast<int>(times.size()) < options.max_reps &&
+                (static_cast<int>(times.size()) < options.min_reps || total < options.min_seconds * 1e9))
+            {
+                if(setup) setup();
+                uint64_t created_before = GraphMemory::snapshot().created_nodes;
+                PerfSample perf_start;
+                PerfSample perf_end;
+                if(counters) counters->read(perf_start);
+                auto start = Clock::now();
+                fn();
+                double ns = std::chrono::duration<double,std::nano>(Clock::now() - start).count();
+                if(counters && counters->read(perf_end)) perf_total += perf_end - perf_start;
+                GraphMemory::Snapshot after = GraphMemory::snapshot();
+                created += after.created_nodes - created_before;
+                if(times.empty()) live_after_first = after.live_nodes;
+                times.push_back(ns);
+                total += ns;
+            }
+            GraphMemory::Snapshot last = GraphMemory::snapshot();
+
+            std::sort(times.begin(),times.end());
+            BenchResult result;
+            result.name = name;
+            result.reps = static_cast<int>(times.size());
+            result.ops = ops;
+            result.flops = flops;
+            result.min_ns = times.front();
+            result.median_ns = times.size() % 2 == 1 ? times[times.size() / 2]
+                : 0.5 * (times[times.size() / 2 - 1] + times[times.size() / 2]);
+            // nearest rank
+            std::size_t rank = static_cast<std::size_t>(std::ceil(0.99 * times.size()));
+            result.p99_ns = times[std::max<std::size_t>(rank,1) - 1];
+            result.mean_ns = total / times.size();
+            double squares = 0.0;
+            for(double t : times)
+            {
+                squares += (t - result.mean_ns) * (t - result.mean_ns);
+            }
+            result.stddev_ns = times.size() > 1 ? std::sqrt(squares / (times.size() - 1)) : 0.0;
+            result.nodes = static_cast<double>(created) / times.size();
+            result.leaked_nodes = times.size() > 1
+                ? static_cast<double>(last.live_nodes - live_after_first) / (times.size() - 1) : 0.0;
+            result.peak_nodes = last.peak_nodes - before.live_nodes;
+            result.perf = perf_total.per(static_cast<double>(times.size()));
+
+            std::printf("%-40s %8d reps  median %12.0f ns  p99 %12.0f ns  %10.2f ns/op",
+                name.c_str(),result.reps,result.median_ns,result.p99_ns,result.ns_per_op());
+            if(flops > 0.0)
+            {
+                std::printf("  %7.3f GFLOP/s",result.gflops());
+            }
+            if(result.nodes > 0.0)
+            {
+                std::printf("  %9.0f nodes",result.nodes);
+            }
+            if(result.perf.ipc() > 0.0)
+            {
+                std::printf("  IPC %.2f",result.perf.ipc());
+            }
+            if(result.leaked_nodes > 0.0)
+            {
+                std::printf("  LEAK %.0f nodes/rep",result.leaked_nodes);
+            }
+            std::printf("\n");
+            results_.push_back(result);
+            return true;
+        }
+
+        bool run(const std::string& name,double ops,const std::function<void()>& fn)
+        {
+            return run(name,ops,0.0,nullptr,fn);
+        }
+
+        const std::vector<BenchResult>& results() const { return results_; }
+
+        // {"commit": ..., "results": [{...}, ...]}, one object per case
+        void write_json(const std::string& path,const std::string& commit) const
+        {
+            std::ofstream out(path,std::ios::trunc);
+            if(!out)
+            {
+                throw std::runtime_error("Failed to write " + path);
+            }
+            auto escape = [](const std::string& text){
+                std::string escaped;
+                for(char ch : text)
+                {
+                    if(ch == '"' || ch == '\\') escaped.push_back('\\');
+                    escaped.push_back(ch);
+                }
+                return escaped;
+            };
+            out << "{\n  \"commit\": \"" << escape(commit) << "\",\n  \"results\": [\n";
+            for(std::size_t i = 0;i < results_.size();i++)
+            {
+                const BenchResult& r = results_[i];
+                char line[512];
+                std::snprintf(line,sizeof(line),
+                    "    {\"name\": \"%s\", \"reps\": %d, \"ops\": %.0f, \"flops\": %.0f, "
+                    "\"min_ns\": %.1f, \"median_ns\": %.1f, \"mean_ns\": %.1f, \"p99_ns\": %.1f, "
+                    "\"stddev_ns\": %.1f, \"ns_per_op\": %.3f, \"gflops\": %.4f, "
+                    "\"nodes\": %.1f, \"leaked_nodes\": %.1f, \"peak_nodes\": %lld",
+                    escape(r.name).c_str(),r.reps,r.ops,r.flops,r.min_ns,r.median_ns,r.mean_ns,
+                    r.p99_ns,r.stddev_ns,r.ns_per_op(),r.gflops(),r.nodes,r.leaked_nodes,
+                    static_cast<long long>(r.peak_nodes));
+                out << line;
+                // the counters of the case, null for the ones which could not be opened
+                for(std::size_t e = 0;e < perf_event_count;e++)
+                {
+                    PerfEvent event = static_cast<PerfEvent>(e);
+                    std::string key = perf_event_name(event);
+                    for(char& ch : key)
+                    {
+                        ch = ch == ' ' ? '_' : static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+                    }
+                    out << ", \"" << key << "\": ";
+                    if(r.perf.has(event)) out << r.perf[event];
+                    else out << "null";
+                }
+                out << ", \"ipc\": ";
+                if(r.perf.ipc() > 0.0) out << r.perf.ipc();
+                else out << "null";
+                out << "}" << (i + 1 < results_.size() ? ",\n" : "\n");
+            }
+            out << "  ]\n}\n";
+        }
+};
+
+#endif
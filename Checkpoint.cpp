@@ -0,0 +1,113 @@
+#include "Checkpoint.h"
+
+int Checkpoint::numel(const Matrix<Tensor>& matrix)
+{
+    return matrix.size != -1 ? matrix.size : matrix.rows * matrix.columns;
+}
+
+Matrix<Tensor> Checkpoint::detach(const Matrix<Tensor>& matrix)
+{
+    int n = numel(matrix);
+    std::shared_ptr<Tensor[]> data = Matrix<Tensor>::allocate(n);
+    for(int i = 0;i < n;i++)
+    {
+        data[i] = Tensor{matrix.data[i].value()};
+    }
+    if(matrix.size != -1)
+    {
+        return Matrix<Tensor>{matrix.size,data};
+    }
+    return Matrix<Tensor>{matrix.rows,matrix.columns,data};
+}
+
+Matrix<Tensor> Checkpoint::apply(Function fn,Matrix<Tensor>& input,const std::vector<Tensor>& params)
+{
+    ProfileScope scope("checkpoint");
+    Matrix<Tensor> result{};
+    try
+    {
+        int n_in = numel(input);
+
+        // forward on detached leaves with the grad mode off, only the output
+        // values are kept so fn does not need to build a graph
+        Matrix<Tensor> inner_input = detach(input);
+        {
+            NoGradScope no_grad;
+            Matrix<Tensor> inner_output = fn(inner_input);
+            result = detach(inner_output);
+        }
+        int n_out = numel(result);
+
+        // one node stands for the whole block: it depends on the inputs and
+        // every output depends on it, so in reverse topological order it runs
+        // after all the outputs have received their gradients. The params are
+        // in prev as well since the recomputed graph writes their gradients
+        Tensor block{};
+        std::vector<std::shared_ptr<Impl>> inputs(n_in);
+        for(int i = 0;i < n_in;i++)
+        {
+            inputs[i] = input.data[i].impl;
+        }
+        block.impl->prev.reserve(inputs.size() + params.size());
+        block.impl->prev.assign(inputs.begin(),inputs.end());
+        for(const Tensor& param : params)
+        {
+            block.impl->prev.push_back(param.impl);
+        }
+
+        // weak pointers since the outputs own the block node through prev
+        std::vector<std::weak_ptr<Impl>> outputs(n_out);
+        for(int i = 0;i < n_out;i++)
+        {
+            result.data[i].impl->prev = {block.impl};
+            outputs[i] = result.data[i].impl;
+        }
+
+        block.impl->set_backward([fn,inputs,outputs,rows = input.rows,columns = input.columns,size = input.size](){
+            // rebuild the block from the saved input values
+            std::shared_ptr<Tensor[]> data = Matrix<Tensor>::allocate(static_cast<int>(inputs.size()));
+            for(std::size_t i = 0;i < inputs.size();i++)
+            {
+                data[i] = Tensor{inputs[i]->val()};
+            }
+            Matrix<Tensor> recompute_input = size != -1 ? Matrix<Tensor>{size,data} : Matrix<Tensor>{rows,columns,data};
+            // a parallel backward runs this with the locks of the inputs and
+            // params held, parallel ops of fn and the backward of the
+            // recomputed graph stay on this thread (Parallel::BackwardScope)
+            Matrix<Tensor> recompute_output = fn(recompute_input);
+
+            // seed the recomputed outputs with the gradients the outputs got
+            std::vector<std::shared_ptr<Impl>> roots;
+            for(std::size_t i = 0;i < outputs.size();i++)
+            {
+                std::shared_ptr<Impl> out = outputs[i].lock();
+                if(!out || out->grad() == 0.0f) continue;
+                recompute_output.data[i].impl->grad() += out->grad();
+                roots.push_back(recompute_output.data[i].impl);
+            }
+            Tensor::run_backward(roots);
+
+            for(std::size_t i = 0;i < inputs.size();i++)
+            {
+                inputs[i]->accumulate(data[i].impl->grad());
+            }
+        });
+        // folded if no input requires a gradient, the outputs are constants then
+        for(int i = 0;i < n_out;i++)
+        {
+            result.data[i].impl->requires_grad = block.impl->requires_grad;
+        }
+        Logger::info("Successfully checkpointed a block");
+    }
+    catch(const std::exception& e)
+    {
+        Logger::error(std::string(e.what()));
+        std::cerr << e.what() << std::endl;
+    }
+    catch(...)
+    {
+        Logger::error("Error while checkpointing a block");
+        std::cerr << "Error while checkpointing a block" << std::endl;
+    }
+    return result;
+}
@@ -0,0 +1,44 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <functional>
+#include <vector>
+#include "Tensor.h"
+#include "Matrix.h"
+
+// Activation checkpointing (recompute in backward)
+//
+// normally every node of a block keeps its inputs alive through prev and
+// its closure, so all the activations of a deep network stay in memory until
+// backward is finished. A checkpointed block only keeps its input and its
+// output, everything in between is thrown away after the forward pass and
+// computed again when the gradients reach the block
+//
+//     Matrix<Tensor> h = checkpoint([&](Matrix<Tensor>& x){
+//         return (x.matmul(W1) + b1).pow(2).matmul(W2);
+//     }, input, layer.parameters());
+//
+// the block is run twice so it trades compute for memory. Tensors the block
+// uses but does not get as input (weights) must be leaves of the graph and
+// are passed as params: their gradients are accumulated directly by the
+// recomputed graph, the block node has them in prev so a parallel backward
+// locks them while it runs
+class Checkpoint
+{
+    public:
+        using Function = std::function<Matrix<Tensor>(Matrix<Tensor>&)>;
+
+        static Matrix<Tensor> apply(Function fn,Matrix<Tensor>& input,const std::vector<Tensor>& params);
+
+    private:
+        // fresh leaves with the same values and shape, which are not connected to the graph
+        static Matrix<Tensor> detach(const Matrix<Tensor>& matrix);
+        static int numel(const Matrix<Tensor>& matrix);
+};
+
+inline Matrix<Tensor> checkpoint(Checkpoint::Function fn,Matrix<Tensor>& input,const std::vector<Tensor>& params)
+{
+    return Checkpoint::apply(std::move(fn),input,params);
+}
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef DTYPE_H
+#define DTYPE_H
+
+#include <bit>
+#include <cstdint>
+#include <type_traits>
+
+// Element types of tensors and dense matrices
+//
+// a tensor is BasicTensor<S> with S one of float, double, bfloat16 or
+// float16, Tensor is BasicTensor<float>. bfloat16 is the upper half of a
+// float (same range, 8 bits of mantissa), float16 is IEEE half precision
+// (10 bits of mantissa but nothing above 65504 and nothing below 6e-8, the
+// reason for loss scaling). Both only store: every computation converts to
+// float and the result is rounded back, gradients and sums are kept in
+// accumulate_t<S> which is float for both
+//
+//     BasicTensor<double> x{0.5};           // a graph in double
+//     Matrix<bfloat16> table(rows,dim,0.0f); // half the bytes of Matrix<float>
+struct bfloat16
+{
+    uint16_t bits = 0;
+
+    constexpr bfloat16() = default;
+    constexpr bfloat16(float value) : bits(round(value)) {}
+
+    constexpr operator float() const
+    {
+        return std::bit_cast<float>(static_cast<uint32_t>(bits) << 16);
+    }
+
+    // round to nearest even, a NaN stays a (quiet) NaN
+    static constexpr uint16_t round(float value)
+    {
+        uint32_t u = std::bit_cast<uint32_t>(value);
+        if((u & 0x7fffffffu) > 0x7f800000u)
+        {
+            return static_cast<uint16_t>((u >> 16) | 0x0040u);
+        }
+        return static_cast<uint16_t>((u + 0x7fffu + ((u >> 16) & 1u)) >> 16);
+    }
+
+    constexpr bfloat16& operator+=(float other) { return *this = float(*this) + other; }
+    constexpr bfloat16& operator-=(float other) { return *this = float(*this) - other; }
+    constexpr bfloat16& operator*=(float other) { return *this = float(*this) * other; }
+    constexpr bfloat16& operator/=(float other) { return *this = float(*this) / other; }
+};
+
+static_assert(sizeof(bfloat16) == 2);
+
+struct float16
+{
+    uint16_t bits = 0;
+
+    constexpr float16() = default;
+    constexpr float16(float value) : bits(round(value)) {}
+
+    constexpr operator float() const
+    {
+        uint32_t sign = static_cast<uint32_t>(bits & 0x8000u) << 16;
+        uint32_t exponent = (bits >> 10) & 0x1fu;
+        uint32_t mantissa = bits & 0x3ffu;
+        if(exponent == 0)
+        {
+            // zero or subnormal, mantissa * 2^-24 is exact in float
+            float magnitude = static_cast<float>(mantissa) * 5.9604644775390625e-8f;
+            return std::bit_cast<float>(sign | std::bit_cast<uint32_t>(magnitude));
+        }
+        if(exponent == 0x1f)
+        {
+            return std::bit_cast<float>(sign | 0x7f800000u | (mantissa << 13));
+        }
+        return std::bit_cast<float>(sign | ((exponent + 112) << 23) | (mantissa << 13));
+    }
+
+    // round to nearest even, too large becomes inf, too small 0 (through the subnormals)
+    static constexpr uint16_t round(float value)
+    {
+        uint32_t u = std::bit_cast<uint32_t>(value);
+        uint32_t sign = (u >> 16) & 0x8000u;
+        uint32_t magnitude = u & 0x7fffffffu;
+        if(magnitude > 0x7f800000u) return static_cast<uint16_t>(sign | 0x7e00u);
+        // 65520 and above round to inf
+        if(magnitude >= 0x477ff000u) return static_cast<uint16_t>(sign | 0x7c00u);
+        if(magnitude < 0x38800000u)
+        {
+            // below 2^-14: adding 0.5 leaves the subnormal mantissa in the
+            // low bits of the float, rounded by the addition
+            float shifted = std::bit_cast<float>(magnitude) + 0.5f;
+            return static_cast<uint16_t>(sign | (std::bit_cast<uint32_t>(shifted) - 0x3f000000u));
+        }
+        // rebias the exponent (127 - 15) and round the 13 dropped bits
+        magnitude += 0xc8000fffu + ((magnitude >> 13) & 1u);
+        return static_cast<uint16_t>(sign | (magnitude >> 13));
+    }
+
+    constexpr float16& operator+=(float other) { return *this = float(*this) + other; }
+    constexpr float16& operator-=(float other) { return *this = float(*this) - other; }
+    constexpr float16& operator*=(float other) { return *this = float(*this) * other; }
+    constexpr float16& operator/=(float other) { return *this = float(*this) / other; }
+};
+
+static_assert(sizeof(float16) == 2);
+
+// what sums and gradients of an element type are kept in
+template<typename S>
+struct accumulate_type { using type = S; };
+
+template<>
+struct accumulate_type<bfloat16> { using type = float; };
+
+template<>
+struct accumulate_type<float16> { using type = float; };
+
+template<typename S>
+using accumulate_t = typename accumulate_type<S>::type;
+
+template<typename S>
+inline constexpr bool is_dtype_v = std::is_same_v<S,float> || std::is_same_v<S,double>
+    || std::is_same_v<S,bfloat16> || std::is_same_v<S,float16>;
+
+// a one byte id of the element type, 0 is none of them
+template<typename S>
+constexpr uint8_t dtype_id()
+{
+    if constexpr(std::is_same_v<S,float>) return 1;
+    else if constexpr(std::is_same_v<S,double>) return 2;
+    else if constexpr(std::is_same_v<S,bfloat16>) return 3;
+    else if constexpr(std::is_same_v<S,float16>) return 4;
+    else return 0;
+}
+
+template<typename S>
+constexpr const char* dtype_name()
+{
+    if constexpr(std::is_same_v<S,float>) return "float32";
+    else if constexpr(std::is_same_v<S,double>) return "float64";
+    else if constexpr(std::is_same_v<S,bfloat16>) return "bfloat16";
+    else if constexpr(std::is_same_v<S,float16>) return "float16";
+    else return "unknown";
+}
+
+#endif
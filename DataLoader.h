@@ -1,11 +1,37 @@
+#ifndef DATALOADER_H
+#define DATALOADER_H
+
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <tuple>
 #include <map>
+#include <memory>
+#include <random>
 #include <deque>
 #include <string>
+#include <string_view>
 #include <stdexcept>
+#include <span>
+#include <cstring>
+#include <cstdint>
+#include <array>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Vocabulary.h"
+#include "ThreadPool.h"
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 std::vector<std::string> read_file(std::string filename)
 {
@@ -45,6 +71,652 @@ std::tuple<std::vector<std::vector<int>>,std::vector<int>> build_dataset(std::ve
         }
     }
     return std::make_tuple(X,Y);
-} 
+}
+
+// Read only memory mapping of a whole file, the pages are only read
+// from the disk when they are touched for the first time
+class MappedFile
+{
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+
+    public:
+        explicit MappedFile(const std::string& filename)
+        {
+            int fd = ::open(filename.c_str(),O_RDONLY);
+            if(fd < 0)
+            {
+                throw std::runtime_error("Failed to open " + filename);
+            }
+            struct stat info{};
+            if(::fstat(fd,&info) != 0)
+            {
+                ::close(fd);
+                throw std::runtime_error("Failed to stat " + filename);
+            }
+            size_ = static_cast<std::size_t>(info.st_size);
+            if(size_ > 0)
+            {
+                void* mapped = ::mmap(nullptr,size_,PROT_READ,MAP_PRIVATE,fd,0);
+                if(mapped == MAP_FAILED)
+                {
+                    ::close(fd);
+                    throw std::runtime_error("Failed to mmap " + filename);
+                }
+                // the file is scanned from the front to the back
+                ::madvise(mapped,size_,MADV_SEQUENTIAL);
+                data_ = static_cast<const char*>(mapped);
+            }
+            // the mapping stays valid after the descriptor is closed
+            ::close(fd);
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        MappedFile(MappedFile&& other) noexcept : data_(other.data_),size_(other.size_)
+        {
+            other.data_ = nullptr;
+            other.size_ = 0;
+        }
+
+        MappedFile& operator=(MappedFile&& other) noexcept
+        {
+            if(this != &other)
+            {
+                unmap();
+                data_ = other.data_;
+                size_ = other.size_;
+                other.data_ = nullptr;
+                other.size_ = 0;
+            }
+            return *this;
+        }
+
+        ~MappedFile()
+        {
+            unmap();
+        }
+
+        const char* data() const { return data_; }
+        std::size_t size() const { return size_; }
+        std::string_view view() const { return {data_,size_}; }
+
+    private:
+        void unmap()
+        {
+            if(data_ != nullptr)
+            {
+                ::munmap(const_cast<char*>(data_),size_);
+                data_ = nullptr;
+            }
+        }
+};
+
+// splits the text at '\n' like std::getline does (a newline at the very end
+// does not give an extra empty line), the newlines are searched 32 or 16
+// bytes at a time and the lines point into the text without copying it
+inline std::vector<std::string_view> split_lines(std::string_view text)
+{
+    std::vector<std::string_view> lines;
+    const char* data = text.data();
+    std::size_t n = text.size();
+    std::size_t line_start = 0;
+    std::size_t i = 0;
+
+    auto emit = [&](std::size_t newline){
+        lines.emplace_back(data + line_start,newline - line_start);
+        line_start = newline + 1;
+    };
+
+#if defined(__AVX2__)
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for(;i + 32 <= n;i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk,newline)));
+        while(mask != 0)
+        {
+            emit(i + static_cast<std::size_t>(__builtin_ctz(mask)));
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i newline = _mm_set1_epi8('\n');
+    for(;i + 16 <= n;i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk,newline)));
+        while(mask != 0)
+        {
+            emit(i + static_cast<std::size_t>(__builtin_ctz(mask)));
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for(;i < n;i++)
+    {
+        if(data[i] == '\n') emit(i);
+    }
+    if(line_start < n)
+    {
+        lines.emplace_back(data + line_start,n - line_start);
+    }
+    return lines;
+}
+
+// the corpus (names.txt) as views into the mapped file, nothing is copied
+// so the views are only valid as long as the corpus is alive
+class MappedCorpus
+{
+    MappedFile file;
+    std::vector<std::string_view> lines_;
+
+    public:
+        explicit MappedCorpus(const std::string& filename)
+            : file(filename),lines_(split_lines(file.view())) {}
+
+        const std::vector<std::string_view>& lines() const { return lines_; }
+        std::string_view text() const { return file.view(); }
+        std::size_t size() const { return lines_.size(); }
+        std::string_view operator[](std::size_t i) const { return lines_[i]; }
+};
+
+// a non owning view over flat X / Y buffers, which can live in a
+// FlatDataset or in a mapped dataset file
+template<typename Index = int32_t>
+struct DatasetView
+{
+    const Index* X = nullptr;
+    const Index* Y = nullptr;
+    std::size_t size = 0;
+    int block_size = 0;
+
+    const Index* row(std::size_t i) const { return X + i * block_size; }
+    Index target(std::size_t i) const { return Y[i]; }
+};
+
+// the whole dataset in two flat buffers instead of one vector per example
+// X is size x block_size in row major order and Y has one target per row
+// the examples of word w are the rows [word_offsets[w], word_offsets[w+1])
+// Index can be uint8_t when the vocabulary fits in a byte
+template<typename Index = int32_t>
+struct FlatDataset
+{
+    int block_size = 0;
+    std::size_t size = 0;
+    std::vector<Index> X;
+    std::vector<Index> Y;
+    std::vector<std::size_t> word_offsets;
+
+    const Index* row(std::size_t i) const { return X.data() + i * block_size; }
+    Index target(std::size_t i) const { return Y[i]; }
+    std::size_t words() const { return word_offsets.empty() ? 0 : word_offsets.size() - 1; }
+    std::size_t bytes() const { return (X.size() + Y.size()) * sizeof(Index); }
+    DatasetView<Index> view() const { return {X.data(),Y.data(),size,block_size}; }
+};
+
+// the rows of one word, x and y point to the first row of the word
+// X has to be zero already since the first row of a word is all zeros
+template<typename Index>
+void fill_word_examples(std::string_view word,int block_size,const Vocabulary& vocab,Index* x,Index* y)
+{
+    vocab.encode(word,std::span<Index>(y,word.size()));
+    for(std::size_t k = 1;k < word.size();k++)
+    {
+        // the previous row shifted left by one with the previous character appended
+        Index* row = x + k * block_size;
+        std::copy(row - block_size + 1,row,row);
+        row[block_size - 1] = y[k - 1];
+    }
+}
+
+// same examples as build_dataset, but a prefix sum over the word lengths
+// gives every word its slice of X and Y up front, so there is exactly one
+// allocation for X and one for Y and the words can be filled in parallel.
+// The slices do not overlap, so the result is the same for any number of threads
+template<typename Index = int32_t,typename Words>
+FlatDataset<Index> build_flat_dataset(const Words& words,int block_size,const Vocabulary& vocab)
+{
+    FlatDataset<Index> dataset;
+    dataset.block_size = block_size;
+    dataset.word_offsets.resize(words.size() + 1);
+    dataset.word_offsets[0] = 0;
+    for(std::size_t w = 0;w < words.size();w++)
+    {
+        dataset.word_offsets[w + 1] = dataset.word_offsets[w] + std::string_view(words[w]).size();
+    }
+    dataset.size = dataset.word_offsets.back();
+    dataset.X.assign(dataset.size * block_size,Index{0});
+    dataset.Y.resize(dataset.size);
+
+    Parallel::parallel_for(0,words.size(),4096,[&](std::size_t lo,std::size_t hi){
+        for(std::size_t w = lo;w < hi;w++)
+        {
+            std::size_t offset = dataset.word_offsets[w];
+            fill_word_examples(std::string_view(words[w]),block_size,vocab,
+                dataset.X.data() + offset * block_size,dataset.Y.data() + offset);
+        }
+    });
+    return dataset;
+}
+
+template<typename Index = int32_t,typename Words>
+FlatDataset<Index> build_flat_dataset(const Words& words,int block_size,const std::map<char,int>& encoder)
+{
+    return build_flat_dataset<Index>(words,block_size,Vocabulary::from_map(encoder));
+}
+
+// A split of a flat dataset into sets of words, without copying any rows
+// the words of a split are stored as runs of consecutive examples: where the
+// run starts in the flat dataset and how many examples of the split come
+// before it. Row i is found with a binary search over the runs, neighbouring
+// words which are also neighbours in the dataset share one run
+template<typename Index = int32_t>
+class DatasetSplit
+{
+    struct Runs
+    {
+        std::vector<std::size_t> start;  // first example of the run in the dataset
+        std::vector<std::size_t> before; // examples of the split before the run, ends with size
+    };
+
+    const Index* X_ = nullptr;
+    const Index* Y_ = nullptr;
+    std::shared_ptr<const Runs> runs;
+
+    std::size_t locate(std::size_t i) const
+    {
+        // a row past the end (any row of an empty split) has no run to look in
+        if(i >= size)
+        {
+            throw std::out_of_range("Row " + std::to_string(i) + " of a split of " + std::to_string(size) + " rows");
+        }
+        const auto& before = runs->before;
+        std::size_t run = std::upper_bound(before.begin(),before.end() - 1,i) - before.begin() - 1;
+        return runs->start[run] + (i - before[run]);
+    }
+
+    public:
+        std::size_t size = 0;
+        int block_size = 0;
+
+        DatasetSplit() = default;
+
+        // word_offsets[w] is the first example of word w, words are the
+        // ids of the words in the split
+        DatasetSplit(DatasetView<Index> data,std::span<const std::size_t> word_offsets,
+            std::span<const std::size_t> words)
+            : X_(data.X),Y_(data.Y),block_size(data.block_size)
+        {
+            auto built = std::make_shared<Runs>();
+            for(std::size_t w : words)
+            {
+                std::size_t first = word_offsets[w];
+                std::size_t count = word_offsets[w + 1] - first;
+                if(count == 0) continue;
+                if(built->start.empty() || built->start.back() + (size - built->before.back()) != first)
+                {
+                    built->start.push_back(first);
+                    built->before.push_back(size);
+                }
+                size += count;
+            }
+            built->before.push_back(size);
+            runs = std::move(built);
+        }
+
+        const Index* row(std::size_t i) const { return X_ + locate(i) * block_size; }
+        Index target(std::size_t i) const { return Y_[locate(i)]; }
+        std::size_t runs_count() const { return runs ? runs->start.size() : 0; }
+};
+
+// Shuffles a permutation of the word ids once and hands out the splits as
+// ranges of it, so there is one copy of the examples however many splits or
+// folds are used. The permutation is the same one std::shuffle with the seed
+// gave the words in the training script, so the splits contain the same words
+template<typename Index = int32_t>
+class DatasetSplitter
+{
+    DatasetView<Index> data;
+    std::vector<std::size_t> word_offsets;
+    std::vector<std::size_t> order;
+
+    public:
+        DatasetSplitter(DatasetView<Index> data,std::span<const std::size_t> word_offsets,uint64_t seed = 42)
+            : data(data),word_offsets(word_offsets.begin(),word_offsets.end())
+        {
+            if(word_offsets.empty() || word_offsets.back() != data.size)
+            {
+                throw std::runtime_error("Word offsets do not match the dataset");
+            }
+            order.resize(word_offsets.size() - 1);
+            for(std::size_t w = 0;w < order.size();w++)
+            {
+                order[w] = w;
+            }
+            std::mt19937 rng(static_cast<std::mt19937::result_type>(seed));
+            std::shuffle(order.begin(),order.end(),rng);
+        }
+
+        DatasetSplitter(const FlatDataset<Index>& dataset,uint64_t seed = 42)
+            : DatasetSplitter(dataset.view(),dataset.word_offsets,seed)
+        {
+        }
+
+        std::size_t words() const { return order.size(); }
+
+        // the words order[begin] up to order[end - 1]
+        DatasetSplit<Index> range(std::size_t begin,std::size_t end) const
+        {
+            end = std::min(end,order.size());
+            begin = std::min(begin,end);
+            return DatasetSplit<Index>(data,word_offsets,std::span<const std::size_t>(order).subspan(begin,end - begin));
+        }
+
+        // fractions of the shuffled words, 0.8 and 0.9 give the dev set like the script did
+        DatasetSplit<Index> fraction(double from,double to) const
+        {
+            return range(static_cast<std::size_t>(from * order.size()),static_cast<std::size_t>(to * order.size()));
+        }
+
+        // train, dev and test
+        std::array<DatasetSplit<Index>,3> train_dev_test(double train = 0.8,double dev = 0.1) const
+        {
+            return {fraction(0.0,train),fraction(train,train + dev),fraction(train + dev,1.0)};
+        }
+
+        // k-fold cross validation, fold i is held out and the other folds are trained on
+        std::pair<DatasetSplit<Index>,DatasetSplit<Index>> fold(int k,int i) const
+        {
+            if(k < 2 || i < 0 || i >= k)
+            {
+                throw std::runtime_error("Fold " + std::to_string(i) + " of " + std::to_string(k) + " does not exist");
+            }
+            std::size_t begin = order.size() * i / k;
+            std::size_t end = order.size() * (i + 1) / k;
+            std::vector<std::size_t> rest(order.begin(),order.begin() + begin);
+            rest.insert(rest.end(),order.begin() + end,order.end());
+            return {DatasetSplit<Index>(data,word_offsets,rest),range(begin,end)};
+        }
+};
+
+// xoshiro256** seeded through splitmix64, a lot faster than std::mt19937
+// and with a much smaller state, good enough for sampling batches
+class FastRng
+{
+    uint64_t state[4];
+
+    static uint64_t rotl(uint64_t x,int k) { return (x << k) | (x >> (64 - k)); }
+
+    public:
+        explicit FastRng(uint64_t seed = 42)
+        {
+            for(auto& s : state)
+            {
+                seed += 0x9E3779B97F4A7C15ull;
+                uint64_t z = seed;
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+                s = z ^ (z >> 31);
+            }
+        }
+
+        uint64_t next()
+        {
+            uint64_t result = rotl(state[1] * 5,7) * 9;
+            uint64_t t = state[1] << 17;
+            state[2] ^= state[0];
+            state[3] ^= state[1];
+            state[1] ^= state[2];
+            state[0] ^= state[3];
+            state[2] ^= t;
+            state[3] = rotl(state[3],45);
+            return result;
+        }
+
+        // number in [0, n) by a multiply and a shift instead of a division
+        uint64_t uniform(uint64_t n)
+        {
+            return static_cast<uint64_t>((static_cast<unsigned __int128>(next()) * n) >> 64);
+        }
+};
+
+// one minibatch, the buffers are allocated once and filled again for every batch
+template<typename Index = int32_t>
+struct Batch
+{
+    std::vector<Index> X; // size x block_size
+    std::vector<Index> Y;
+    std::size_t size = 0;
+    int block_size = 0;
+    uint64_t number = 0;  // how many batches came before this one
+    uint64_t epoch = 0;
+
+    const Index* row(std::size_t i) const { return X.data() + i * block_size; }
+};
+
+// fills batches on a background thread, `depth` batches ahead of the consumer
+// the batches live in a ring of depth + 1 slots which are reused, next()
+// hands out one slot and takes it back on the following call
+template<typename Index = int32_t>
+class Prefetcher
+{
+    public:
+        using Fill = std::function<void(Batch<Index>&)>;
+
+        struct Stats
+        {
+            uint64_t batches = 0;
+            double fill_seconds = 0.0; // time the background thread spent filling
+            double wait_seconds = 0.0; // time next() had to wait for a batch
+        };
+
+    private:
+        Fill fill;
+        std::vector<Batch<Index>> slots;
+        std::deque<std::size_t> ready;
+        std::deque<std::size_t> free;
+        std::size_t in_use;
+        bool has_in_use = false;
+        bool stopping = false;
+        std::exception_ptr error; // thrown by fill, rethrown by next()
+        std::mutex mutex;
+        std::condition_variable ready_cv;
+        std::condition_variable free_cv;
+        Stats stats_;
+        std::thread worker;
+
+        void run()
+        {
+            while(true)
+            {
+                std::size_t slot;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    free_cv.wait(lock,[this](){ return stopping || !free.empty(); });
+                    if(stopping) return;
+                    slot = free.front();
+                    free.pop_front();
+                }
+                auto start = std::chrono::steady_clock::now();
+                try
+                {
+                    fill(slots[slot]);
+                }
+                catch(...)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        error = std::current_exception();
+                    }
+                    ready_cv.notify_one();
+                    return;
+                }
+                std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ready.push_back(slot);
+                    stats_.fill_seconds += took.count();
+                }
+                ready_cv.notify_one();
+            }
+        }
+
+    public:
+        Prefetcher(Fill fill,std::size_t batch_size,int block_size,std::size_t depth)
+            : fill(std::move(fill)),slots(std::max<std::size_t>(depth,1) + 1)
+        {
+            for(std::size_t i = 0;i < slots.size();i++)
+            {
+                slots[i].X.resize(batch_size * block_size);
+                slots[i].Y.resize(batch_size);
+                slots[i].size = batch_size;
+                slots[i].block_size = block_size;
+                free.push_back(i);
+            }
+            worker = std::thread(&Prefetcher::run,this);
+        }
+
+        Prefetcher(const Prefetcher&) = delete;
+        Prefetcher& operator=(const Prefetcher&) = delete;
+
+        ~Prefetcher()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            free_cv.notify_all();
+            worker.join();
+        }
+
+        // the batch stays valid until the next call
+        const Batch<Index>& next()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if(has_in_use)
+            {
+                free.push_back(in_use);
+                free_cv.notify_one();
+            }
+            auto start = std::chrono::steady_clock::now();
+            ready_cv.wait(lock,[this](){ return !ready.empty() || error; });
+            if(ready.empty())
+            {
+                has_in_use = false;
+                std::rethrow_exception(error);
+            }
+            std::chrono::duration<double> waited = std::chrono::steady_clock::now() - start;
+            stats_.wait_seconds += waited.count();
+            stats_.batches++;
+            in_use = ready.front();
+            ready.pop_front();
+            has_in_use = true;
+            return slots[in_use];
+        }
+
+        Stats stats()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return stats_;
+        }
+};
+
+// Minibatch sampler over a dataset view
+// RANDOM draws every row independently (like torch.randint over the training
+// set), EPOCH walks through a shuffled permutation of the row indices so every
+// row is seen once per epoch, the dataset itself is never copied or reordered.
+// The batches are gathered on a background thread while the training loop runs
+template<typename View,typename Index = int32_t>
+class DataLoader
+{
+    public:
+        enum class Sampling { RANDOM, EPOCH };
+        using Stats = typename Prefetcher<Index>::Stats;
+
+    private:
+        View view;
+        Sampling sampling;
+        FastRng rng;
+        std::vector<std::size_t> permutation;
+        std::size_t position = 0;
+        uint64_t epoch = 0;
+        uint64_t number = 0;
+        Prefetcher<Index> prefetcher; // last, so it starts after everything else is ready
+
+        std::size_t next_row()
+        {
+            if(sampling == Sampling::RANDOM)
+            {
+                return static_cast<std::size_t>(rng.uniform(view.size));
+            }
+            if(position == permutation.size())
+            {
+                shuffle(permutation,rng);
+                position = 0;
+                epoch++;
+            }
+            return permutation[position++];
+        }
+
+        // a batch of an empty view has no row to draw, checked before the
+        // background thread starts filling batches
+        static View non_empty(View view)
+        {
+            if(view.size == 0)
+            {
+                throw std::runtime_error("DataLoader needs a view with at least one row");
+            }
+            return view;
+        }
+
+        // the identity in shuffled order, built before the background thread starts
+        static std::vector<std::size_t> first_permutation(std::size_t n,FastRng& rng)
+        {
+            std::vector<std::size_t> order(n);
+            for(std::size_t i = 0;i < n;i++)
+            {
+                order[i] = i;
+            }
+            shuffle(order,rng);
+            return order;
+        }
+
+        // Fisher-Yates with the fast generator
+        static void shuffle(std::vector<std::size_t>& order,FastRng& rng)
+        {
+            for(std::size_t i = order.size();i > 1;i--)
+            {
+                std::swap(order[i - 1],order[rng.uniform(i)]);
+            }
+        }
+
+        void fill(Batch<Index>& batch)
+        {
+            int block_size = view.block_size;
+            for(std::size_t b = 0;b < batch.size;b++)
+            {
+                std::size_t i = next_row();
+                const auto* row = view.row(i);
+                std::copy(row,row + block_size,batch.X.data() + b * block_size);
+                batch.Y[b] = static_cast<Index>(view.target(i));
+            }
+            batch.number = number++;
+            batch.epoch = epoch;
+        }
+
+    public:
+        DataLoader(View view,std::size_t batch_size,uint64_t seed = 42,
+            Sampling sampling = Sampling::RANDOM,std::size_t prefetch = 2)
+            : view(non_empty(view)),sampling(sampling),rng(seed),
+              permutation(sampling == Sampling::EPOCH ? first_permutation(view.size,rng) : std::vector<std::size_t>()),
+              prefetcher([this](Batch<Index>& batch){ fill(batch); },batch_size,view.block_size,prefetch)
+        {
+        }
 
+        const Batch<Index>& next() { return prefetcher.next(); }
+        Stats stats() { return prefetcher.stats(); }
+};
 
+#endif
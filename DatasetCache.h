@@ -0,0 +1,248 @@
+#ifndef DATASET_CACHE_H
+#define DATASET_CACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "DataLoader.h"
+#include "Vocabulary.h"
+#include "Logger.h"
+
+// Binary cache of the flat dataset of the corpus
+//
+// the file is a header followed by X, Y and the word offsets of the whole
+// corpus, each array starts on a 64 byte boundary. Loading maps the file and
+// points the dataset straight into the mapping, so nothing is parsed or copied.
+// The train / dev / test splits are views over the words of this one dataset,
+// so the split seed is not part of the file.
+// The cache is only used if the version, the parameters and the source file
+// (size, modification time and checksum) are the same as when it was written,
+// otherwise the dataset is built from the source and the cache is rewritten
+struct DatasetFileHeader
+{
+    static constexpr char expected_magic[8] = {'N','A','M','E','S','D','S','\0'};
+    static constexpr uint32_t current_version = 2;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t index_bytes;  // sizeof the index type of X and Y
+    int32_t block_size;
+    int32_t vocab_size;
+    char vocab[256];       // characters in id order
+    uint64_t source_size;
+    int64_t source_mtime_ns;
+    uint64_t source_checksum;
+    uint64_t examples;
+    uint64_t words;
+    uint64_t x_offset;     // byte offsets of the arrays
+    uint64_t y_offset;
+    uint64_t word_offsets_offset;
+};
+
+static_assert(sizeof(std::size_t) == sizeof(uint64_t),"The word offsets are stored as 64 bit numbers");
+
+// FNV-1a over 8 bytes at a time, good enough to notice a changed corpus
+inline uint64_t corpus_checksum(std::string_view text)
+{
+    uint64_t hash = 14695981039346656037ull;
+    std::size_t i = 0;
+    for(;i + 8 <= text.size();i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word,text.data() + i,8);
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for(;i < text.size();i++)
+    {
+        hash = (hash ^ static_cast<unsigned char>(text[i])) * 1099511628211ull;
+    }
+    return hash ^ text.size();
+}
+
+template<typename Index = int32_t>
+class CachedDataset
+{
+    MappedFile file;
+    Vocabulary vocab_;
+    DatasetView<Index> data;
+    std::span<const std::size_t> word_offsets_;
+    std::unique_ptr<DatasetSplitter<Index>> splitter_;
+    DatasetSplit<Index> splits[3];
+    bool from_cache_ = false;
+
+    static constexpr std::size_t align_up(std::size_t n)
+    {
+        return (n + 63) & ~std::size_t{63};
+    }
+
+    static bool source_stat(const std::string& path,uint64_t& size,int64_t& mtime_ns)
+    {
+        struct stat info{};
+        if(::stat(path.c_str(),&info) != 0) return false;
+        size = static_cast<uint64_t>(info.st_size);
+        mtime_ns = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000ll + info.st_mtim.tv_nsec;
+        return true;
+    }
+
+    // true if the mapped file is a cache of the source for these parameters
+    static bool matches(const MappedFile& file,const std::string& source_path,int block_size)
+    {
+        if(file.size() < sizeof(DatasetFileHeader)) return false;
+        DatasetFileHeader header;
+        std::memcpy(&header,file.data(),sizeof(header));
+        if(std::memcmp(header.magic,DatasetFileHeader::expected_magic,8) != 0) return false;
+        if(header.version != DatasetFileHeader::current_version) return false;
+        if(header.index_bytes != sizeof(Index) || header.block_size != block_size) return false;
+
+        uint64_t size = 0;
+        int64_t mtime_ns = 0;
+        if(!source_stat(source_path,size,mtime_ns) || size != header.source_size) return false;
+        if(mtime_ns != header.source_mtime_ns)
+        {
+            // touched but maybe not changed, only the checksum can tell
+            MappedFile source(source_path);
+            if(corpus_checksum(source.view()) != header.source_checksum) return false;
+        }
+
+        if(header.x_offset + header.examples * block_size * sizeof(Index) > file.size()) return false;
+        if(header.y_offset + header.examples * sizeof(Index) > file.size()) return false;
+        if(header.word_offsets_offset + (header.words + 1) * sizeof(uint64_t) > file.size()) return false;
+        return true;
+    }
+
+    void attach(uint64_t seed)
+    {
+        DatasetFileHeader header;
+        std::memcpy(&header,file.data(),sizeof(header));
+        vocab_ = Vocabulary::from_chars(std::string_view(header.vocab,header.vocab_size));
+        data.X = reinterpret_cast<const Index*>(file.data() + header.x_offset);
+        data.Y = reinterpret_cast<const Index*>(file.data() + header.y_offset);
+        data.size = header.examples;
+        data.block_size = header.block_size;
+        word_offsets_ = std::span<const std::size_t>(
+            reinterpret_cast<const std::size_t*>(file.data() + header.word_offsets_offset),header.words + 1);
+        splitter_ = std::make_unique<DatasetSplitter<Index>>(data,word_offsets_,seed);
+        auto parts = splitter_->train_dev_test();
+        for(int s = 0;s < 3;s++)
+        {
+            splits[s] = parts[s];
+        }
+    }
+
+    // builds the dataset of all the words of the source in file order
+    static void build(const std::string& source_path,const std::string& cache_path,int block_size)
+    {
+        MappedCorpus corpus(source_path);
+        Vocabulary vocab = Vocabulary::from_text(corpus.text());
+        if(sizeof(Index) == 1 && vocab.size() > 256)
+        {
+            throw std::runtime_error("Vocabulary does not fit in the index type");
+        }
+
+        FlatDataset<Index> dataset = build_flat_dataset<Index>(corpus.lines(),block_size,vocab);
+
+        DatasetFileHeader header{};
+        std::memcpy(header.magic,DatasetFileHeader::expected_magic,8);
+        header.version = DatasetFileHeader::current_version;
+        header.index_bytes = sizeof(Index);
+        header.block_size = block_size;
+        header.vocab_size = vocab.size();
+        std::string chars = vocab.chars();
+        std::memcpy(header.vocab,chars.data(),chars.size());
+        source_stat(source_path,header.source_size,header.source_mtime_ns);
+        header.source_checksum = corpus_checksum(corpus.text());
+
+        header.examples = dataset.size;
+        header.words = dataset.words();
+        header.x_offset = align_up(sizeof(DatasetFileHeader));
+        header.y_offset = align_up(header.x_offset + dataset.X.size() * sizeof(Index));
+        header.word_offsets_offset = align_up(header.y_offset + dataset.Y.size() * sizeof(Index));
+
+        // written next to the cache and renamed, so a reader never sees half a file
+        std::string tmp_path = cache_path + ".tmp";
+        {
+            std::ofstream out(tmp_path,std::ios::binary | std::ios::trunc);
+            if(!out)
+            {
+                throw std::runtime_error("Failed to write " + tmp_path);
+            }
+            const char zeros[64] = {};
+            std::size_t written = 0;
+            auto write = [&](const void* data,std::size_t bytes){
+                out.write(static_cast<const char*>(data),static_cast<std::streamsize>(bytes));
+                written += bytes;
+            };
+            auto pad_to = [&](std::size_t position){
+                write(zeros,position - written);
+            };
+            write(&header,sizeof(header));
+            pad_to(header.x_offset);
+            write(dataset.X.data(),dataset.X.size() * sizeof(Index));
+            pad_to(header.y_offset);
+            write(dataset.Y.data(),dataset.Y.size() * sizeof(Index));
+            pad_to(header.word_offsets_offset);
+            write(dataset.word_offsets.data(),dataset.word_offsets.size() * sizeof(std::size_t));
+            if(!out)
+            {
+                throw std::runtime_error("Failed to write " + tmp_path);
+            }
+        }
+        if(std::rename(tmp_path.c_str(),cache_path.c_str()) != 0)
+        {
+            throw std::runtime_error("Failed to move " + tmp_path + " to " + cache_path);
+        }
+    }
+
+    CachedDataset(MappedFile file,bool from_cache,uint64_t seed) : file(std::move(file)),from_cache_(from_cache)
+    {
+        attach(seed);
+    }
+
+    public:
+        static CachedDataset load_or_build(const std::string& source_path,const std::string& cache_path,
+            int block_size,uint64_t seed)
+        {
+            try
+            {
+                MappedFile cached(cache_path);
+                if(matches(cached,source_path,block_size))
+                {
+                    Logger::info("Loaded the dataset from " + cache_path);
+                    return CachedDataset(std::move(cached),true,seed);
+                }
+            }
+            catch(const std::exception& e)
+            {
+                // no cache yet or it can not be read, build it below
+                Logger::info(std::string("Dataset cache not used: ") + e.what());
+            }
+
+            build(source_path,cache_path,block_size);
+            Logger::info("Built the dataset cache " + cache_path);
+            return CachedDataset(MappedFile(cache_path),false,seed);
+        }
+
+        const Vocabulary& vocab() const { return vocab_; }
+        bool from_cache() const { return from_cache_; }
+        int block_size() const { return data.block_size; }
+
+        // every example of the corpus, words in file order
+        DatasetView<Index> dataset() const { return data; }
+        std::span<const std::size_t> word_offsets() const { return word_offsets_; }
+        // for other splits or folds over the same words
+        const DatasetSplitter<Index>& splitter() const { return *splitter_; }
+
+        DatasetSplit<Index> train() const { return splits[0]; }
+        DatasetSplit<Index> dev() const { return splits[1]; }
+        DatasetSplit<Index> test() const { return splits[2]; }
+};
+
+#endif
@@ -0,0 +1,329 @@
+#ifndef EXPRESSION_H
+#define EXPRESSION_H
+
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include "Tensor.h"
+
+// Expression templates for scalar tensor arithmetic
+//
+// every op of Tensor creates a node with its own closure, so
+// (a * b + c).tanh() is three nodes of which only the last is needed. An
+// expression started with expr() is not evaluated op by op, its type records
+// the whole computation and converting it to a tensor creates one node whose
+// forward is the composed computation and whose backward is the composed
+// derivative (chain rule over the tree, unrolled by the compiler)
+//
+//     Tensor d = (expr(a) * b + c).tanh();    // one node with prev {a, b, c}
+//     Tensor e = expr(x).exp() / 2.0f + 1.0f; // numbers are constants of the tree
+//
+// the values of the intermediate steps are kept in the closure of the node
+// (a float each) instead of in nodes of their own. Tensors in an expression
+// are its leaves and are shared, an expression does not copy them. Tensor op
+// Tensor is still evaluated right away, one operand has to be an expression
+namespace expression
+{
+    // a tensor of the expression, owner goes to prev of the fused node
+    template<typename S>
+    struct Leaf
+    {
+        using scalar = S;
+        using compute_type = accumulate_t<S>;
+
+        std::shared_ptr<BasicImpl<S>> owner;
+        BasicImpl<S>* node;
+        compute_type value{};
+
+        void forward() { value = node->val(); }
+        void backward(compute_type g) const { node->accumulate(g); }
+        void release(std::vector<std::shared_ptr<BasicImpl<S>>>& prev) { prev.push_back(std::move(owner)); }
+    };
+
+    // a number, it has no gradient
+    template<typename S>
+    struct Constant
+    {
+        using scalar = S;
+        using compute_type = accumulate_t<S>;
+
+        compute_type value;
+
+        void forward() {}
+        void backward(compute_type) const {}
+        void release(std::vector<std::shared_ptr<BasicImpl<S>>>&) {}
+    };
+
+    // out is the value of the op, some derivatives are cheaper with it
+    struct Add
+    {
+        template<typename T> static T forward(T a,T b) { return a + b; }
+        template<typename T> static T left(T g,T,T,T) { return g; }
+        template<typename T> static T right(T g,T,T,T) { return g; }
+    };
+
+    struct Sub
+    {
+        template<typename T> static T forward(T a,T b) { return a - b; }
+        template<typename T> static T left(T g,T,T,T) { return g; }
+        template<typename T> static T right(T g,T,T,T) { return -g; }
+    };
+
+    struct Mul
+    {
+        template<typename T> static T forward(T a,T b) { return a * b; }
+        template<typename T> static T left(T g,T,T b,T) { return g * b; }
+        template<typename T> static T right(T g,T a,T,T) { return g * a; }
+    };
+
+    struct Div
+    {
+        template<typename T> static T forward(T a,T b) { return a / b; }
+        template<typename T> static T left(T g,T,T b,T) { return g / b; }
+        template<typename T> static T right(T g,T,T b,T out) { return -g * out / b; }
+    };
+
+    struct Neg
+    {
+        template<typename T> T forward(T x) const { return -x; }
+        template<typename T> T derivative(T g,T,T) const { return -g; }
+    };
+
+    struct Tanh
+    {
+        template<typename T> T forward(T x) const { return std::tanh(x); }
+        template<typename T> T derivative(T g,T,T out) const { return g * (T(1) - out * out); }
+    };
+
+    struct Sigmoid
+    {
+        template<typename T> T forward(T x) const { return T(1) / (T(1) + std::exp(-x)); }
+        template<typename T> T derivative(T g,T,T out) const { return g * out * (T(1) - out); }
+    };
+
+    struct Exp
+    {
+        template<typename T> T forward(T x) const { return std::exp(x); }
+        template<typename T> T derivative(T g,T,T out) const { return g * out; }
+    };
+
+    struct Log
+    {
+        template<typename T> T forward(T x) const { return std::log(x); }
+        template<typename T> T derivative(T g,T x,T) const { return g / x; }
+    };
+
+    struct Sqrt
+    {
+        template<typename T> T forward(T x) const { return std::sqrt(x); }
+        template<typename T> T derivative(T g,T,T out) const { return g * T(0.5) / out; }
+    };
+
+    struct Pow
+    {
+        int n;
+        template<typename T> T forward(T x) const { return static_cast<T>(std::pow(x,n)); }
+        template<typename T> T derivative(T g,T x,T) const { return g * n * static_cast<T>(std::pow(x,n - 1)); }
+    };
+
+    template<typename Op,typename L,typename R>
+    struct Binary
+    {
+        static_assert(std::is_same_v<typename L::scalar,typename R::scalar>,
+            "the tensors of an expression need the same element type");
+        using scalar = typename L::scalar;
+        using compute_type = accumulate_t<scalar>;
+
+        L l;
+        R r;
+        compute_type value{};
+
+        void forward()
+        {
+            l.forward();
+            r.forward();
+            value = Op::forward(l.value,r.value);
+        }
+
+        void backward(compute_type g) const
+        {
+            l.backward(Op::left(g,l.value,r.value,value));
+            r.backward(Op::right(g,l.value,r.value,value));
+        }
+
+        void release(std::vector<std::shared_ptr<BasicImpl<scalar>>>& prev)
+        {
+            l.release(prev);
+            r.release(prev);
+        }
+    };
+
+    template<typename Op,typename E>
+    struct Unary
+    {
+        using scalar = typename E::scalar;
+        using compute_type = accumulate_t<scalar>;
+
+        [[no_unique_address]] Op op;
+        E e;
+        compute_type value{};
+
+        void forward()
+        {
+            e.forward();
+            value = op.forward(e.value);
+        }
+
+        void backward(compute_type g) const
+        {
+            e.backward(op.derivative(g,e.value,value));
+        }
+
+        void release(std::vector<std::shared_ptr<BasicImpl<scalar>>>& prev)
+        {
+            e.release(prev);
+        }
+    };
+}
+
+template<typename E>
+class Expr;
+
+template<typename T>
+struct is_expr : std::false_type {};
+
+template<typename E>
+struct is_expr<Expr<E>> : std::true_type {};
+
+template<typename T>
+inline constexpr bool is_expr_v = is_expr<T>::value;
+
+template<typename E>
+class Expr
+{
+    public:
+        using scalar = typename E::scalar;
+        using compute_type = accumulate_t<scalar>;
+
+        E tree;
+
+        explicit Expr(E tree) : tree(std::move(tree)) {}
+
+        // a tensor as the leaf of an expression
+        static Expr<expression::Leaf<scalar>> leaf(const BasicTensor<scalar>& tensor)
+        {
+            return Expr<expression::Leaf<scalar>>({tensor.impl,tensor.impl.get()});
+        }
+
+        // one node for the whole expression
+        BasicTensor<scalar> eval() const
+        {
+            ProfileOp profile("fused");
+            BasicTensor<scalar> out{};
+            try
+            {
+                E fused = tree;
+                fused.forward();
+                out.impl->val() = static_cast<scalar>(fused.value);
+                // the leaves go to prev, the closure keeps their plain pointers
+                // and the values of the steps in between
+                fused.release(out.impl->prev);
+                out.impl->set_backward([fused = std::move(fused),out_impl = out.impl.get()](){
+                    fused.backward(out_impl->grad());
+                });
+                Logger::info("Successfully evaluated a fused expression");
+            }
+            catch(const std::exception& e)
+            {
+                Logger::error(std::string(e.what()));
+                std::cerr << e.what() << std::endl;
+            }
+            catch(...)
+            {
+                Logger::error("Error while evaluating a fused expression");
+                std::cerr << "Error while evaluating a fused expression" << std::endl;
+            }
+            return out;
+        }
+
+        operator BasicTensor<scalar>() const { return eval(); }
+
+        template<typename Op>
+        Expr<expression::Unary<Op,E>> apply(Op op = {}) const
+        {
+            return Expr<expression::Unary<Op,E>>({op,tree});
+        }
+
+        Expr<expression::Unary<expression::Neg,E>> operator-() const { return apply<expression::Neg>(); }
+        Expr<expression::Unary<expression::Tanh,E>> tanh() const { return apply<expression::Tanh>(); }
+        Expr<expression::Unary<expression::Sigmoid,E>> sigmoid() const { return apply<expression::Sigmoid>(); }
+        Expr<expression::Unary<expression::Exp,E>> exp() const { return apply<expression::Exp>(); }
+        Expr<expression::Unary<expression::Log,E>> log() const { return apply<expression::Log>(); }
+        Expr<expression::Unary<expression::Sqrt,E>> sqrt() const { return apply<expression::Sqrt>(); }
+        Expr<expression::Unary<expression::Pow,E>> pow(int n) const { return apply(expression::Pow{n}); }
+};
+
+// the start of an expression, expr(a) * b + c
+template<typename S>
+Expr<expression::Leaf<S>> expr(const BasicTensor<S>& tensor)
+{
+    return Expr<expression::Leaf<S>>::leaf(tensor);
+}
+
+namespace expression
+{
+    // the tree of an operand: an expression, a tensor (a leaf) or a number (a constant)
+    template<typename S,typename T>
+    auto operand(const T& value)
+    {
+        if constexpr(is_expr_v<T>)
+        {
+            return value.tree;
+        }
+        else if constexpr(is_tensor_v<T>)
+        {
+            return Expr<Leaf<S>>::leaf(value).tree;
+        }
+        else
+        {
+            return Constant<S>{static_cast<accumulate_t<S>>(value)};
+        }
+    }
+
+    template<typename A,typename B>
+    struct scalar_of
+    {
+        using type = typename std::conditional_t<is_expr_v<A>,A,B>::scalar;
+    };
+
+    // at least one side is an expression, the other one an expression, a tensor or a number
+    template<typename A,typename B>
+    inline constexpr bool operands_v = (is_expr_v<A> || is_expr_v<B>)
+        && (is_expr_v<A> || is_tensor_v<A> || std::is_arithmetic_v<A>)
+        && (is_expr_v<B> || is_tensor_v<B> || std::is_arithmetic_v<B>);
+
+    template<typename Op,typename A,typename B>
+    auto combine(const A& a,const B& b)
+    {
+        using S = typename scalar_of<A,B>::type;
+        auto l = operand<S>(a);
+        auto r = operand<S>(b);
+        return Expr<Binary<Op,decltype(l),decltype(r)>>({std::move(l),std::move(r)});
+    }
+}
+
+template<typename A,typename B,typename = std::enable_if_t<expression::operands_v<std::decay_t<A>,std::decay_t<B>>>>
+auto operator+(const A& a,const B& b) { return expression::combine<expression::Add>(a,b); }
+
+template<typename A,typename B,typename = std::enable_if_t<expression::operands_v<std::decay_t<A>,std::decay_t<B>>>>
+auto operator-(const A& a,const B& b) { return expression::combine<expression::Sub>(a,b); }
+
+template<typename A,typename B,typename = std::enable_if_t<expression::operands_v<std::decay_t<A>,std::decay_t<B>>>>
+auto operator*(const A& a,const B& b) { return expression::combine<expression::Mul>(a,b); }
+
+template<typename A,typename B,typename = std::enable_if_t<expression::operands_v<std::decay_t<A>,std::decay_t<B>>>>
+auto operator/(const A& a,const B& b) { return expression::combine<expression::Div>(a,b); }
+
+#endif
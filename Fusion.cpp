@@ -0,0 +1,148 @@
+#include "Fusion.h"
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// a model of what backward (Tensor.cpp) keeps per scheduled node besides the
+// node itself, from the sizes of the elements: the entry of the visited set
+// and of the index of BackwardGraph (a hash node is a next pointer and the
+// value, plus a bucket), the topological order, edge_begin and deps. The
+// overhead of the allocator and of the hash tables' growth is not in it
+template<typename Node>
+static constexpr std::size_t engine_node_bytes()
+{
+    constexpr std::size_t hash_entry = 2 * sizeof(void*);
+    return hash_entry + sizeof(Node*)
+        + hash_entry + sizeof(std::pair<Node* const,std::size_t>)
+        + sizeof(std::shared_ptr<Node>)
+        + sizeof(std::size_t) + sizeof(std::atomic<int>);
+}
+
+// per edge: the prev entry (read by the walk and by BackwardGraph) and the index in edges
+template<typename Node>
+static constexpr std::size_t engine_edge_bytes()
+{
+    return 2 * sizeof(std::shared_ptr<Node>) + sizeof(std::size_t);
+}
+
+FusionReport& FusionReport::operator+=(const FusionReport& other)
+{
+    nodes_before += other.nodes_before;
+    nodes_after += other.nodes_after;
+    edges_before += other.edges_before;
+    edges_after += other.edges_after;
+    chains += other.chains;
+    traffic_before += other.traffic_before;
+    traffic_after += other.traffic_after;
+    return *this;
+}
+
+std::string FusionReport::format() const
+{
+    double saved = traffic_before == 0 ? 0.0 : 100.0 * (1.0 - static_cast<double>(traffic_after) / traffic_before);
+    char line[256];
+    std::snprintf(line,sizeof(line),
+        "fusion: nodes %zu -> %zu (%zu chains), edges %zu -> %zu, estimated backward graph traffic %.2f MB -> %.2f MB (-%.1f%%)",
+        nodes_before,nodes_after,chains,edges_before,edges_after,traffic_before / 1e6,traffic_after / 1e6,saved);
+    return line;
+}
+
+template<typename S>
+FusionReport Fusion::run(const BasicTensor<S>& root)
+{
+    using Node = BasicImpl<S>;
+    ProfileScope scope("fusion");
+    // set_backward would fold the rewired nodes with the grad mode off
+    GradModeScope grad_mode(true);
+    FusionReport report;
+
+    // the nodes which stay in the graph, each one is visited once
+    std::vector<Node*> heads{root.impl.get()};
+    std::unordered_set<Node*> visited;
+    while(!heads.empty())
+    {
+        Node* head = heads.back();
+        heads.pop_back();
+        report.nodes_before++;
+        report.edges_before += head->prev.size();
+
+        // the chain goes down from the head through the first input which is
+        // owned by nothing but its consumer (one consumer and no tensor outside
+        // the graph), the other inputs stay nodes of their own and start
+        // chains of their own, so the branches still run in parallel. A
+        // node comes after its consumer, that order is a topological order
+        std::vector<std::shared_ptr<Node>> prev = std::move(head->prev);
+        std::vector<std::shared_ptr<Node>> inputs;
+        inputs.reserve(prev.size());
+        std::vector<std::shared_ptr<Node>> chain;
+        while(true)
+        {
+            std::shared_ptr<Node> next;
+            for(auto& p : prev)
+            {
+                if(!next && head->backward_fn && p && p->backward_fn && p.use_count() == 1)
+                {
+                    next = std::move(p);
+                }
+                else
+                {
+                    inputs.push_back(std::move(p));
+                }
+            }
+            if(!next) break;
+            report.nodes_before++;
+            report.edges_before += next->prev.size();
+            prev = std::move(next->prev);
+            next->clear_prev();
+            chain.push_back(std::move(next));
+        }
+
+        head->prev = std::move(inputs);
+        for(const auto& p : head->prev)
+        {
+            // a node with one owner is reached through this edge only,
+            // only the shared ones have to be remembered
+            if(p && (p.use_count() == 1 || visited.insert(p.get()).second))
+            {
+                heads.push_back(p.get());
+            }
+        }
+        report.nodes_after++;
+        report.edges_after += head->prev.size();
+        if(chain.empty())
+        {
+            continue;
+        }
+        report.chains++;
+        // the closure owns the absorbed nodes, their gradients are written
+        // and read inside the chain, the profiler puts the time on the head
+        head->set_backward([own = std::move(head->backward_fn),chain = std::move(chain)](){
+            own();
+            for(const auto& node : chain)
+            {
+                node->backward_fn();
+            }
+        });
+    }
+
+    // make_shared puts the node and its two counts (plus a vtable pointer) in one block
+    std::size_t node_bytes = sizeof(Node) + 16;
+    report.traffic_before = report.nodes_before * (node_bytes + engine_node_bytes<Node>())
+        + report.edges_before * engine_edge_bytes<Node>();
+    report.traffic_after = report.nodes_before * node_bytes + report.nodes_after * engine_node_bytes<Node>()
+        + report.edges_after * engine_edge_bytes<Node>();
+    if(Profiler::enabled())
+    {
+        Profiler::record_fusion(report.nodes_before,report.nodes_after,report.traffic_before,report.traffic_after);
+    }
+    Logger::info("Fused " + std::to_string(report.nodes_before) + " nodes into " + std::to_string(report.nodes_after));
+    return report;
+}
+
+template FusionReport Fusion::run(const BasicTensor<float>&);
+template FusionReport Fusion::run(const BasicTensor<double>&);
+template FusionReport Fusion::run(const BasicTensor<bfloat16>&);
+template FusionReport Fusion::run(const BasicTensor<float16>&);
@@ -0,0 +1,54 @@
+#ifndef FUSION_H
+#define FUSION_H
+
+#include <cstddef>
+#include <string>
+#include "Tensor.h"
+
+// Fusion of the chains of a graph built by a forward pass
+//
+// an elementwise chain like (x - mean) / std * gamma + beta over a Matrix
+// gives four nodes per element, each of which is visited, sorted,
+// dependency counted and scheduled by backward on its own although only the
+// last one is used by anything else. After the forward pass (and before
+// backward) the pass walks the graph from the root and merges a node whose
+// only owner is its one consumer into that consumer: the consumer takes over
+// its prev and runs its backward_fn right after its own. A chain becomes one
+// node, one task and one pass over the graph in backward. Only chains are
+// merged, a node absorbs one of its inputs, so the branches of the graph
+// stay separate tasks of a parallel backward
+//
+//     Tensor loss = cross_entropy(model.forward(x),y);
+//     FusionReport report = Fusion::run(loss);
+//     loss.backward();
+//
+// a node is only absorbed if nothing else holds it: a tensor still held by
+// the caller, a node used twice or a leaf keeps its own node. The forward of
+// a scalar expression is fused by expr() (Expression.h), this pass fuses what
+// was built op by op. With the profiler on the savings show up in its report
+struct FusionReport
+{
+    std::size_t nodes_before = 0;
+    std::size_t nodes_after = 0;
+    std::size_t edges_before = 0;
+    std::size_t edges_after = 0;
+    std::size_t chains = 0;          // nodes which absorbed at least one other
+    // bytes of graph and engine state backward reads and writes, modelled
+    // from the element sizes (see Fusion.cpp) and not measured, the closures
+    // and the gradients are the same either way
+    std::size_t traffic_before = 0;
+    std::size_t traffic_after = 0;
+
+    FusionReport& operator+=(const FusionReport& other);
+    std::string format() const;
+};
+
+class Fusion
+{
+    public:
+        // merges the chains of everything reachable from root
+        template<typename S>
+        static FusionReport run(const BasicTensor<S>& root);
+};
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef GRAD_MODE_H
+#define GRAD_MODE_H
+
+#include <atomic>
+
+// Whether ops record the graph
+//
+// a node requires a gradient if it is a leaf which asks for one (the default,
+// BasicTensor::constant and requires_grad(false) make leaves which do not) or
+// if one of its inputs requires one. An op whose inputs are all constants is
+// folded: its output keeps the value but gets no prev and no backward, so a
+// constant-only subexpression never reaches the graph. With the grad mode off
+// every op is folded, like torch.no_grad
+//
+//     {
+//         NoGradScope no_grad;                  // evaluation, nothing to backpropagate
+//         loss = cross_entropy(mlp.forward(x),y);
+//     }
+//
+// the mode is one for the whole process so the tasks of the thread pool see
+// it as well, set it around a forward pass and not from several threads
+class GradMode
+{
+    static std::atomic<bool> enabled_;
+
+    public:
+        static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+        static bool exchange(bool enabled) { return enabled_.exchange(enabled,std::memory_order_relaxed); }
+};
+
+// the grad mode for the enclosing block
+class GradModeScope
+{
+    bool saved;
+
+    public:
+        explicit GradModeScope(bool enabled) : saved(GradMode::exchange(enabled)) {}
+        ~GradModeScope() { GradMode::exchange(saved); }
+
+        GradModeScope(const GradModeScope&) = delete;
+        GradModeScope& operator=(const GradModeScope&) = delete;
+};
+
+class NoGradScope : public GradModeScope
+{
+    public:
+        NoGradScope() : GradModeScope(false) {}
+};
+
+#endif
@@ -0,0 +1,89 @@
+#include "GraphMemory.h"
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+#include "Allocator.h"
+#include "Profiler.h"
+#include "Tensor.h"
+
+std::atomic<int64_t> GraphMemory::live_nodes_{0};
+std::atomic<int64_t> GraphMemory::peak_nodes_{0};
+std::atomic<uint64_t> GraphMemory::created_nodes_{0};
+std::atomic<int64_t> GraphMemory::live_edges_{0};
+std::atomic<int64_t> GraphMemory::closure_bytes_{0};
+bool GraphMemory::debug_ = false;
+bool GraphMemory::started_profiler_ = false;
+
+GraphMemory::Snapshot GraphMemory::snapshot()
+{
+    Snapshot s;
+    s.live_nodes = live_nodes_.load(std::memory_order_relaxed);
+    s.peak_nodes = std::max(peak_nodes_.load(std::memory_order_relaxed),s.live_nodes);
+    s.created_nodes = created_nodes_.load(std::memory_order_relaxed);
+    s.live_edges = live_edges_.load(std::memory_order_relaxed);
+    // make_shared puts the node and its two counts (plus a vtable pointer) in one block
+    s.node_bytes = static_cast<std::size_t>(std::max<int64_t>(s.live_nodes,0)) * (sizeof(Impl) + 16);
+    s.edge_bytes = static_cast<std::size_t>(std::max<int64_t>(s.live_edges,0)) * sizeof(std::shared_ptr<Impl>);
+    s.closure_bytes = static_cast<std::size_t>(std::max<int64_t>(closure_bytes_.load(std::memory_order_relaxed),0));
+    CachingAllocator::Stats stats = CachingAllocator::stats();
+    s.buffer_bytes = stats.bytes_in_use;
+    s.peak_buffer_bytes = stats.peak_bytes_in_use;
+    return s;
+}
+
+std::string GraphMemory::Snapshot::format() const
+{
+    char line[256];
+    std::snprintf(line,sizeof(line),
+        "nodes %lld (peak %lld), edges %lld, graph %.2f MB (nodes %.2f, edges %.2f, closures %.2f), buffers %.2f MB (peak %.2f)",
+        static_cast<long long>(live_nodes),static_cast<long long>(peak_nodes),static_cast<long long>(live_edges),
+        graph_bytes() / 1e6,node_bytes / 1e6,edge_bytes / 1e6,closure_bytes / 1e6,
+        buffer_bytes / 1e6,peak_buffer_bytes / 1e6);
+    return line;
+}
+
+void GraphMemory::reset_peak()
+{
+    peak_nodes_.store(live_nodes_.load(std::memory_order_relaxed),std::memory_order_relaxed);
+    // the allocator keeps its own high-water mark, its counters start again as well
+    CachingAllocator::reset_stats();
+}
+
+void GraphMemory::set_debug(bool on)
+{
+    if(on && !Profiler::enabled())
+    {
+        Profiler::start();
+        started_profiler_ = true;
+    }
+    else if(!on && started_profiler_)
+    {
+        Profiler::stop();
+        started_profiler_ = false;
+    }
+    debug_ = on;
+}
+
+std::string GraphMemory::dump(std::size_t top)
+{
+    if(!debug_) return "";
+    std::vector<Profiler::Row> rows = Profiler::rows();
+    rows.erase(std::remove_if(rows.begin(),rows.end(),[](const Profiler::Row& row){
+        return row.live_nodes <= 0;
+    }),rows.end());
+    std::sort(rows.begin(),rows.end(),[](const Profiler::Row& a,const Profiler::Row& b){
+        return a.live_nodes > b.live_nodes;
+    });
+
+    std::string out;
+    char line[160];
+    std::snprintf(line,sizeof(line),"%-22s %-40s %12s\n","live nodes by op","site","nodes");
+    out += line;
+    for(std::size_t i = 0;i < rows.size() && i < top;i++)
+    {
+        std::snprintf(line,sizeof(line),"%-22s %-40s %12lld\n",rows[i].name.c_str(),rows[i].site.c_str(),
+            static_cast<long long>(rows[i].live_nodes));
+        out += line;
+    }
+    return out;
+}
@@ -0,0 +1,82 @@
+#ifndef GRAPH_MEMORY_H
+#define GRAPH_MEMORY_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Memory held by the autograd graph
+//
+// every node counts itself in and out, so at any point it is known how many
+// nodes are alive, how many edges (prev entries) and closure bytes they hold
+// and what the Matrix buffers in the caching allocator add on top. A graph
+// which should have been freed after a step shows up as live nodes which do
+// not go back down
+//
+//     GraphMemory::reset_peak();
+//     ... one training step ...
+//     std::cout << GraphMemory::snapshot().format() << std::endl;
+//
+// in debug mode (which runs the Profiler) dump() lists the live nodes by the
+// op and call site which created them
+class GraphMemory
+{
+    static std::atomic<int64_t> live_nodes_;
+    static std::atomic<int64_t> peak_nodes_;
+    static std::atomic<uint64_t> created_nodes_;
+    static std::atomic<int64_t> live_edges_;
+    static std::atomic<int64_t> closure_bytes_;
+    static bool debug_;
+    static bool started_profiler_; // set_debug started the Profiler, so it stops it too
+
+    public:
+        struct Snapshot
+        {
+            int64_t live_nodes = 0;
+            int64_t peak_nodes = 0;      // since the last reset_peak
+            uint64_t created_nodes = 0;  // since the start of the program
+            int64_t live_edges = 0;
+            std::size_t node_bytes = 0;  // the nodes themselves with their shared_ptr counts
+            std::size_t edge_bytes = 0;  // the prev vectors
+            std::size_t closure_bytes = 0; // backward closures too big for std::function's buffer
+            std::size_t buffer_bytes = 0;  // Matrix buffers (and parameters) in the caching allocator
+            std::size_t peak_buffer_bytes = 0;
+
+            std::size_t graph_bytes() const { return node_bytes + edge_bytes + closure_bytes; }
+            std::string format() const;
+        };
+
+        static void node_created()
+        {
+            int64_t live = live_nodes_.fetch_add(1,std::memory_order_relaxed) + 1;
+            created_nodes_.fetch_add(1,std::memory_order_relaxed);
+            int64_t peak = peak_nodes_.load(std::memory_order_relaxed);
+            while(live > peak && !peak_nodes_.compare_exchange_weak(peak,live,std::memory_order_relaxed)) {}
+        }
+
+        static void node_destroyed()
+        {
+            live_nodes_.fetch_sub(1,std::memory_order_relaxed);
+        }
+
+        // what a node holds besides itself, added once its backward is set
+        static void holds(int64_t edges,int64_t closure_bytes)
+        {
+            if(edges != 0) live_edges_.fetch_add(edges,std::memory_order_relaxed);
+            if(closure_bytes != 0) closure_bytes_.fetch_add(closure_bytes,std::memory_order_relaxed);
+        }
+
+        static Snapshot snapshot();
+        // the peak of nodes and of the allocator start again at what is alive now
+        static void reset_peak();
+
+        // debug mode starts the Profiler so the nodes carry their op, a
+        // Profiler which was already running is left running afterwards
+        static void set_debug(bool on);
+        static bool debug() { return debug_; }
+        // live nodes by op and call site, the top rows, empty unless in debug mode
+        static std::string dump(std::size_t top = 15);
+};
+
+#endif
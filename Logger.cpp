@@ -2,4 +2,5 @@
 // cannot initializa in a header file
 std::string Logger::file_path = "";
 bool Logger::set = false;
+std::mutex Logger::mutex;
 Logger::Loggermode Logger::current_mode = Logger::Loggermode::NONE;
\ No newline at end of file
@@ -3,11 +3,13 @@
 
 #include <string>
 #include <fstream>
+#include <mutex>
 
 class Logger
 {
     static std::string file_path;
     static bool set;
+    static std::mutex mutex; // ops can log from several threads at once
     public:
         enum class Loggermode { NONE, OPTIMIZED, DEBUG, INFO, ERROR};
     // set the mode
@@ -32,6 +34,7 @@ class Logger
         {
             if(current_mode != Loggermode::OPTIMIZED || file_path == "")
             {
+                std::lock_guard<std::mutex> lock(mutex);
                 std::ofstream ofs(file_path,std::ios::app); // append mode
                 if(ofs.is_open())
                 {
@@ -43,6 +46,7 @@ class Logger
 
         static void error(std::string line)
         {
+            std::lock_guard<std::mutex> lock(mutex);
             std::ofstream ofs(file_path,std::ios::app); // append mode
             if(ofs.is_open())
             {
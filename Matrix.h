@@ -13,6 +13,9 @@
 #include <exception>
 #include "Tensor.h"
 #include "Logger.h"
+#include "MixedPrecision.h"
+#include "Allocator.h"
+#include "ThreadPool.h"
 
 template <typename T>
 class ThreeDArray;
@@ -27,11 +30,80 @@ class Matrix {
 
     Matrix() = default;
 
+    friend class Checkpoint;
+
 public:
 
+    // every buffer of a matrix goes through the caching allocator
+    // so the same shapes in the next training step reuse the memory
+    static std::shared_ptr<T[]> allocate(int n)
+    {
+        if(Profiler::enabled()) Profiler::allocated(static_cast<std::size_t>(n) * sizeof(T));
+        return CachingAllocator::allocate<T>(static_cast<std::size_t>(n));
+    }
+
+    // sum of the n elements data[start], data[start + stride], ...
+    // added up in accumulate_t<T> (float for a bfloat16 matrix), in
+    // deterministic mode the elements are added up in blocks of a fixed
+    // size and the blocks are combined pairwise, so the shape of the reduction
+    // tree (and with it the rounding) does not depend on the number of threads.
+    // Inside a backward function parallel_for runs inline, so the sum is not
+    // split across threads there
+    static T reduce_sum(const std::shared_ptr<T[]>& data,int start,int n,int stride)
+    {
+        if(n <= 0) return T{};
+        bool deterministic = Parallel::deterministic();
+        int threads = Parallel::inside_backward() ? 1 : static_cast<int>(Parallel::num_threads());
+        int block = n;
+        if(deterministic)
+        {
+            block = static_cast<int>(Parallel::reduction_block);
+        }
+        else if(threads > 1 && n >= static_cast<int>(Parallel::min_parallel_reduce))
+        {
+            block = (n + threads - 1) / threads;
+        }
+        int blocks = (n + block - 1) / block;
+
+        std::vector<accumulate_t<T>> partial(blocks);
+        Parallel::parallel_for(0,blocks,deterministic ? Parallel::min_parallel_reduce / Parallel::reduction_block : 1,
+            [&](std::size_t lo,std::size_t hi){
+                for(std::size_t b = lo;b < hi;b++)
+                {
+                    int first = static_cast<int>(b) * block;
+                    int last = std::min(n,first + block);
+                    accumulate_t<T> acc = data[start + first * stride];
+                    for(int k = first + 1;k < last;k++)
+                    {
+                        acc += data[start + k * stride];
+                    }
+                    partial[b] = acc;
+                }
+            });
+
+        if(deterministic)
+        {
+            for(int width = 1;width < blocks;width *= 2)
+            {
+                for(int b = 0;b + width < blocks;b += 2 * width)
+                {
+                    partial[b] = partial[b] + partial[b + width];
+                }
+            }
+        }
+        else
+        {
+            for(int b = 1;b < blocks;b++)
+            {
+                partial[0] += partial[b];
+            }
+        }
+        return static_cast<T>(partial[0]);
+    }
+
     Matrix(int rows, int columns, T fill_value)
-        : rows(rows), columns(columns),
-         data(std::shared_ptr<T[]>(new T[rows * columns], std::default_delete<T[]>())),
+        : rows(rows), columns(columns), size(-1),
+         data(allocate(rows * columns)),
          shape_({rows,columns}) {
         for (int i = 0; i < rows * columns; i++) {
             data[i] = fill_value;
@@ -44,7 +116,7 @@ public:
         : rows(rows), columns(columns), data(data),shape_({rows,columns}),size(-1) {}
 
     Matrix(int rows,int columns,std::vector<T> new_data) : rows(rows),columns(columns),size(-1),
-    data(std::shared_ptr<T[]>(new T[rows * columns], std::default_delete<T[]>()))
+    data(allocate(rows * columns))
     {
         for(int i = 0;i < rows * columns;i++)
         {
@@ -53,7 +125,7 @@ public:
     }
 
     Matrix(int size,std::vector<T> new_data) : rows(-1),columns(-1),size(size),
-    data(std::shared_ptr<T[]>(new T[size], std::default_delete<T[]>()))
+    data(allocate(size))
     {
         for(int i = 0;i < size;i++)
         {
@@ -65,7 +137,7 @@ public:
         : rows(-1),columns(-1),size(size),shape_({-1,-1}),data(data) {}
 
     Matrix(const Matrix& matrix)
-        : rows(matrix.rows), columns(matrix.columns), data(matrix.data),size(-1) {}
+        : rows(matrix.rows), columns(matrix.columns), size(matrix.size), data(matrix.data), shape_(matrix.shape_) {}
 
     // could have used template<typename ...Args>
     // but if i pass a single argument could cause ambiguity
@@ -96,6 +168,43 @@ public:
         return result;
     }
 
+    // number of elements and element i in row major order, for vectors and matrices
+    int numel() const
+    {
+        return size != -1 ? size : rows * columns;
+    }
+
+    T flat(int i) const
+    {
+        return data[i];
+    }
+
+    int num_rows() const { return rows; }
+    int num_columns() const { return columns; }
+
+    // the elements rounded to the autocast type (MixedPrecision.h) with the
+    // same shape, the matrix itself if autocast is off or T is not a tensor
+    Matrix<T> autocast() const
+    {
+        if constexpr(is_tensor_v<T>)
+        {
+            if(Autocast::enabled())
+            {
+                ProfileScope scope("autocast");
+                int n = numel();
+                std::shared_ptr<T[]> new_data = allocate(n);
+                for(int i = 0;i < n;i++)
+                {
+                    new_data[i] = Autocast::cast(data[i]);
+                }
+                Matrix<T> result(*this);
+                result.data = new_data;
+                return result;
+            }
+        }
+        return *this;
+    }
+
     T operator[](int position)
     {
         T result{};
@@ -225,6 +334,7 @@ public:
     }
 
     Matrix<T> broadcast_to(int target_rows, int target_cols) {
+        ProfileScope scope("broadcast");
         try
         {
             if(rows != -1 && columns != -1)
@@ -249,7 +359,7 @@ public:
         }
 
         Matrix<T> result{target_rows, target_cols};
-        result.data = std::shared_ptr<T[]>(new T[target_rows * target_cols]);
+        result.data = allocate(target_rows * target_cols);
 
         try
         {
@@ -314,7 +424,7 @@ public:
             {
                 if(keepdim)
                 {
-                    std::shared_ptr<T[]> new_data(new T[1 * columns]);
+                    std::shared_ptr<T[]> new_data = allocate(1 * columns);
                     for(int i = 0;i < columns;i++)
                     {
                         new_data[i] = T{};
@@ -330,7 +440,7 @@ public:
                 }
                 else
                 {
-                    std::shared_ptr<T[]> new_data(new T[1 * columns]);
+                    std::shared_ptr<T[]> new_data = allocate(1 * columns);
                     for(int i = 0;i < columns;i++)
                     {
                         new_data[i] = T{};
@@ -350,7 +460,7 @@ public:
             {
                 if(keepdim)
                 {
-                    std::shared_ptr<T[]> new_data(new T[rows * 1]);
+                    std::shared_ptr<T[]> new_data = allocate(rows * 1);
                     for(int i = 0;i < rows;i++)
                     {
                         new_data[i] = T{};
@@ -367,7 +477,7 @@ public:
                 }
                 else
                 {
-                    std::shared_ptr<T[]> new_data(new T[rows * 1]);
+                    std::shared_ptr<T[]> new_data = allocate(rows * 1);
                     for(int i = 0;i < rows;i++)
                     {
                         new_data[i] = T{};
@@ -411,7 +521,7 @@ public:
             {
                 if(keepdim)
                 {
-                    std::shared_ptr<T[]> new_data(new T[1 * columns]);
+                    std::shared_ptr<T[]> new_data = allocate(1 * columns);
                     for(int i = 0;i < columns;i++)
                     {
                         new_data[i] = T{std::numeric_limits<float>::max()};
@@ -427,7 +537,7 @@ public:
                 }
                 else
                 {
-                    std::shared_ptr<T[]> new_data(new T[1 * columns]);
+                    std::shared_ptr<T[]> new_data = allocate(1 * columns);
                     for(int i = 0;i < columns;i++)
                     {
                         new_data[i] = T{std::numeric_limits<float>::max()};
@@ -447,7 +557,7 @@ public:
             {
                 if(keepdim)
                 {
-                    std::shared_ptr<T[]> new_data(new T[rows * 1]);
+                    std::shared_ptr<T[]> new_data = allocate(rows * 1);
                     for(int i = 0;i < rows;i++)
                     {
                         new_data[i] = T{std::numeric_limits<float>::max()};
@@ -464,7 +574,7 @@ public:
                 }
                 else
                 {
-                    std::shared_ptr<T[]> new_data(new T[rows * 1]);
+                    std::shared_ptr<T[]> new_data = allocate(rows * 1);
                     for(int i = 0;i < rows;i++)
                     {
                         new_data[i] = T{std::numeric_limits<float>::max()};
@@ -501,6 +611,7 @@ public:
 
     T sum()
     {
+        ProfileScope scope("sum");
         T sum = T{};
         try
         {
@@ -514,10 +625,7 @@ public:
                 throw std::runtime_error("Only Vectors are allowed");
             }
 
-            for(int i = 0;i < this->size;i++)
-            {
-                sum += this->data[i];
-            }
+            sum = reduce_sum(this->data,0,this->size,1);
 
         }
         catch(const std::exception& e)
@@ -537,10 +645,11 @@ public:
 
     Matrix<T> clone()
     {
+        ProfileScope scope("clone");
         Matrix<T> result{this->rows,this->columns};
         try
         {
-            result.data = std::shared_ptr<T[]>(new T[rows * columns]);
+            result.data = allocate(rows * columns);
             for(int i = 0;i < rows * columns ;i++)
             {
                 result.data[i] = T{this->data[i].value()};
@@ -562,36 +671,37 @@ public:
 
     Matrix<T> sum(int dim,bool keepdim)
     {
+        ProfileScope scope("sum dim");
         Matrix<T> result{};
         try
         {
+            // every output sums a column (dim 0) or a row, a chunk gets enough
+            // of them to add up min_parallel_reduce elements like reduce_sum
+            std::size_t length = static_cast<std::size_t>(std::max(dim == 0 ? rows : columns,1));
+            std::size_t grain = std::max<std::size_t>(Parallel::min_parallel_reduce / length,1);
             if(dim == 0)
             {
                 if (keepdim)
                 {
-                    std::shared_ptr<T[]> new_data(new T[1 * columns]);
-                    for(int i = 0;i < columns;i++)
-                    {
-                        new_data[i] = T{};
-                        for(int j = 0;j < rows;j++)
+                    std::shared_ptr<T[]> new_data = allocate(1 * columns);
+                    Parallel::parallel_for(0,columns,grain,[&](std::size_t lo,std::size_t hi){
+                        for(int i = static_cast<int>(lo);i < static_cast<int>(hi);i++)
                         {
-                            new_data[i] += data[j * columns+i];
+                            new_data[i] = reduce_sum(data,i,rows,columns);
                         }
-                    }
+                    });
                     result = Matrix<T>(1,columns,new_data);
                 }
                 else
                 {
                     //std::cout << "I am here" << std::endl;
-                    std::shared_ptr<T[]> new_data(new T[1 * columns]);
-                    for(int i = 0;i < columns;i++)
-                    {
-                        new_data[i] = T{};
-                        for(int j = 0;j < rows;j++)
+                    std::shared_ptr<T[]> new_data = allocate(1 * columns);
+                    Parallel::parallel_for(0,columns,grain,[&](std::size_t lo,std::size_t hi){
+                        for(int i = static_cast<int>(lo);i < static_cast<int>(hi);i++)
                         {
-                            new_data[i] += data[j * columns+i];
+                            new_data[i] = reduce_sum(data,i,rows,columns);
                         }
-                    }
+                    });
                     result = Matrix<T>(columns , new_data);
                 }
             }
@@ -600,28 +710,24 @@ public:
                 if(keepdim)
                 {
                     //std::cout << "I am here" << std::endl;
-                    std::shared_ptr<T[]> new_data(new T[rows * 1]);
-                    for(int i = 0;i < rows;i++)
-                    {
-                        new_data[i] = T{};
-                        for(int j = 0;j < columns;j++)
+                    std::shared_ptr<T[]> new_data = allocate(rows * 1);
+                    Parallel::parallel_for(0,rows,grain,[&](std::size_t lo,std::size_t hi){
+                        for(int i = static_cast<int>(lo);i < static_cast<int>(hi);i++)
                         {
-                            new_data[i] += data[i * columns + j];
+                            new_data[i] = reduce_sum(data,i * columns,columns,1);
                         }
-                    }
+                    });
                     result = Matrix<T>(rows, 1, new_data);
                 }
                 else
                 {
-                    std::shared_ptr<T[]> new_data(new T[rows * 1]);
-                    for(int i = 0;i < rows;i++)
-                    {
-                        new_data[i] = T{};
-                        for(int j = 0;j < columns;j++)
+                    std::shared_ptr<T[]> new_data = allocate(rows * 1);
+                    Parallel::parallel_for(0,rows,grain,[&](std::size_t lo,std::size_t hi){
+                        for(int i = static_cast<int>(lo);i < static_cast<int>(hi);i++)
                         {
-                            new_data[i] += data[i * columns + j];
+                            new_data[i] = reduce_sum(data,i * columns,columns,1);
                         }
-                    }
+                    });
                     result = Matrix<T>(rows, new_data);
                 }
             }
@@ -645,16 +751,22 @@ public:
     // i want both rvalue and lvalue to be passed
     template<typename _T>
     Matrix<T> matmul(_T&& a) {
+        ProfileScope scope("matmul");
         static_assert(std::is_same_v<std::decay_t<_T>, Matrix<T>>, "Invalid argument type");
-        std::shared_ptr<T[]> new_data(new T[rows * a.columns]);
+        std::shared_ptr<T[]> new_data = allocate(rows * a.columns);
         try
         {
+            // low precision inputs under autocast, the products are summed in float
+            Matrix<T> lhs = autocast();
+            Matrix<T> rhs = a.autocast();
             for (int i = 0; i < rows * a.columns; i++) {
-                new_data[i] = T{};
+                // rounded to T once per element, not once per product
+                accumulate_t<T> acc{};
                 for (int j = 0; j < columns; j++) {
-                    new_data[i] += data[(i / a.columns) * columns + j] *
-                                a.data[i % a.columns + j * a.columns];
+                    acc += lhs.data[(i / a.columns) * columns + j] *
+                                rhs.data[i % a.columns + j * a.columns];
                 }
+                new_data[i] = acc;
             }
             Logger::info("Successfully matrix multiplied two matrices");
         }
@@ -663,12 +775,13 @@ public:
             Logger::error("Error while matrix multiplying two matrices");
             std::cerr << "Error while matrix multiplying two matrices" << std::endl;
         }
-        return {rows, a.columns, new_data};
+        return Matrix<T>(rows, a.columns, new_data).autocast();
     }
 
     // mean of the vector
     T mean()
     {
+        ProfileScope scope("mean");
         T t{};
         //std::cout << "This is used" << this->size << std::endl;
         try
@@ -677,10 +790,7 @@ public:
             {
                 throw std::runtime_error("Matrices are not allowed to use this function");
             }
-            for(int i = 0;i < this->size;i++)
-            {
-                t += this->data[i];
-            }
+            t = reduce_sum(this->data,0,this->size,1);
             t /= this->size;
             Logger::info("Successfully calculated the mean of a vector");
         }
@@ -707,13 +817,14 @@ public:
         Matrix<T>
     >::type
     operator+(_T&& a) {
+        ProfileScope scope("matrix add");
         //ownership will be shared so it will not call the destructor
         // which atleast someone owns it
         int out_rows = std::max(rows, a.rows);
         int out_cols = std::max(columns, a.columns);
 
         // Matrix<T> result{out_rows, out_cols,T{}};
-        std::shared_ptr<T[]> new_data(new T[out_rows * out_cols]);
+        std::shared_ptr<T[]> new_data = allocate(out_rows * out_cols);
         try
         {            
             Matrix<T> A = this->broadcast_to(out_rows, out_cols);
@@ -734,7 +845,7 @@ public:
             std::cerr << "Error while calculating element wise operation of + using broadcasting" << std::endl;
         }
 
-        return {out_rows,out_cols,new_data};
+        return Matrix<T>(out_rows,out_cols,new_data).autocast();
     }
     
     template<typename _T>  
@@ -743,13 +854,14 @@ public:
         Matrix<T>
     >::type
     operator-(_T&& a) {
+        ProfileScope scope("matrix sub");
         //ownership will be shared so it will not call the destructor
         // which atleast someone owns it
         int out_rows = std::max(rows, a.rows);
         int out_cols = std::max(columns, a.columns);
 
         // Matrix<T> result{out_rows, out_cols,T{}};
-        std::shared_ptr<T[]> new_data(new T[out_rows * out_cols]);
+        std::shared_ptr<T[]> new_data = allocate(out_rows * out_cols);
         try
         {            
             Matrix<T> A = this->broadcast_to(out_rows, out_cols);
@@ -775,7 +887,7 @@ public:
             std::cerr << "Error while calculating element wise operation of - using broadcasting" << std::endl;
         }
 
-        return {out_rows,out_cols,new_data};
+        return Matrix<T>(out_rows,out_cols,new_data).autocast();
     }
 
     template<typename _T>
@@ -785,13 +897,14 @@ public:
     >::type
     operator*(_T&& a)
     {
+        ProfileScope scope("matrix mul");
         //ownership will be shared so it will not call the destructor
         // which atleast someone owns it
         int out_rows = std::max(rows, a.rows);
         int out_cols = std::max(columns, a.columns);
 
         // Matrix<T> result{out_rows, out_cols,T{}};
-        std::shared_ptr<T[]> new_data(new T[out_rows * out_cols]);
+        std::shared_ptr<T[]> new_data = allocate(out_rows * out_cols);
         try
         {            
             Matrix<T> A = this->broadcast_to(out_rows, out_cols);
@@ -817,7 +930,7 @@ public:
             std::cerr << "Error while calculating element wise operation of * using broadcasting" << std::endl;
         }
 
-        return {out_rows,out_cols,new_data};
+        return Matrix<T>(out_rows,out_cols,new_data).autocast();
     }
 
     template<typename _T>
@@ -827,13 +940,14 @@ public:
     >::type
     operator/(_T&& a)
     {
+        ProfileScope scope("matrix div");
         //ownership will be shared so it will not call the destructor
         // which atleast someone owns it
         int out_rows = std::max(rows, a.rows);
         int out_cols = std::max(columns, a.columns);
 
         // Matrix<T> result{out_rows, out_cols,T{}};
-        std::shared_ptr<T[]> new_data(new T[out_rows * out_cols]);
+        std::shared_ptr<T[]> new_data = allocate(out_rows * out_cols);
         try
         {            
             Matrix<T> A = this->broadcast_to(out_rows, out_cols);
@@ -859,7 +973,7 @@ public:
             std::cerr << "Error while calculating element wise operation of / using broadcasting" << std::endl;
         }
 
-        return {out_rows,out_cols,new_data};
+        return Matrix<T>(out_rows,out_cols,new_data).autocast();
     }   
 
     Matrix<T> view(std::tuple<int, int> size) {
@@ -883,7 +997,8 @@ public:
     }
 
     Matrix<T> transpose() {
-        std::shared_ptr<T[]> new_data(new T[rows * columns]);
+        ProfileScope scope("transpose");
+        std::shared_ptr<T[]> new_data = allocate(rows * columns);
         int index = 0;
         for (int i = 0; i < columns; i++) {
             for (int j = 0; j < rows; j++) {
@@ -895,7 +1010,8 @@ public:
 
     Matrix<T> pow(int num)
     {
-        std::shared_ptr<T[]> new_data(new T[rows * columns]);
+        ProfileScope scope("matrix pow");
+        std::shared_ptr<T[]> new_data = allocate(rows * columns);
         for(int i = 0;i < rows * columns;i++)
         {
             new_data[i] = this->data[i].pow(num);
@@ -980,7 +1096,7 @@ public:
             second_dim = total_elements / first_dim;
         }
 
-        auto new_data = std::make_shared<T[]>(total_elements);
+        auto new_data = Matrix<T>::allocate(total_elements);
         for (int i = 0; i < total_elements; ++i) {
             new_data[i] = *data[i];
         }
@@ -0,0 +1,293 @@
+#ifndef MEMORY_PLANNER_H
+#define MEMORY_PLANNER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Allocator.h"
+#include "Logger.h"
+
+// Plans the memory of one training step by liveness analysis
+//
+// 1) capture_begin() / capture_end() around one step (forward and backward)
+//    records every Matrix buffer which is allocated with the tick when it is
+//    allocated and the tick when it is freed
+// 2) plan() puts the buffers into a small set of slabs, buffers whose
+//    lifetimes do not overlap share the same slab
+// 3) replay_begin() / replay_end() around the next steps serve the k-th
+//    allocation of the step from the slab that the k-th captured buffer got
+//
+// if a step does not allocate the same sequence as the captured one the
+// planner falls back to the caching allocator for the rest of the step,
+// so a wrong plan costs memory but never gives the same slab to two live buffers
+// a buffer from a slab which is still alive after replay_end() goes back to
+// its slab when it is freed, one which outlives the plan (plan() again or the
+// destructor) keeps its block, the allocator caches it like one of its own
+class MemoryPlanner : public CachingAllocator::Hook
+{
+    public:
+        struct Buffer
+        {
+            std::size_t bytes;
+            std::size_t alloc_tick;
+            std::size_t free_tick; // npos if it was still alive at capture_end()
+            int slab = -1;
+        };
+
+        struct Report
+        {
+            std::size_t buffers = 0;        // buffers seen in the captured step
+            std::size_t planned_buffers = 0; // buffers which got a slab
+            std::size_t slabs = 0;
+            std::size_t naive_bytes = 0;    // every buffer with its own memory
+            std::size_t live_peak_bytes = 0; // most bytes alive at the same time
+            std::size_t planned_bytes = 0;  // sum of the slab sizes
+            std::size_t replay_hits = 0;    // allocations served from a slab
+            std::size_t replay_fallbacks = 0; // allocations the plan could not serve
+        };
+
+        static constexpr std::size_t npos = std::numeric_limits<std::size_t>::max();
+
+    private:
+        enum class Mode { IDLE, CAPTURE, REPLAY };
+
+        struct Slab
+        {
+            std::size_t bytes = 0;
+            void* block = nullptr;
+            bool busy = false;
+            // lifetimes of the tenants, used while planning
+            std::vector<std::pair<std::size_t,std::size_t>> intervals;
+
+            explicit Slab(std::size_t bytes) : bytes(bytes) {}
+        };
+
+        Mode mode = Mode::IDLE;
+        std::size_t tick = 0;
+        std::vector<Buffer> buffers;
+        std::unordered_map<void*,std::size_t> live; // block -> captured buffer
+        std::vector<Slab> slabs;
+        std::unordered_map<void*,int> slab_of_block;
+        std::size_t replay_index = 0;
+        bool replay_diverged = false;
+        Report report_{};
+
+        static bool overlaps(const Slab& slab,std::size_t start,std::size_t end)
+        {
+            for(const auto& [s,e] : slab.intervals)
+            {
+                if(start < e && s < end) return true;
+            }
+            return false;
+        }
+
+        void release_slabs()
+        {
+            std::vector<void*> in_use = CachingAllocator::disown(this);
+            for(auto& slab : slabs)
+            {
+                if(std::find(in_use.begin(),in_use.end(),slab.block) == in_use.end())
+                {
+                    std::free(slab.block);
+                }
+            }
+            slabs.clear();
+            slab_of_block.clear();
+        }
+
+    public:
+        MemoryPlanner() = default;
+        MemoryPlanner(const MemoryPlanner&) = delete;
+        MemoryPlanner& operator=(const MemoryPlanner&) = delete;
+
+        ~MemoryPlanner()
+        {
+            if(CachingAllocator::get_hook() == this)
+            {
+                CachingAllocator::set_hook(nullptr);
+            }
+            release_slabs();
+        }
+
+        void capture_begin()
+        {
+            if(CachingAllocator::get_hook() != nullptr)
+            {
+                throw std::runtime_error("Another hook is already installed in the allocator");
+            }
+            buffers.clear();
+            live.clear();
+            tick = 0;
+            mode = Mode::CAPTURE;
+            CachingAllocator::set_hook(this);
+        }
+
+        void capture_end()
+        {
+            CachingAllocator::set_hook(nullptr);
+            // whatever is still alive escapes the step (outputs, parameters ...)
+            // and keeps its free_tick as npos so it never gets a slab
+            live.clear();
+            mode = Mode::IDLE;
+            Logger::info("Captured " + std::to_string(buffers.size()) + " buffers for memory planning");
+        }
+
+        // greedy by size: the biggest buffers are placed first and every
+        // buffer goes to the smallest slab which is big enough and free
+        // during its whole lifetime, otherwise a new slab is opened
+        Report plan()
+        {
+            release_slabs();
+            report_ = Report{};
+            report_.buffers = buffers.size();
+
+            std::vector<std::size_t> order;
+            for(std::size_t i = 0;i < buffers.size();i++)
+            {
+                buffers[i].slab = -1;
+                report_.naive_bytes += buffers[i].bytes;
+                if(buffers[i].free_tick != npos) order.push_back(i);
+            }
+            std::stable_sort(order.begin(),order.end(),[this](std::size_t a,std::size_t b){
+                return buffers[a].bytes > buffers[b].bytes;
+            });
+
+            for(std::size_t index : order)
+            {
+                Buffer& buffer = buffers[index];
+                int best = -1;
+                for(int s = 0;s < static_cast<int>(slabs.size());s++)
+                {
+                    if(slabs[s].bytes < buffer.bytes) continue;
+                    if(overlaps(slabs[s],buffer.alloc_tick,buffer.free_tick)) continue;
+                    if(best == -1 || slabs[s].bytes < slabs[best].bytes) best = s;
+                }
+                if(best == -1)
+                {
+                    slabs.emplace_back(buffer.bytes);
+                    best = static_cast<int>(slabs.size()) - 1;
+                }
+                slabs[best].intervals.emplace_back(buffer.alloc_tick,buffer.free_tick);
+                buffer.slab = best;
+                report_.planned_buffers++;
+            }
+
+            for(auto& slab : slabs)
+            {
+                slab.block = std::aligned_alloc(CachingAllocator::alignment,slab.bytes);
+                if(slab.block == nullptr)
+                {
+                    release_slabs();
+                    throw std::bad_alloc();
+                }
+                slab_of_block[slab.block] = static_cast<int>(&slab - slabs.data());
+                report_.planned_bytes += slab.bytes;
+            }
+            report_.slabs = slabs.size();
+
+            // sweep over the ticks to find the peak of bytes alive at once
+            std::vector<std::pair<std::size_t,long long>> events;
+            for(const auto& buffer : buffers)
+            {
+                events.emplace_back(buffer.alloc_tick,static_cast<long long>(buffer.bytes));
+                if(buffer.free_tick != npos)
+                    events.emplace_back(buffer.free_tick,-static_cast<long long>(buffer.bytes));
+            }
+            std::sort(events.begin(),events.end());
+            long long alive = 0;
+            for(const auto& [t,delta] : events)
+            {
+                alive += delta;
+                report_.live_peak_bytes = std::max(report_.live_peak_bytes,static_cast<std::size_t>(alive));
+            }
+
+            Logger::info("Memory plan: " + std::to_string(report_.planned_bytes) + " bytes in " +
+                std::to_string(report_.slabs) + " slabs instead of " + std::to_string(report_.naive_bytes) + " bytes");
+            return report_;
+        }
+
+        void replay_begin()
+        {
+            if(CachingAllocator::get_hook() != nullptr)
+            {
+                throw std::runtime_error("Another hook is already installed in the allocator");
+            }
+            replay_index = 0;
+            replay_diverged = false;
+            mode = Mode::REPLAY;
+            CachingAllocator::set_hook(this);
+        }
+
+        void replay_end()
+        {
+            CachingAllocator::set_hook(nullptr);
+            mode = Mode::IDLE;
+        }
+
+        Report report() const
+        {
+            return report_;
+        }
+
+        const std::vector<Buffer>& captured() const
+        {
+            return buffers;
+        }
+
+        void* on_allocate(std::size_t bucket) override
+        {
+            if(mode != Mode::REPLAY) return nullptr;
+            std::size_t index = replay_index++;
+            if(replay_diverged || index >= buffers.size() || buffers[index].bytes != bucket)
+            {
+                // the step does not look like the captured one anymore
+                replay_diverged = true;
+                report_.replay_fallbacks++;
+                return nullptr;
+            }
+            int s = buffers[index].slab;
+            if(s == -1 || slabs[s].busy)
+            {
+                report_.replay_fallbacks++;
+                return nullptr;
+            }
+            slabs[s].busy = true;
+            report_.replay_hits++;
+            return slabs[s].block;
+        }
+
+        void on_allocated(void* block,std::size_t bucket) override
+        {
+            if(mode != Mode::CAPTURE) return;
+            live[block] = buffers.size();
+            buffers.push_back(Buffer{bucket,tick++,npos});
+        }
+
+        void on_free(void* block) override
+        {
+            if(mode != Mode::CAPTURE) return;
+            auto it = live.find(block);
+            if(it != live.end())
+            {
+                buffers[it->second].free_tick = tick++;
+                live.erase(it);
+            }
+        }
+
+        void on_return(void* block) override
+        {
+            auto slab = slab_of_block.find(block);
+            if(slab != slab_of_block.end())
+            {
+                slabs[slab->second].busy = false;
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,73 @@
+#include "MixedPrecision.h"
+#include <cmath>
+#include "Optimizer.h"
+
+std::atomic<AutocastType> Autocast::type_{AutocastType::NONE};
+
+const char* autocast_name(AutocastType type)
+{
+    switch(type)
+    {
+        case AutocastType::BFLOAT16: return dtype_name<bfloat16>();
+        case AutocastType::FLOAT16: return dtype_name<float16>();
+        default: return dtype_name<float>();
+    }
+}
+
+LossScaler::LossScaler(LossScalerOptions options)
+    : options(options),scale_(options.enabled ? options.init_scale : 1.0f)
+{
+}
+
+Tensor LossScaler::scale(Tensor loss) const
+{
+    if(!options.enabled) return loss;
+    return loss * scale_;
+}
+
+bool LossScaler::unscale(Optimizer& optimizer)
+{
+    if(unscaled) return overflow;
+    unscaled = true;
+    overflow = false;
+    if(!options.enabled) return false;
+
+    ParameterBuffer& buffer = optimizer.buffer();
+    float* g = buffer.grads();
+    const float inverse = 1.0f / scale_;
+    // inf - inf is nan and nan stays nan, one check at the end covers every element
+    float poison = 0.0f;
+    for(std::size_t i = 0;i < buffer.size();i++)
+    {
+        g[i] *= inverse;
+        poison += g[i] - g[i];
+    }
+    overflow = !std::isfinite(poison);
+    return overflow;
+}
+
+bool LossScaler::step(Optimizer& optimizer)
+{
+    unscale(optimizer);
+    bool stepped = !overflow;
+    if(stepped)
+    {
+        optimizer.step();
+    }
+    if(options.enabled)
+    {
+        if(overflow)
+        {
+            scale_ *= options.backoff_factor;
+            good_steps = 0;
+            skipped++;
+        }
+        else if(++good_steps >= options.growth_interval)
+        {
+            scale_ *= options.growth_factor;
+            good_steps = 0;
+        }
+    }
+    unscaled = false;
+    return stepped;
+}
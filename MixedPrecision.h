@@ -0,0 +1,121 @@
+#ifndef MIXED_PRECISION_H
+#define MIXED_PRECISION_H
+
+#include <atomic>
+#include <cstdint>
+#include "Tensor.h"
+
+class Optimizer;
+
+// Mixed precision training
+//
+// the parameters (master weights), the optimizer state and the gradients
+// stay float. While autocast is on, the Matrix ops which produce activations
+// (matmul, the elementwise ops, Linear and Tanh) round their inputs and
+// outputs to bfloat16 or float16 and the gradients flowing back through them
+// are rounded the same way. An input which is the output of such an op is
+// rounded already and is used as it is, so an activation passed from one op
+// to the next is cast once. Reductions, BatchNorm1d and
+// cross_entropy run on the rounded values in float, sums are never rounded.
+// float16 gradients underflow (below 6e-8) and overflow (above 65504), the
+// LossScaler multiplies the loss so the gradients stay in range and skips the
+// step when one of them came out inf or nan
+//
+//     LossScaler scaler;                      // for float16, bfloat16 has the range of float
+//     {
+//         AutocastScope autocast(AutocastType::FLOAT16);
+//         loss = cross_entropy(mlp.forward(x),y);
+//     }
+//     optimizer.zero_grad();
+//     scaler.scale(loss).backward();
+//     scaler.step(optimizer);                 // unscale, skip on overflow, adjust the scale
+//
+// a node keeps a float value either way, this reproduces the numerics of a
+// low precision graph, not its memory
+enum class AutocastType
+{
+    NONE,
+    BFLOAT16,
+    FLOAT16
+};
+
+const char* autocast_name(AutocastType type);
+
+// the type is one for the whole process so the tasks of the thread pool see
+// it as well, set it around a forward pass and not from several threads
+class Autocast
+{
+    static std::atomic<AutocastType> type_;
+
+    public:
+        static AutocastType type() { return type_.load(std::memory_order_relaxed); }
+        static bool enabled() { return type() != AutocastType::NONE; }
+        static AutocastType exchange(AutocastType type) { return type_.exchange(type,std::memory_order_relaxed); }
+
+        // the tensor rounded to the autocast type, the tensor itself if off
+        template<typename S>
+        static BasicTensor<S> cast(BasicTensor<S>& tensor)
+        {
+            switch(type())
+            {
+                case AutocastType::BFLOAT16: return tensor.template round_to<bfloat16>();
+                case AutocastType::FLOAT16: return tensor.template round_to<float16>();
+                default: return tensor;
+            }
+        }
+};
+
+// autocast on for the enclosing block, AutocastType::NONE turns it off
+class AutocastScope
+{
+    AutocastType saved;
+
+    public:
+        explicit AutocastScope(AutocastType type = AutocastType::BFLOAT16) : saved(Autocast::exchange(type)) {}
+        ~AutocastScope() { Autocast::exchange(saved); }
+
+        AutocastScope(const AutocastScope&) = delete;
+        AutocastScope& operator=(const AutocastScope&) = delete;
+};
+
+struct LossScalerOptions
+{
+    float init_scale = 65536.0f;
+    float growth_factor = 2.0f;
+    float backoff_factor = 0.5f;
+    int growth_interval = 2000; // steps without an overflow before the scale grows
+    bool enabled = true;        // off: scale 1 and step always steps
+};
+
+// dynamic loss scaling like torch.cuda.amp.GradScaler
+class LossScaler
+{
+    LossScalerOptions options;
+    float scale_;
+    int good_steps = 0;
+    bool unscaled = false;
+    bool overflow = false;
+    uint64_t skipped = 0;
+
+    public:
+        explicit LossScaler(LossScalerOptions options = {});
+
+        // the loss times the scale, its backward leaves scaled gradients
+        Tensor scale(Tensor loss) const;
+
+        // divides the gradients of the optimizer's buffer by the scale, true
+        // if one of them is inf or nan. Call it before clipping the gradients,
+        // step does it otherwise
+        bool unscale(Optimizer& optimizer);
+
+        // steps the optimizer unless a gradient overflowed, then lowers the
+        // scale after an overflow or raises it after growth_interval good
+        // steps. True if the optimizer stepped
+        bool step(Optimizer& optimizer);
+
+        float current_scale() const { return scale_; }
+        bool found_overflow() const { return overflow; }
+        uint64_t skipped_steps() const { return skipped; }
+};
+
+#endif
@@ -0,0 +1,295 @@
+#include "Module.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include "Expression.h"
+
+void Module::collect_parameters(std::vector<Tensor>& out) const
+{
+    for(const Matrix<Tensor>& parameter : parameters_)
+    {
+        ParameterBuffer::collect(parameter,out);
+    }
+    for(const auto& child : children_)
+    {
+        child->collect_parameters(out);
+    }
+}
+
+std::vector<Tensor> Module::parameters() const
+{
+    std::vector<Tensor> out;
+    collect_parameters(out);
+    return out;
+}
+
+std::size_t Module::num_parameters() const
+{
+    return parameters().size();
+}
+
+std::shared_ptr<ParameterBuffer> Module::flatten()
+{
+    buffer_ = ParameterBuffer::flatten(parameters());
+    return buffer_;
+}
+
+void Module::zero_grad()
+{
+    if(buffer_)
+    {
+        buffer_->zero_grad();
+        return;
+    }
+    // not flattened, one parameter at a time
+    for(Tensor& parameter : parameters())
+    {
+        parameter.zero_grad();
+    }
+}
+
+void Module::train(bool on)
+{
+    training_ = on;
+    for(const auto& child : children_)
+    {
+        child->train(on);
+    }
+}
+
+void Module::save(const std::string& path) const
+{
+    if(!buffer_)
+    {
+        throw std::runtime_error("Only a flattened module can be saved");
+    }
+    std::ofstream out(path,std::ios::binary | std::ios::trunc);
+    uint64_t count = buffer_->size();
+    out.write(reinterpret_cast<const char*>(&count),sizeof(count));
+    out.write(reinterpret_cast<const char*>(buffer_->values()),static_cast<std::streamsize>(count * sizeof(float)));
+    if(!out)
+    {
+        throw std::runtime_error("Failed to write " + path);
+    }
+}
+
+void Module::load(const std::string& path)
+{
+    if(!buffer_)
+    {
+        throw std::runtime_error("Only a flattened module can be loaded");
+    }
+    std::ifstream in(path,std::ios::binary);
+    uint64_t count = 0;
+    in.read(reinterpret_cast<char*>(&count),sizeof(count));
+    if(!in || count != buffer_->size())
+    {
+        throw std::runtime_error(path + " does not hold the parameters of this module");
+    }
+    in.read(reinterpret_cast<char*>(buffer_->values()),static_cast<std::streamsize>(count * sizeof(float)));
+    if(!in)
+    {
+        throw std::runtime_error("Failed to read " + path);
+    }
+}
+
+static float uniform_bound(int in_features)
+{
+    return 1.0f / std::sqrt(static_cast<float>(in_features));
+}
+
+Linear::Linear(int in_features,int out_features,std::mt19937& gen,bool bias)
+    : in_features(in_features),out_features(out_features),has_bias(bias),
+      weight(make_parameter(in_features,out_features,[&,uniform = std::uniform_real_distribution<float>(
+          -uniform_bound(in_features),uniform_bound(in_features))]() mutable { return uniform(gen); })),
+      bias(bias ? make_parameter(1,out_features,[](){ return 0.0f; }) : Matrix<Tensor>(1,0))
+{
+    register_parameter(weight);
+    if(has_bias)
+    {
+        register_parameter(this->bias);
+    }
+}
+
+Matrix<Tensor> Linear::forward(Matrix<Tensor>& x)
+{
+    ProfileScope scope("Linear::forward");
+    if(x.num_columns() != in_features)
+    {
+        throw std::runtime_error("Linear expects " + std::to_string(in_features) + " features but got "
+            + std::to_string(x.num_columns()));
+    }
+    int batch = x.num_rows();
+    // under autocast the input, the weight and the bias are low precision
+    // copies of the float ones, the sum over the inputs stays float
+    Matrix<Tensor> input = x.autocast();
+    Matrix<Tensor> w = weight.autocast();
+    Matrix<Tensor> bias_copy = has_bias ? bias.autocast() : bias;
+    std::shared_ptr<Tensor[]> data = Matrix<Tensor>::allocate(batch * out_features);
+    for(int b = 0;b < batch;b++)
+    {
+        for(int o = 0;o < out_features;o++)
+        {
+            // one fused node per term instead of a product and a sum
+            Tensor acc = has_bias ? bias_copy.flat(o) : Tensor::constant(0.0f);
+            for(int i = 0;i < in_features;i++)
+            {
+                Tensor xi = input.flat(b * in_features + i);
+                acc = acc + expr(xi) * w.flat(i * out_features + o);
+            }
+            data[b * out_features + o] = acc;
+        }
+    }
+    return Matrix<Tensor>(batch,out_features,data).autocast();
+}
+
+Embedding::Embedding(int num_embeddings,int embedding_dim,std::mt19937& gen)
+    : num_embeddings(num_embeddings),embedding_dim(embedding_dim),
+      weight(make_parameter(num_embeddings,embedding_dim,
+          [&,normal = std::normal_distribution<float>(0.0f,1.0f)]() mutable { return normal(gen); }))
+{
+    register_parameter(weight);
+}
+
+Matrix<Tensor> Embedding::forward(Matrix<Tensor>& x)
+{
+    int n = x.numel();
+    std::vector<int32_t> ids(n);
+    for(int i = 0;i < n;i++)
+    {
+        ids[i] = static_cast<int32_t>(x.flat(i).value());
+    }
+    return lookup(ids.data(),x.num_rows(),x.num_columns());
+}
+
+Matrix<Tensor> Tanh::forward(Matrix<Tensor>& x)
+{
+    ProfileScope scope("Tanh::forward");
+    int n = x.numel();
+    std::shared_ptr<Tensor[]> data = Matrix<Tensor>::allocate(n);
+    for(int i = 0;i < n;i++)
+    {
+        data[i] = x.flat(i).tanh();
+    }
+    return Matrix<Tensor>(x.num_rows(),x.num_columns(),data).autocast();
+}
+
+BatchNorm1d::BatchNorm1d(int features,float eps,float momentum)
+    : features(features),eps(eps),momentum(momentum),
+      gamma(make_parameter(1,features,[](){ return 1.0f; })),
+      beta(make_parameter(1,features,[](){ return 0.0f; })),
+      running_mean(features,0.0f),running_var(features,1.0f)
+{
+    register_parameter(gamma);
+    register_parameter(beta);
+}
+
+Matrix<Tensor> BatchNorm1d::forward(Matrix<Tensor>& x)
+{
+    ProfileScope scope("BatchNorm1d::forward");
+    if(x.num_columns() != features)
+    {
+        throw std::runtime_error("BatchNorm1d expects " + std::to_string(features) + " features but got "
+            + std::to_string(x.num_columns()));
+    }
+    int batch = x.num_rows();
+    std::shared_ptr<Tensor[]> data = Matrix<Tensor>::allocate(batch * features);
+    for(int j = 0;j < features;j++)
+    {
+        Tensor scale = gamma.flat(j);
+        Tensor shift = beta.flat(j);
+        if(!training())
+        {
+            float inv_std = 1.0f / std::sqrt(running_var[j] + eps);
+            for(int b = 0;b < batch;b++)
+            {
+                Tensor xb = x.flat(b * features + j);
+                data[b * features + j] = (expr(xb) - running_mean[j]) * inv_std * scale + shift;
+            }
+            continue;
+        }
+
+        Tensor sum = x.flat(j);
+        for(int b = 1;b < batch;b++)
+        {
+            sum = sum + x.flat(b * features + j);
+        }
+        Tensor mean = sum / static_cast<float>(batch);
+        std::vector<Tensor> centered(batch);
+        Tensor squares = Tensor::constant(0.0f);
+        for(int b = 0;b < batch;b++)
+        {
+            Tensor xb = x.flat(b * features + j);
+            centered[b] = xb - mean;
+            squares = squares + expr(centered[b]) * centered[b];
+        }
+        // biased variance for the normalisation, unbiased for the running estimate like torch
+        Tensor var = squares / static_cast<float>(batch);
+        Tensor inv_std = 1.0f / (expr(var) + eps).sqrt();
+        for(int b = 0;b < batch;b++)
+        {
+            data[b * features + j] = expr(centered[b]) * inv_std * scale + shift;
+        }
+
+        float unbiased = batch > 1 ? squares.value() / (batch - 1) : var.value();
+        running_mean[j] = (1.0f - momentum) * running_mean[j] + momentum * mean.value();
+        running_var[j] = (1.0f - momentum) * running_var[j] + momentum * unbiased;
+    }
+    return {batch,features,data};
+}
+
+Sequential::Sequential(std::vector<std::shared_ptr<Module>> modules)
+{
+    for(auto& module : modules)
+    {
+        add(std::move(module));
+    }
+}
+
+Sequential& Sequential::add(std::shared_ptr<Module> module)
+{
+    layers.push_back(module);
+    register_module(std::move(module));
+    return *this;
+}
+
+Matrix<Tensor> Sequential::forward(Matrix<Tensor>& x)
+{
+    Matrix<Tensor> h = x;
+    for(const auto& layer : layers)
+    {
+        h = layer->forward(h);
+    }
+    return h;
+}
+
+Tensor cross_entropy(Matrix<Tensor>& logits,const int32_t* targets)
+{
+    ProfileScope scope("cross_entropy");
+    int batch = logits.num_rows();
+    int classes = logits.num_columns();
+    Tensor total = Tensor::constant(0.0f);
+    for(int b = 0;b < batch;b++)
+    {
+        int target = targets[b];
+        if(target < 0 || target >= classes)
+        {
+            throw std::runtime_error("Target " + std::to_string(target) + " is not a class of the logits");
+        }
+        float largest = logits.flat(b * classes).value();
+        for(int k = 1;k < classes;k++)
+        {
+            largest = std::max(largest,logits.flat(b * classes + k).value());
+        }
+        Tensor sum = Tensor::constant(0.0f);
+        for(int k = 0;k < classes;k++)
+        {
+            sum = sum + (expr(logits.flat(b * classes + k)) - largest).exp();
+        }
+        Tensor picked = logits.flat(b * classes + target);
+        total = total + (expr(sum).log() + largest - picked);
+    }
+    return total / static_cast<float>(batch);
+}
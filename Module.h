@@ -0,0 +1,195 @@
+#ifndef MODULE_H
+#define MODULE_H
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "Tensor.h"
+#include "Matrix.h"
+#include "ParameterBuffer.h"
+
+// Building blocks of a network, like torch.nn
+//
+// a module registers its parameter matrices and its submodules, flatten() on
+// the outermost module moves every parameter of the tree into one
+// ParameterBuffer, after that zeroing the gradients, an optimizer step or
+// saving the weights is a single pass over two contiguous arrays
+//
+//     std::mt19937 gen(42);
+//     auto emb = std::make_shared<Embedding>(27,10,gen);
+//     auto mlp = std::make_shared<Sequential>();
+//     mlp->add(std::make_shared<Linear>(30,200,gen,false));
+//     mlp->add(std::make_shared<BatchNorm1d>(200));
+//     mlp->add(std::make_shared<Tanh>());
+//     mlp->add(std::make_shared<Linear>(200,27,gen));
+//     Sequential model;
+//     model.add(emb);
+//     model.add(mlp);
+//     auto params = model.flatten();
+//
+// modules are shared between their parents by shared_ptr, a matrix stored by
+// value shares its tensors with the module's member, so nothing dangles
+class Module
+{
+    std::vector<Matrix<Tensor>> parameters_;
+    std::vector<std::shared_ptr<Module>> children_;
+    std::shared_ptr<ParameterBuffer> buffer_;
+    bool training_ = true;
+
+    protected:
+        void register_parameter(const Matrix<Tensor>& parameter)
+        {
+            parameters_.push_back(parameter);
+        }
+
+        void register_module(std::shared_ptr<Module> child)
+        {
+            children_.push_back(std::move(child));
+        }
+
+        // a matrix of distinct leaves, the fill constructor would share one tensor
+        template<typename Init>
+        static Matrix<Tensor> make_parameter(int rows,int columns,Init init)
+        {
+            std::shared_ptr<Tensor[]> data = Matrix<Tensor>::allocate(rows * columns);
+            for(int i = 0;i < rows * columns;i++)
+            {
+                data[i] = Tensor{static_cast<float>(init())};
+            }
+            return {rows,columns,data};
+        }
+
+    public:
+        Module() = default;
+        Module(const Module&) = delete;
+        Module& operator=(const Module&) = delete;
+        virtual ~Module() = default;
+
+        virtual Matrix<Tensor> forward(Matrix<Tensor>& x) = 0;
+        Matrix<Tensor> operator()(Matrix<Tensor>& x) { return forward(x); }
+
+        // the parameters of this module and its children in registration order
+        void collect_parameters(std::vector<Tensor>& out) const;
+        std::vector<Tensor> parameters() const;
+        std::size_t num_parameters() const;
+
+        // binds every parameter of the tree to one contiguous buffer
+        std::shared_ptr<ParameterBuffer> flatten();
+        std::shared_ptr<ParameterBuffer> buffer() const { return buffer_; }
+        void zero_grad();
+
+        // training mode, batch statistics in BatchNorm1d, set for the whole tree
+        void train(bool on = true);
+        void eval() { train(false); }
+        bool training() const { return training_; }
+
+        // the values of the flat buffer, the model has to be flattened
+        void save(const std::string& path) const;
+        void load(const std::string& path);
+};
+
+// y = x W + b, W is (in, out) so a batch (B, in) gives (B, out)
+class Linear : public Module
+{
+    int in_features;
+    int out_features;
+    bool has_bias;
+
+    public:
+        Matrix<Tensor> weight;
+        Matrix<Tensor> bias;
+
+        // weights uniform in +-1/sqrt(in) like torch.nn.Linear, the bias starts at 0
+        Linear(int in_features,int out_features,std::mt19937& gen,bool bias = true);
+        Matrix<Tensor> forward(Matrix<Tensor>& x) override;
+};
+
+// rows of the table looked up by the character ids of the context, the
+// embeddings of one example are concatenated so (B, block) gives (B, block * dim)
+// the result shares the tensors of the table, the lookup adds no nodes
+class Embedding : public Module
+{
+    int num_embeddings;
+    int embedding_dim;
+
+    public:
+        Matrix<Tensor> weight;
+
+        // standard normal like torch.nn.Embedding
+        Embedding(int num_embeddings,int embedding_dim,std::mt19937& gen);
+
+        template<typename Index>
+        Matrix<Tensor> lookup(const Index* X,int batch,int block_size)
+        {
+            ProfileScope scope("Embedding::lookup");
+            int width = block_size * embedding_dim;
+            std::shared_ptr<Tensor[]> data = Matrix<Tensor>::allocate(batch * width);
+            for(int b = 0;b < batch;b++)
+            {
+                for(int k = 0;k < block_size;k++)
+                {
+                    int id = static_cast<int>(X[b * block_size + k]);
+                    if(id < 0 || id >= num_embeddings)
+                    {
+                        throw std::runtime_error("Id " + std::to_string(id) + " is not in the embedding table");
+                    }
+                    for(int d = 0;d < embedding_dim;d++)
+                    {
+                        data[b * width + k * embedding_dim + d] = weight.flat(id * embedding_dim + d);
+                    }
+                }
+            }
+            return {batch,width,data};
+        }
+
+        // the values of x are the ids
+        Matrix<Tensor> forward(Matrix<Tensor>& x) override;
+};
+
+class Tanh : public Module
+{
+    public:
+        Matrix<Tensor> forward(Matrix<Tensor>& x) override;
+};
+
+// normalises every feature over the batch, then scales by gamma and shifts by
+// beta, in eval mode the running mean and variance are used instead
+class BatchNorm1d : public Module
+{
+    int features;
+    float eps;
+    float momentum;
+
+    public:
+        Matrix<Tensor> gamma;
+        Matrix<Tensor> beta;
+        // plain numbers, they are not trained by backward
+        std::vector<float> running_mean;
+        std::vector<float> running_var;
+
+        explicit BatchNorm1d(int features,float eps = 1e-5f,float momentum = 0.1f);
+        Matrix<Tensor> forward(Matrix<Tensor>& x) override;
+};
+
+class Sequential : public Module
+{
+    std::vector<std::shared_ptr<Module>> layers;
+
+    public:
+        Sequential() = default;
+        explicit Sequential(std::vector<std::shared_ptr<Module>> modules);
+
+        Sequential& add(std::shared_ptr<Module> module);
+        std::size_t size() const { return layers.size(); }
+        std::shared_ptr<Module> operator[](std::size_t i) const { return layers[i]; }
+
+        Matrix<Tensor> forward(Matrix<Tensor>& x) override;
+};
+
+// mean over the batch of -log softmax(logits)[target], the largest logit of
+// every row is subtracted first (as a constant) so exp can not overflow
+Tensor cross_entropy(Matrix<Tensor>& logits,const int32_t* targets);
+
+#endif
@@ -0,0 +1,160 @@
+#include "Optimizer.h"
+#include "ThreadPool.h"
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+// buffers smaller than this are updated on one thread
+static constexpr std::size_t min_parallel_update = 1 << 16;
+
+#if defined(__AVX__)
+// a * b + c, fused if the target has FMA
+static inline __m256 multiply_add(__m256 a,__m256 b,__m256 c)
+{
+#if defined(__FMA__)
+    return _mm256_fmadd_ps(a,b,c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a,b),c);
+#endif
+}
+#endif
+
+Optimizer::Optimizer(std::shared_ptr<ParameterBuffer> params,std::vector<ParamGroup> groups,std::size_t state_slots)
+    : params(std::move(params)),groups_(std::move(groups)),state_slots(state_slots)
+{
+    for(const ParamGroup& group : groups_)
+    {
+        if(group.begin > group.end || group.end > this->params->size())
+        {
+            throw std::runtime_error("Parameter group [" + std::to_string(group.begin) + ", "
+                + std::to_string(group.end) + ") is outside of the buffer");
+        }
+    }
+    if(state_slots > 0)
+    {
+        // zero initialised, the moments and the velocity start at 0
+        state = CachingAllocator::allocate<float>(std::max<std::size_t>(state_slots * this->params->size(),1));
+    }
+}
+
+void SGD::kernel(float* p,const float* g,float* v,std::size_t n,const OptimizerOptions& o,bool first)
+{
+    const float lr = o.lr;
+    const float wd = o.weight_decay;
+    const float mu = o.momentum;
+    // the velocity starts at 0 and the first step puts the whole update
+    // in, without dampening, like torch
+    const float keep = first ? 1.0f : 1.0f - o.dampening;
+    std::size_t i = 0;
+#if defined(__AVX__)
+    const __m256 lr8 = _mm256_set1_ps(-lr);
+    const __m256 wd8 = _mm256_set1_ps(wd);
+    const __m256 mu8 = _mm256_set1_ps(mu);
+    const __m256 keep8 = _mm256_set1_ps(keep);
+    for(;i + 8 <= n;i += 8)
+    {
+        __m256 p8 = _mm256_loadu_ps(p + i);
+        __m256 d8 = multiply_add(wd8,p8,_mm256_loadu_ps(g + i));
+        if(mu != 0.0f)
+        {
+            __m256 v8 = multiply_add(mu8,_mm256_loadu_ps(v + i),_mm256_mul_ps(keep8,d8));
+            _mm256_storeu_ps(v + i,v8);
+            d8 = o.nesterov ? multiply_add(mu8,v8,d8) : v8;
+        }
+        _mm256_storeu_ps(p + i,multiply_add(lr8,d8,p8));
+    }
+#endif
+    for(;i < n;i++)
+    {
+        float d = g[i] + wd * p[i];
+        if(mu != 0.0f)
+        {
+            v[i] = mu * v[i] + keep * d;
+            d = o.nesterov ? d + mu * v[i] : v[i];
+        }
+        p[i] -= lr * d;
+    }
+}
+
+void SGD::step()
+{
+    ProfileScope scope("SGD::step");
+    steps++;
+    const bool first = steps == 1;
+    float* p = params->values();
+    const float* g = params->grads();
+    float* v = state_array(0);
+    for(const ParamGroup& group : groups_)
+    {
+        Parallel::parallel_for(group.begin,group.end,min_parallel_update,[&](std::size_t lo,std::size_t hi){
+            kernel(p + lo,g + lo,v + lo,hi - lo,group.options,first);
+        });
+    }
+}
+
+void Adam::kernel(float* p,const float* g,float* m,float* v,std::size_t n,
+    const OptimizerOptions& o,bool decoupled,float bias1,float bias2)
+{
+    const float b1 = o.beta1;
+    const float b2 = o.beta2;
+    const float eps = o.eps;
+    const float step_size = o.lr / bias1;
+    const float inv_sqrt_bias2 = 1.0f / std::sqrt(bias2);
+    // decoupled decay scales the value, otherwise the decay goes into the gradient
+    const float shrink = decoupled ? 1.0f - o.lr * o.weight_decay : 1.0f;
+    const float wd = decoupled ? 0.0f : o.weight_decay;
+    std::size_t i = 0;
+#if defined(__AVX__)
+    const __m256 b1_8 = _mm256_set1_ps(b1);
+    const __m256 one_b1 = _mm256_set1_ps(1.0f - b1);
+    const __m256 b2_8 = _mm256_set1_ps(b2);
+    const __m256 one_b2 = _mm256_set1_ps(1.0f - b2);
+    const __m256 eps8 = _mm256_set1_ps(eps);
+    const __m256 step8 = _mm256_set1_ps(step_size);
+    const __m256 inv8 = _mm256_set1_ps(inv_sqrt_bias2);
+    const __m256 shrink8 = _mm256_set1_ps(shrink);
+    const __m256 wd8 = _mm256_set1_ps(wd);
+    for(;i + 8 <= n;i += 8)
+    {
+        __m256 p8 = _mm256_loadu_ps(p + i);
+        __m256 g8 = multiply_add(wd8,p8,_mm256_loadu_ps(g + i));
+        __m256 m8 = multiply_add(b1_8,_mm256_loadu_ps(m + i),_mm256_mul_ps(one_b1,g8));
+        __m256 v8 = multiply_add(b2_8,_mm256_loadu_ps(v + i),_mm256_mul_ps(one_b2,_mm256_mul_ps(g8,g8)));
+        _mm256_storeu_ps(m + i,m8);
+        _mm256_storeu_ps(v + i,v8);
+        __m256 denominator = multiply_add(_mm256_sqrt_ps(v8),inv8,eps8);
+        __m256 update = _mm256_div_ps(_mm256_mul_ps(step8,m8),denominator);
+        _mm256_storeu_ps(p + i,_mm256_sub_ps(_mm256_mul_ps(p8,shrink8),update));
+    }
+#endif
+    for(;i < n;i++)
+    {
+        float grad = g[i] + wd * p[i];
+        m[i] = b1 * m[i] + (1.0f - b1) * grad;
+        v[i] = b2 * v[i] + (1.0f - b2) * (grad * grad);
+        float denominator = std::sqrt(v[i]) * inv_sqrt_bias2 + eps;
+        p[i] = p[i] * shrink - (step_size * m[i]) / denominator;
+    }
+}
+
+void Adam::step()
+{
+    ProfileScope scope("Adam::step");
+    steps++;
+    float* p = params->values();
+    const float* g = params->grads();
+    float* m = state_array(0);
+    float* v = state_array(1);
+    for(const ParamGroup& group : groups_)
+    {
+        const OptimizerOptions& o = group.options;
+        float bias1 = 1.0f - static_cast<float>(std::pow(o.beta1,steps));
+        float bias2 = 1.0f - static_cast<float>(std::pow(o.beta2,steps));
+        Parallel::parallel_for(group.begin,group.end,min_parallel_update,[&](std::size_t lo,std::size_t hi){
+            kernel(p + lo,g + lo,m + lo,v + lo,hi - lo,o,decoupled,bias1,bias2);
+        });
+    }
+}
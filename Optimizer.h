@@ -0,0 +1,124 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "ParameterBuffer.h"
+
+// Optimizers over a ParameterBuffer
+//
+// an update reads the gradient and writes the value and the optimizer state of
+// every parameter in one pass (one fused kernel per group, vectorised with AVX
+// when the compiler targets it), the state of all the parameters is one
+// contiguous array next to the buffer. Parameter groups are ranges of the
+// buffer with their own settings, for example no weight decay on the biases
+//
+//     auto params = ParameterBuffer::flatten(parameters);
+//     AdamW optimizer(params,{.lr = 1e-3f,.weight_decay = 0.01f});
+//     optimizer.zero_grad();
+//     loss.backward();
+//     optimizer.step();
+struct OptimizerOptions
+{
+    float lr = 0.1f;
+    float weight_decay = 0.0f;
+    // SGD
+    float momentum = 0.0f;
+    float dampening = 0.0f;
+    bool nesterov = false;
+    // Adam and AdamW
+    float beta1 = 0.9f;
+    float beta2 = 0.999f;
+    float eps = 1e-8f;
+};
+
+struct ParamGroup
+{
+    std::size_t begin = 0; // slots [begin, end) of the buffer
+    std::size_t end = 0;
+    OptimizerOptions options;
+};
+
+class Optimizer
+{
+    protected:
+        std::shared_ptr<ParameterBuffer> params;
+        std::vector<ParamGroup> groups_;
+        std::shared_ptr<float[]> state; // state_slots arrays of params->size() floats
+        std::size_t state_slots;
+
+        // slot k of the state of parameter i is state[k * size + i]
+        float* state_array(std::size_t k) { return state.get() + k * params->size(); }
+
+    public:
+        Optimizer(std::shared_ptr<ParameterBuffer> params,std::vector<ParamGroup> groups,std::size_t state_slots);
+        virtual ~Optimizer() = default;
+
+        // one group over the whole buffer
+        static std::vector<ParamGroup> single_group(const ParameterBuffer& params,const OptimizerOptions& options)
+        {
+            return {ParamGroup{0,params.size(),options}};
+        }
+
+        virtual void step() = 0;
+
+        // all the gradients of the buffer in one memset
+        void zero_grad() { params->zero_grad(); }
+
+        // the options can be changed between steps, a learning rate schedule for example
+        std::vector<ParamGroup>& groups() { return groups_; }
+        ParameterBuffer& buffer() { return *params; }
+        std::size_t state_bytes() const { return state_slots * params->size() * sizeof(float); }
+};
+
+// SGD with momentum, dampening, Nesterov momentum and L2 weight decay like torch.optim.SGD
+class SGD : public Optimizer
+{
+    long long steps = 0;
+
+    public:
+        SGD(std::shared_ptr<ParameterBuffer> params,const OptimizerOptions& options)
+            : SGD(params,single_group(*params,options)) {}
+        SGD(std::shared_ptr<ParameterBuffer> params,std::vector<ParamGroup> groups)
+            : Optimizer(std::move(params),std::move(groups),1) {}
+
+        void step() override;
+        long long step_count() const { return steps; }
+
+        // p -= lr * update, with the velocity v only if momentum is not 0,
+        // on the first step the velocity starts at the update itself
+        static void kernel(float* p,const float* g,float* v,std::size_t n,const OptimizerOptions& o,bool first);
+};
+
+// Adam, with decoupled set AdamW: the weight decay shrinks the value directly
+// instead of being added to the gradient
+class Adam : public Optimizer
+{
+    bool decoupled;
+    long long steps = 0;
+
+    public:
+        Adam(std::shared_ptr<ParameterBuffer> params,const OptimizerOptions& options,bool decoupled = false)
+            : Adam(params,single_group(*params,options),decoupled) {}
+        Adam(std::shared_ptr<ParameterBuffer> params,std::vector<ParamGroup> groups,bool decoupled = false)
+            : Optimizer(std::move(params),std::move(groups),2),decoupled(decoupled) {}
+
+        void step() override;
+        long long step_count() const { return steps; }
+
+        // m and v are the first and second moment, bias1 and bias2 the bias corrections 1 - beta^t
+        static void kernel(float* p,const float* g,float* m,float* v,std::size_t n,
+            const OptimizerOptions& o,bool decoupled,float bias1,float bias2);
+};
+
+class AdamW : public Adam
+{
+    public:
+        AdamW(std::shared_ptr<ParameterBuffer> params,const OptimizerOptions& options)
+            : Adam(std::move(params),options,true) {}
+        AdamW(std::shared_ptr<ParameterBuffer> params,std::vector<ParamGroup> groups)
+            : Adam(std::move(params),std::move(groups),true) {}
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef PARAMETER_BUFFER_H
+#define PARAMETER_BUFFER_H
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include "Allocator.h"
+#include "Tensor.h"
+#include "Matrix.h"
+
+// Values and gradients of a set of parameters in two flat arrays
+//
+// flatten() moves the value and the gradient of every parameter into slot i
+// of the arrays and points the parameter's node there, so the graph keeps
+// reading and accumulating into the parameter as before while zeroing the
+// gradients or updating the values is one pass over contiguous memory.
+// The arrays come from the caching allocator and are 64 byte aligned, the
+// parameters keep the buffer alive
+class ParameterBuffer
+{
+    std::size_t size_;
+    std::shared_ptr<float[]> values_;
+    std::shared_ptr<float[]> grads_;
+
+    public:
+        explicit ParameterBuffer(std::size_t n)
+            : size_(n),
+              values_(CachingAllocator::allocate<float>(std::max<std::size_t>(n,1))),
+              grads_(CachingAllocator::allocate<float>(std::max<std::size_t>(n,1)))
+        {
+        }
+
+        ParameterBuffer(const ParameterBuffer&) = delete;
+        ParameterBuffer& operator=(const ParameterBuffer&) = delete;
+
+        static std::shared_ptr<ParameterBuffer> flatten(const std::vector<Tensor>& parameters)
+        {
+            auto buffer = std::make_shared<ParameterBuffer>(parameters.size());
+            for(std::size_t i = 0;i < parameters.size();i++)
+            {
+                Tensor parameter = parameters[i];
+                parameter.bind(buffer->values_.get() + i,buffer->grads_.get() + i,buffer);
+            }
+            return buffer;
+        }
+
+        // the elements of the matrix in row major order
+        static void collect(const Matrix<Tensor>& matrix,std::vector<Tensor>& out)
+        {
+            int n = matrix.numel();
+            for(int i = 0;i < n;i++)
+            {
+                out.push_back(matrix.flat(i));
+            }
+        }
+
+        std::size_t size() const { return size_; }
+        float* values() { return values_.get(); }
+        float* grads() { return grads_.get(); }
+        const float* values() const { return values_.get(); }
+        const float* grads() const { return grads_.get(); }
+
+        void zero_grad()
+        {
+            std::memset(grads_.get(),0,size_ * sizeof(float));
+        }
+};
+
+#endif
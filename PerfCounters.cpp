@@ -0,0 +1,217 @@
+#include "PerfCounters.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    const char* names[perf_event_count] = {
+        "cycles","instructions","L1d misses","LLC misses","branch misses",
+        "task clock ns","page faults","context switches"
+    };
+
+#if defined(__linux__)
+    struct EventConfig
+    {
+        uint32_t type;
+        uint64_t config;
+    };
+
+    EventConfig config_of(PerfEvent event)
+    {
+        switch(event)
+        {
+            case PerfEvent::CYCLES: return {PERF_TYPE_HARDWARE,PERF_COUNT_HW_CPU_CYCLES};
+            case PerfEvent::INSTRUCTIONS: return {PERF_TYPE_HARDWARE,PERF_COUNT_HW_INSTRUCTIONS};
+            case PerfEvent::L1D_MISSES:
+                return {PERF_TYPE_HW_CACHE,PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+            case PerfEvent::LLC_MISSES: return {PERF_TYPE_HARDWARE,PERF_COUNT_HW_CACHE_MISSES};
+            case PerfEvent::BRANCH_MISSES: return {PERF_TYPE_HARDWARE,PERF_COUNT_HW_BRANCH_MISSES};
+            case PerfEvent::TASK_CLOCK: return {PERF_TYPE_SOFTWARE,PERF_COUNT_SW_TASK_CLOCK};
+            case PerfEvent::PAGE_FAULTS: return {PERF_TYPE_SOFTWARE,PERF_COUNT_SW_PAGE_FAULTS};
+            case PerfEvent::CONTEXT_SWITCHES: return {PERF_TYPE_SOFTWARE,PERF_COUNT_SW_CONTEXT_SWITCHES};
+            default: return {PERF_TYPE_SOFTWARE,PERF_COUNT_SW_DUMMY};
+        }
+    }
+
+    int open_event(PerfEvent event,int group_fd)
+    {
+        perf_event_attr attr;
+        std::memset(&attr,0,sizeof(attr));
+        attr.size = sizeof(attr);
+        EventConfig config = config_of(event);
+        attr.type = config.type;
+        attr.config = config.config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        if(group_fd < 0)
+        {
+            // the leader starts disabled and enables the whole group at once
+            attr.disabled = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        }
+        // this thread on any cpu
+        return static_cast<int>(syscall(SYS_perf_event_open,&attr,0,-1,group_fd,0));
+    }
+#endif
+
+    std::string human(double value)
+    {
+        char text[32];
+        if(value >= 1e9) std::snprintf(text,sizeof(text),"%.2fG",value / 1e9);
+        else if(value >= 1e6) std::snprintf(text,sizeof(text),"%.2fM",value / 1e6);
+        else if(value >= 1e3) std::snprintf(text,sizeof(text),"%.2fK",value / 1e3);
+        else std::snprintf(text,sizeof(text),"%.0f",value);
+        return text;
+    }
+}
+
+const char* perf_event_name(PerfEvent event)
+{
+    return names[static_cast<std::size_t>(event)];
+}
+
+PerfSample& PerfSample::operator+=(const PerfSample& other)
+{
+    for(std::size_t i = 0;i < perf_event_count;i++)
+    {
+        values[i] += other.values[i];
+    }
+    present |= other.present;
+    return *this;
+}
+
+PerfSample operator-(const PerfSample& end,const PerfSample& start)
+{
+    PerfSample out;
+    out.present = end.present & start.present;
+    for(std::size_t i = 0;i < perf_event_count;i++)
+    {
+        // a scaled count can come out a little smaller than the one before
+        out.values[i] = end.values[i] > start.values[i] ? end.values[i] - start.values[i] : 0;
+    }
+    return out;
+}
+
+PerfSample PerfSample::per(double n) const
+{
+    PerfSample out = *this;
+    if(n <= 0.0) return out;
+    for(std::size_t i = 0;i < perf_event_count;i++)
+    {
+        out.values[i] = static_cast<uint64_t>(values[i] / n + 0.5);
+    }
+    return out;
+}
+
+std::string PerfSample::format() const
+{
+    std::string out;
+    for(std::size_t i = 0;i < perf_event_count;i++)
+    {
+        PerfEvent event = static_cast<PerfEvent>(i);
+        if(!out.empty()) out += "  ";
+        out += std::string(names[i]) + " " + (has(event) ? human(static_cast<double>(values[i])) : "n/a");
+        if(event == PerfEvent::INSTRUCTIONS)
+        {
+            char ipc_text[32];
+            std::snprintf(ipc_text,sizeof(ipc_text),"%.2f",ipc());
+            out += std::string("  IPC ") + (ipc() > 0.0 ? ipc_text : "n/a");
+        }
+    }
+    return out;
+}
+
+PerfCounters::PerfCounters()
+{
+#if defined(__linux__)
+    std::string failed;
+    for(std::size_t i = 0;i < perf_event_count;i++)
+    {
+        PerfEvent event = static_cast<PerfEvent>(i);
+        int fd = open_event(event,leader);
+        if(fd < 0)
+        {
+            failed += std::string(failed.empty() ? "" : ", ") + names[i] + " (" + std::strerror(errno) + ")";
+            continue;
+        }
+        if(leader < 0) leader = fd;
+        fds.push_back(fd);
+        events.push_back(event);
+    }
+    if(leader >= 0)
+    {
+        ioctl(leader,PERF_EVENT_IOC_RESET,PERF_IOC_FLAG_GROUP);
+        ioctl(leader,PERF_EVENT_IOC_ENABLE,PERF_IOC_FLAG_GROUP);
+    }
+    if(!failed.empty())
+    {
+        error_ = "perf_event_open failed for " + failed;
+    }
+#else
+    error_ = "perf_event_open is only available on Linux";
+#endif
+}
+
+PerfCounters::~PerfCounters()
+{
+#if defined(__linux__)
+    for(int fd : fds)
+    {
+        close(fd);
+    }
+#endif
+}
+
+bool PerfCounters::hardware() const
+{
+    bool cycles = false;
+    bool instructions = false;
+    for(PerfEvent event : events)
+    {
+        cycles |= event == PerfEvent::CYCLES;
+        instructions |= event == PerfEvent::INSTRUCTIONS;
+    }
+    return cycles && instructions;
+}
+
+bool PerfCounters::read(PerfSample& out) const
+{
+#if defined(__linux__)
+    if(leader < 0) return false;
+    // nr, time enabled, time running, then one value per event of the group
+    uint64_t buffer[3 + perf_event_count];
+    ssize_t bytes = ::read(leader,buffer,sizeof(buffer));
+    if(bytes < static_cast<ssize_t>(3 * sizeof(uint64_t))) return false;
+    uint64_t nr = std::min<uint64_t>(buffer[0],events.size());
+    uint64_t enabled = buffer[1];
+    uint64_t running = buffer[2];
+    // the kernel counted only part of the time if it had to share the pmu
+    double scale = running > 0 && running < enabled ? static_cast<double>(enabled) / running : 1.0;
+    out = PerfSample{};
+    for(uint64_t i = 0;i < nr;i++)
+    {
+        std::size_t index = static_cast<std::size_t>(events[i]);
+        out.values[index] = static_cast<uint64_t>(buffer[3 + i] * scale);
+        out.present |= 1u << index;
+    }
+    return true;
+#else
+    (void)out;
+    return false;
+#endif
+}
+
+PerfCounters& PerfCounters::thread()
+{
+    thread_local PerfCounters counters;
+    return counters;
+}
@@ -0,0 +1,123 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Hardware performance counters of the calling thread (Linux perf_event_open)
+//
+// the counters of a thread are opened once as one group and keep running,
+// a measurement is the difference of two reads, so wrapping a kernel costs
+// two read() calls and nothing else
+//
+//     PerfSample matmul;
+//     {
+//         PerfScope scope(matmul);
+//         c = a.matmul(b);
+//     }
+//     std::cout << matmul.format() << std::endl; // cycles, instructions, IPC, ...
+//
+// in a container or a VM without a PMU the hardware events can not be
+// opened (and with perf_event_paranoid > 2 nothing can), the events which
+// did open are still counted and the rest is reported as missing, error()
+// tells why. Only user space is counted, that is what paranoid 2 allows
+enum class PerfEvent
+{
+    CYCLES,
+    INSTRUCTIONS,
+    L1D_MISSES,     // L1 data cache read misses
+    LLC_MISSES,     // last level cache misses
+    BRANCH_MISSES,
+    TASK_CLOCK,     // ns on the cpu, software event
+    PAGE_FAULTS,    // software event
+    CONTEXT_SWITCHES, // software event
+    COUNT
+};
+
+inline constexpr std::size_t perf_event_count = static_cast<std::size_t>(PerfEvent::COUNT);
+
+const char* perf_event_name(PerfEvent event);
+
+// counts of the events, present has a bit for every event which was counted
+struct PerfSample
+{
+    std::array<uint64_t,perf_event_count> values{};
+    uint32_t present = 0;
+
+    bool has(PerfEvent event) const { return present & (1u << static_cast<unsigned>(event)); }
+    uint64_t operator[](PerfEvent event) const { return values[static_cast<std::size_t>(event)]; }
+    bool empty() const { return present == 0; }
+
+    // instructions per cycle, 0 without both counters
+    double ipc() const
+    {
+        if(!has(PerfEvent::CYCLES) || !has(PerfEvent::INSTRUCTIONS) || (*this)[PerfEvent::CYCLES] == 0) return 0.0;
+        return static_cast<double>((*this)[PerfEvent::INSTRUCTIONS]) / (*this)[PerfEvent::CYCLES];
+    }
+
+    PerfSample& operator+=(const PerfSample& other);
+    // the counts between two reads
+    friend PerfSample operator-(const PerfSample& end,const PerfSample& start);
+    // every count divided by n, for the average of n repetitions
+    PerfSample per(double n) const;
+
+    // "cycles 1.20G  instructions 3.40G  IPC 2.83  ...", n/a for missing events
+    std::string format() const;
+};
+
+class PerfCounters
+{
+    int leader = -1;
+    std::vector<int> fds;
+    std::vector<PerfEvent> events; // in the order of the group
+    std::string error_;
+
+    public:
+        // opens the group for the calling thread
+        PerfCounters();
+        ~PerfCounters();
+        PerfCounters(const PerfCounters&) = delete;
+        PerfCounters& operator=(const PerfCounters&) = delete;
+
+        bool available() const { return leader >= 0; }
+        // cycles and instructions are there, IPC can be computed
+        bool hardware() const;
+        // why events are missing, empty if everything opened
+        const std::string& error() const { return error_; }
+
+        // totals since the group was opened, scaled up if the kernel had to
+        // multiplex the counters. Must be called on the thread which opened them
+        bool read(PerfSample& out) const;
+
+        // the counters of the calling thread, opened on first use
+        static PerfCounters& thread();
+};
+
+// adds what the enclosing block counts to total
+class PerfScope
+{
+    PerfSample& total;
+    PerfSample start;
+    bool active;
+
+    public:
+        explicit PerfScope(PerfSample& total)
+            : total(total),active(PerfCounters::thread().read(start)) {}
+
+        ~PerfScope()
+        {
+            PerfSample end;
+            if(active && PerfCounters::thread().read(end))
+            {
+                total += end - start;
+            }
+        }
+
+        PerfScope(const PerfScope&) = delete;
+        PerfScope& operator=(const PerfScope&) = delete;
+};
+
+#endif
@@ -0,0 +1,518 @@
+#include "Profiler.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <tuple>
+#include <unordered_map>
+
+std::atomic<bool> Profiler::enabled_{false};
+
+namespace
+{
+    struct Counter
+    {
+        uint64_t calls = 0;
+        uint64_t forward_ns = 0;
+        uint64_t backward_calls = 0;
+        uint64_t backward_ns = 0;
+        uint64_t nodes = 0;
+        uint64_t bytes = 0;
+        uint64_t created = 0; // nodes created by the key itself, not below it
+        uint64_t freed = 0;
+        PerfSample perf;
+    };
+
+    struct Event
+    {
+        uint32_t key;
+        bool backward;
+        uint64_t start_ns;
+        uint64_t end_ns;
+    };
+
+    // an op or a scope at one call site, key 0 is everything outside of them
+    struct KeyInfo
+    {
+        std::string name;
+        uint32_t parent;
+        bool scope;
+    };
+
+    struct CacheKey
+    {
+        const char* name;
+        uint32_t parent;
+        bool scope;
+
+        bool operator==(const CacheKey& other) const
+        {
+            return name == other.name && parent == other.parent && scope == other.scope;
+        }
+    };
+
+    struct CacheKeyHash
+    {
+        std::size_t operator()(const CacheKey& key) const
+        {
+            return std::hash<const void*>()(key.name) ^ (static_cast<std::size_t>(key.parent) << 1 | key.scope);
+        }
+    };
+
+    // everything a thread records goes to its own state, nothing is shared
+    // on the hot path, the states are only read by rows() and the trace
+    struct ThreadState
+    {
+        uint32_t tid = 0;
+        std::vector<Counter> counters;
+        std::vector<Event> events;
+        uint32_t current = 0;
+        uint64_t nodes = 0; // running totals, an op takes the difference
+        uint64_t bytes = 0;
+        // the name of an op is a string literal, its pointer finds the key
+        // without going to the registry
+        std::unordered_map<CacheKey,uint32_t,CacheKeyHash> cache;
+        // the counters at the enter of the open scopes which read them
+        std::vector<PerfSample> perf_starts;
+
+        Counter& counter(uint32_t key)
+        {
+            if(key >= counters.size()) counters.resize(key + 1);
+            return counters[key];
+        }
+    };
+
+    std::mutex registry_mutex;
+    std::vector<KeyInfo> keys{{"(outside ops)",0,true}};
+    std::map<std::tuple<std::string,uint32_t,bool>,uint32_t> key_index;
+    std::vector<std::shared_ptr<ThreadState>> states;
+
+    // the fusion passes run while profiling, under registry_mutex
+    struct FusionTotals
+    {
+        uint64_t passes = 0;
+        uint64_t nodes_before = 0;
+        uint64_t nodes_after = 0;
+        uint64_t bytes_before = 0;
+        uint64_t bytes_after = 0;
+    };
+
+    ProfilerOptions options;
+    FusionTotals fusion;
+    uint64_t started_ns = 0;
+    std::atomic<std::size_t> trace_events{0};
+    std::atomic<std::size_t> dropped_events{0};
+
+    ThreadState& state()
+    {
+        thread_local std::shared_ptr<ThreadState> local = [](){
+            auto created = std::make_shared<ThreadState>();
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            created->tid = static_cast<uint32_t>(states.size());
+            states.push_back(created);
+            return created;
+        }();
+        return *local;
+    }
+
+    uint32_t lookup(ThreadState& t,const char* name,uint32_t parent,bool scope)
+    {
+        CacheKey cache_key{name,parent,scope};
+        auto found = t.cache.find(cache_key);
+        if(found != t.cache.end()) return found->second;
+
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        auto [it,inserted] = key_index.emplace(std::make_tuple(std::string(name),parent,scope),
+            static_cast<uint32_t>(keys.size()));
+        if(inserted)
+        {
+            keys.push_back({name,parent,scope});
+        }
+        t.cache.emplace(cache_key,it->second);
+        return it->second;
+    }
+
+    void add_event(ThreadState& t,uint32_t key,bool backward,uint64_t start_ns,uint64_t end_ns)
+    {
+        if(trace_events.fetch_add(1,std::memory_order_relaxed) >= options.max_trace_events)
+        {
+            dropped_events.fetch_add(1,std::memory_order_relaxed);
+            return;
+        }
+        t.events.push_back({key,backward,start_ns,end_ns});
+    }
+
+    // "train_step/Linear::forward", registry_mutex has to be held
+    std::string path(uint32_t key)
+    {
+        if(key == 0) return "-";
+        std::string out = keys[key].name;
+        for(uint32_t k = keys[key].parent;k != 0;k = keys[k].parent)
+        {
+            out = keys[k].name + "/" + out;
+        }
+        return out;
+    }
+
+    std::string escape(const std::string& text)
+    {
+        std::string escaped;
+        for(char ch : text)
+        {
+            if(ch == '"' || ch == '\\') escaped.push_back('\\');
+            escaped.push_back(ch);
+        }
+        return escaped;
+    }
+}
+
+uint64_t Profiler::now_ns()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+uint32_t Profiler::current()
+{
+    return state().current;
+}
+
+uint32_t Profiler::exchange_current(uint32_t key)
+{
+    ThreadState& t = state();
+    uint32_t saved = t.current;
+    t.current = key;
+    return saved;
+}
+
+void Profiler::start(ProfilerOptions options_)
+{
+    reset();
+    options = options_;
+    started_ns = now_ns();
+    enabled_.store(true,std::memory_order_relaxed);
+}
+
+void Profiler::stop()
+{
+    enabled_.store(false,std::memory_order_relaxed);
+}
+
+void Profiler::reset()
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for(auto& t : states)
+    {
+        t->counters.clear();
+        t->events.clear();
+        t->current = 0;
+    }
+    trace_events = 0;
+    dropped_events = 0;
+    fusion = FusionTotals{};
+}
+
+void Profiler::enter(const char* name,bool scope,Mark& mark)
+{
+    ThreadState& t = state();
+    mark.parent = t.current;
+    mark.key = lookup(t,name,t.current,scope);
+    mark.nodes = t.nodes;
+    mark.bytes = t.bytes;
+    t.current = mark.key;
+    mark.perf = false;
+    if(scope && options.perf_counters)
+    {
+        PerfSample sample;
+        if(PerfCounters::thread().read(sample))
+        {
+            t.perf_starts.push_back(sample);
+            mark.perf = true;
+        }
+    }
+    mark.start_ns = now_ns();
+}
+
+void Profiler::leave(const Mark& mark,bool scope)
+{
+    uint64_t end_ns = now_ns();
+    ThreadState& t = state();
+    Counter& c = t.counter(mark.key);
+    if(mark.perf && !t.perf_starts.empty())
+    {
+        PerfSample sample;
+        if(PerfCounters::thread().read(sample)) c.perf += sample - t.perf_starts.back();
+        t.perf_starts.pop_back();
+    }
+    c.calls++;
+    c.forward_ns += end_ns - mark.start_ns;
+    c.nodes += t.nodes - mark.nodes;
+    c.bytes += t.bytes - mark.bytes;
+    t.current = mark.parent;
+    if(scope || options.trace_ops)
+    {
+        add_event(t,mark.key,false,mark.start_ns,end_ns);
+    }
+}
+
+uint32_t Profiler::node_created(std::size_t bytes)
+{
+    ThreadState& t = state();
+    t.nodes++;
+    t.bytes += bytes;
+    Counter& c = t.counter(t.current);
+    c.created++;
+    if(t.current == 0)
+    {
+        c.nodes++;
+        c.bytes += bytes;
+    }
+    return t.current;
+}
+
+void Profiler::node_destroyed(uint32_t key)
+{
+    // often on another thread than the one which created the node, the
+    // counters of all threads are added up before created - freed is taken
+    state().counter(key).freed++;
+}
+
+void Profiler::allocated(std::size_t bytes)
+{
+    ThreadState& t = state();
+    t.bytes += bytes;
+    if(t.current == 0) t.counter(0).bytes += bytes;
+}
+
+void Profiler::record_backward(uint32_t key,uint64_t start_ns,uint64_t end_ns)
+{
+    ThreadState& t = state();
+    Counter& c = t.counter(key);
+    c.backward_calls++;
+    c.backward_ns += end_ns - start_ns;
+    if(options.trace_ops)
+    {
+        add_event(t,key,true,start_ns,end_ns);
+    }
+}
+
+void Profiler::record_fusion(uint64_t nodes_before,uint64_t nodes_after,uint64_t bytes_before,uint64_t bytes_after)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    fusion.passes++;
+    fusion.nodes_before += nodes_before;
+    fusion.nodes_after += nodes_after;
+    fusion.bytes_before += bytes_before;
+    fusion.bytes_after += bytes_after;
+}
+
+std::vector<Profiler::Row> Profiler::rows()
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    std::vector<Counter> total(keys.size());
+    for(auto& t : states)
+    {
+        for(std::size_t k = 0;k < t->counters.size();k++)
+        {
+            const Counter& c = t->counters[k];
+            total[k].calls += c.calls;
+            total[k].forward_ns += c.forward_ns;
+            total[k].backward_calls += c.backward_calls;
+            total[k].backward_ns += c.backward_ns;
+            total[k].nodes += c.nodes;
+            total[k].bytes += c.bytes;
+            total[k].created += c.created;
+            total[k].freed += c.freed;
+            total[k].perf += c.perf;
+        }
+    }
+
+    // a scope is charged with the backward of every node created below it
+    std::vector<uint64_t> inclusive_backward(keys.size(),0);
+    for(uint32_t k = 1;k < keys.size();k++)
+    {
+        if(total[k].backward_ns == 0) continue;
+        for(uint32_t p = keys[k].parent;p != 0;p = keys[p].parent)
+        {
+            inclusive_backward[p] += total[k].backward_ns;
+        }
+    }
+
+    std::vector<Row> out;
+    for(uint32_t k = 0;k < keys.size();k++)
+    {
+        const Counter& c = total[k];
+        if(c.calls == 0 && c.backward_calls == 0 && c.nodes == 0 && c.bytes == 0 && c.freed == 0) continue;
+        Row row;
+        row.name = keys[k].name;
+        row.site = k == 0 ? "-" : path(keys[k].parent);
+        row.scope = keys[k].scope;
+        row.calls = c.calls;
+        row.forward_ns = c.forward_ns;
+        row.backward_calls = c.backward_calls;
+        row.backward_ns = c.backward_ns + inclusive_backward[k];
+        row.nodes = c.nodes;
+        row.bytes = c.bytes;
+        row.live_nodes = static_cast<int64_t>(c.created) - static_cast<int64_t>(c.freed);
+        row.perf = c.perf;
+        out.push_back(std::move(row));
+    }
+    return out;
+}
+
+std::string Profiler::report(std::size_t top)
+{
+    std::vector<Row> all = rows();
+    std::vector<Row> scopes;
+    std::vector<Row> ops;
+    for(Row& row : all)
+    {
+        (row.scope ? scopes : ops).push_back(std::move(row));
+    }
+    auto by_total = [](const Row& a,const Row& b){
+        return a.forward_ns + a.backward_ns > b.forward_ns + b.backward_ns;
+    };
+    std::sort(scopes.begin(),scopes.end(),by_total);
+    std::sort(ops.begin(),ops.end(),by_total);
+    uint64_t op_total = 0;
+    for(const Row& row : ops)
+    {
+        op_total += row.forward_ns + row.backward_ns;
+    }
+
+    // the end of a long site path is the interesting part
+    auto clip = [](const std::string& text,std::size_t width){
+        return text.size() <= width ? text : ".." + text.substr(text.size() - width + 2);
+    };
+    std::string out;
+    char line[256];
+    auto table = [&](const char* title,const std::vector<Row>& table_rows,std::size_t limit,bool share){
+        std::snprintf(line,sizeof(line),"%-22s %-34s %10s %10s %10s %6s %10s %10s\n",
+            title,"site","calls","fwd ms","bwd ms",share ? "%" : "",
+            "nodes","MB");
+        out += line;
+        for(std::size_t i = 0;i < table_rows.size() && i < limit;i++)
+        {
+            const Row& row = table_rows[i];
+            double percent = op_total == 0 ? 0.0 : 100.0 * (row.forward_ns + row.backward_ns) / op_total;
+            std::snprintf(line,sizeof(line),"%-22s %-34s %10llu %10.3f %10.3f %6s %10llu %10.3f\n",
+                clip(row.name,22).c_str(),clip(row.site,34).c_str(),
+                static_cast<unsigned long long>(row.calls),row.forward_ns / 1e6,row.backward_ns / 1e6,
+                share ? (std::to_string(static_cast<int>(percent + 0.5))).c_str() : "",
+                static_cast<unsigned long long>(row.nodes),row.bytes / 1e6);
+            out += line;
+        }
+    };
+    table("scope",scopes,scopes.size(),false);
+    out += "\n";
+    table("op",ops,top,true);
+    if(ops.size() > top)
+    {
+        out += "... " + std::to_string(ops.size() - top) + " more ops\n";
+    }
+    if(fusion.passes > 0)
+    {
+        double saved = fusion.bytes_before == 0 ? 0.0
+            : 100.0 * (1.0 - static_cast<double>(fusion.bytes_after) / fusion.bytes_before);
+        std::snprintf(line,sizeof(line),
+            "\nfusion: %llu passes, nodes %llu -> %llu, estimated backward graph traffic %.2f MB -> %.2f MB (-%.1f%%)\n",
+            static_cast<unsigned long long>(fusion.passes),static_cast<unsigned long long>(fusion.nodes_before),
+            static_cast<unsigned long long>(fusion.nodes_after),fusion.bytes_before / 1e6,fusion.bytes_after / 1e6,saved);
+        out += line;
+    }
+    if(options.perf_counters)
+    {
+        out += "\n";
+        const PerfCounters& counters = PerfCounters::thread();
+        if(!counters.available())
+        {
+            out += "hardware counters unavailable: " + counters.error() + "\n";
+        }
+        else
+        {
+            if(!counters.hardware())
+            {
+                out += "hardware counters unavailable, software events only: " + counters.error() + "\n";
+            }
+            // counts in millions, n/a for the events which could not be opened
+            auto count = [](const PerfSample& perf,PerfEvent event){
+                char text[32];
+                if(!perf.has(event)) return std::string("n/a");
+                std::snprintf(text,sizeof(text),"%.3f",perf[event] / 1e6);
+                return std::string(text);
+            };
+            std::snprintf(line,sizeof(line),"%-22s %-34s %10s %10s %6s %10s %10s %10s %10s %10s\n",
+                "scope counters","site","Mcycles","Minstr","IPC","ML1d miss","MLLC miss","Mbr miss","cpu ms","faults");
+            out += line;
+            for(const Row& row : scopes)
+            {
+                if(row.perf.empty()) continue;
+                char ipc[16] = "n/a";
+                if(row.perf.ipc() > 0.0) std::snprintf(ipc,sizeof(ipc),"%.2f",row.perf.ipc());
+                char cpu[32] = "n/a";
+                if(row.perf.has(PerfEvent::TASK_CLOCK)) std::snprintf(cpu,sizeof(cpu),"%.3f",row.perf[PerfEvent::TASK_CLOCK] / 1e6);
+                std::snprintf(line,sizeof(line),"%-22s %-34s %10s %10s %6s %10s %10s %10s %10s %10s\n",
+                    clip(row.name,22).c_str(),clip(row.site,34).c_str(),
+                    count(row.perf,PerfEvent::CYCLES).c_str(),count(row.perf,PerfEvent::INSTRUCTIONS).c_str(),ipc,
+                    count(row.perf,PerfEvent::L1D_MISSES).c_str(),count(row.perf,PerfEvent::LLC_MISSES).c_str(),
+                    count(row.perf,PerfEvent::BRANCH_MISSES).c_str(),cpu,
+                    row.perf.has(PerfEvent::PAGE_FAULTS) ? std::to_string(row.perf[PerfEvent::PAGE_FAULTS]).c_str() : "n/a");
+                out += line;
+            }
+        }
+    }
+    if(dropped_events > 0)
+    {
+        out += std::to_string(dropped_events.load()) + " trace events dropped, max_trace_events is "
+            + std::to_string(options.max_trace_events) + "\n";
+    }
+    return out;
+}
+
+void Profiler::write_chrome_trace(const std::string& path_)
+{
+    std::ofstream out(path_,std::ios::trunc);
+    if(!out)
+    {
+        throw std::runtime_error("Failed to write " + path_);
+    }
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    std::vector<std::string> names(keys.size());
+    std::vector<std::string> sites(keys.size());
+    for(uint32_t k = 0;k < keys.size();k++)
+    {
+        names[k] = escape(keys[k].name);
+        sites[k] = escape(k == 0 ? "-" : path(keys[k].parent));
+    }
+
+    // trace_event format, complete events ("X") with timestamps in microseconds
+    out << "{\"displayTimeUnit\": \"ms\",\n\"otherData\": {\"dropped_events\": " << dropped_events.load()
+        << "},\n\"traceEvents\": [\n";
+    bool first = true;
+    char line[128];
+    for(auto& t : states)
+    {
+        if(t->events.empty()) continue;
+        out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << t->tid
+            << ", \"args\": {\"name\": \"thread " << t->tid << "\"}}";
+        first = false;
+        for(const Event& event : t->events)
+        {
+            const char* category = event.backward ? "backward" : keys[event.key].scope ? "scope" : "op";
+            std::snprintf(line,sizeof(line),"\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %u",
+                (static_cast<double>(event.start_ns) - static_cast<double>(started_ns)) / 1e3,
+                (event.end_ns - event.start_ns) / 1e3,t->tid);
+            out << ",\n{\"name\": \"" << names[event.key] << "\", \"cat\": \"" << category
+                << "\", \"ph\": \"X\", " << line << ", \"args\": {\"site\": \"" << sites[event.key] << "\"}}";
+        }
+    }
+    out << "\n]}\n";
+    if(!out)
+    {
+        throw std::runtime_error("Failed to write " + path_);
+    }
+}
@@ -0,0 +1,191 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "PerfCounters.h"
+
+// Opt-in profiler of the autograd engine
+//
+// an op (add, mul, tanh, ...) is recorded per call site, the call site is the
+// innermost open scope like "Linear::forward" or "matmul", so the same add
+// shows up once under matmul and once under BatchNorm1d::forward. For every
+// op and scope it counts the calls, the forward time, the backward time of
+// the nodes it created, the nodes and the bytes allocated (nodes, closures,
+// Matrix buffers). Scopes are inclusive, ops are self time
+//
+//     Profiler::start();
+//     ... a few training steps ...
+//     Profiler::stop();
+//     std::cout << Profiler::report();
+//     Profiler::write_chrome_trace("trace.json"); // chrome://tracing or ui.perfetto.dev
+//
+// while it is off every hook is a relaxed load of one flag and a branch.
+// start/stop/report are meant to be called between steps, not while another
+// thread runs ops
+struct ProfilerOptions
+{
+    // one trace event per op and per backward_fn as well, not only
+    // per scope, a step of the MLP is millions of those
+    bool trace_ops = false;
+    std::size_t max_trace_events = 1 << 20;
+    // read the hardware counters (PerfCounters.h) when a scope opens and
+    // closes, a read is a syscall of about a microsecond so it is off for ops
+    bool perf_counters = false;
+};
+
+class Profiler
+{
+    public:
+        // one line of the report, the rows of all threads added up
+        struct Row
+        {
+            std::string name;
+            std::string site; // path of the enclosing scopes, "-" for none
+            bool scope = false;
+            uint64_t calls = 0;
+            uint64_t forward_ns = 0;
+            uint64_t backward_calls = 0;
+            uint64_t backward_ns = 0;
+            uint64_t nodes = 0;
+            uint64_t bytes = 0;
+            // created and not yet freed while profiling, negative if more
+            // nodes from before start() were freed than created
+            int64_t live_nodes = 0;
+            PerfSample perf; // scopes only, with ProfilerOptions::perf_counters
+        };
+
+        // what an open op or scope remembers to compute its deltas on exit
+        struct Mark
+        {
+            uint32_t key = 0;
+            uint32_t parent = 0;
+            uint64_t start_ns = 0;
+            uint64_t nodes = 0;
+            uint64_t bytes = 0;
+            bool perf = false; // a counter sample was pushed by enter
+        };
+
+    private:
+        static std::atomic<bool> enabled_;
+
+    public:
+        static bool enabled()
+        {
+            return enabled_.load(std::memory_order_relaxed);
+        }
+
+        // clears what was recorded before
+        static void start(ProfilerOptions options = {});
+        static void stop();
+        static void reset();
+
+        static uint64_t now_ns();
+
+        // the key ops of this thread are attributed to, a task handed to
+        // another thread takes it along (see ProfileSite)
+        static uint32_t current();
+        static uint32_t exchange_current(uint32_t key);
+
+        // used through ProfileScope and ProfileOp
+        static void enter(const char* name,bool scope,Mark& mark);
+        static void leave(const Mark& mark,bool scope);
+
+        // a node was created, returns the key of the op it belongs to
+        static uint32_t node_created(std::size_t bytes);
+        static void node_destroyed(uint32_t key);
+        // a closure or a buffer which is not a node
+        static void allocated(std::size_t bytes);
+        static void record_backward(uint32_t key,uint64_t start_ns,uint64_t end_ns);
+        // a fusion pass (Fusion.h) with its estimated backward traffic
+        static void record_fusion(uint64_t nodes_before,uint64_t nodes_after,uint64_t bytes_before,uint64_t bytes_after);
+
+        static std::vector<Row> rows();
+        // scopes first, then the ops by total time, at most top ops
+        static std::string report(std::size_t top = 30);
+        static void write_chrome_trace(const std::string& path);
+};
+
+// times the enclosing block as a call site, ops called inside are attributed to it
+//
+//     ProfileScope scope("Linear::forward");
+class ProfileScope
+{
+    Profiler::Mark mark;
+    bool active = false;
+
+    public:
+        explicit ProfileScope(const char* name)
+        {
+            if(Profiler::enabled())
+            {
+                active = true;
+                Profiler::enter(name,true,mark);
+            }
+        }
+
+        ~ProfileScope()
+        {
+            if(active) Profiler::leave(mark,true);
+        }
+
+        ProfileScope(const ProfileScope&) = delete;
+        ProfileScope& operator=(const ProfileScope&) = delete;
+};
+
+// the same for a single op of Tensor, the nodes created inside carry its key
+// so their backward_fn is attributed to it as well
+class ProfileOp
+{
+    Profiler::Mark mark;
+    bool active = false;
+
+    public:
+        explicit ProfileOp(const char* name)
+        {
+            if(Profiler::enabled())
+            {
+                active = true;
+                Profiler::enter(name,false,mark);
+            }
+        }
+
+        ~ProfileOp()
+        {
+            if(active) Profiler::leave(mark,false);
+        }
+
+        ProfileOp(const ProfileOp&) = delete;
+        ProfileOp& operator=(const ProfileOp&) = delete;
+};
+
+// runs the enclosing block of another thread at the call site of the thread
+// which handed out the work, like a chunk of parallel_for
+class ProfileSite
+{
+    uint32_t saved = 0;
+    bool active = false;
+
+    public:
+        explicit ProfileSite(uint32_t key)
+        {
+            if(key != 0 && Profiler::enabled())
+            {
+                active = true;
+                saved = Profiler::exchange_current(key);
+            }
+        }
+
+        ~ProfileSite()
+        {
+            if(active) Profiler::exchange_current(saved);
+        }
+
+        ProfileSite(const ProfileSite&) = delete;
+        ProfileSite& operator=(const ProfileSite&) = delete;
+};
+
+#endif
@@ -0,0 +1,258 @@
+#ifndef STREAMING_DATASET_H
+#define STREAMING_DATASET_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "DataLoader.h"
+#include "Vocabulary.h"
+
+// Reads a corpus one chunk at a time and splits it into lines like
+// std::getline, only the current chunk (and a line which does not fit into
+// it) is ever in memory, so the corpus can be much larger than the memory
+class ChunkedCorpusReader
+{
+    std::string path;
+    std::ifstream file;
+    std::vector<char> buffer;
+    std::size_t chunk_bytes;
+    std::size_t begin = 0; // unread part of the buffer
+    std::size_t end = 0;
+    bool eof = false;
+    uint64_t bytes_read_ = 0;
+
+    void open()
+    {
+        file = std::ifstream(path,std::ios::binary);
+        if(!file)
+        {
+            throw std::runtime_error("Failed to open " + path);
+        }
+        begin = end = 0;
+        eof = false;
+    }
+
+    // keeps the unfinished line and appends the next chunk after it
+    void refill()
+    {
+        std::size_t rest = end - begin;
+        if(begin > 0 && rest > 0)
+        {
+            std::memmove(buffer.data(),buffer.data() + begin,rest);
+        }
+        begin = 0;
+        end = rest;
+        if(buffer.size() < rest + chunk_bytes)
+        {
+            // only a line longer than a chunk makes the buffer grow
+            buffer.resize(rest + chunk_bytes);
+        }
+        file.read(buffer.data() + end,static_cast<std::streamsize>(chunk_bytes));
+        std::size_t got = static_cast<std::size_t>(file.gcount());
+        end += got;
+        bytes_read_ += got;
+        if(got < chunk_bytes) eof = true;
+    }
+
+    public:
+        explicit ChunkedCorpusReader(const std::string& path,std::size_t chunk_bytes = 1 << 20)
+            : path(path),buffer(std::max<std::size_t>(chunk_bytes,1)),chunk_bytes(std::max<std::size_t>(chunk_bytes,1))
+        {
+            open();
+        }
+
+        // the line is only valid until the next call, false at the end of the file
+        bool next(std::string_view& line)
+        {
+            while(true)
+            {
+                const char* start = buffer.data() + begin;
+                const void* newline = std::memchr(start,'\n',end - begin);
+                if(newline != nullptr)
+                {
+                    std::size_t length = static_cast<const char*>(newline) - start;
+                    line = std::string_view(start,length);
+                    begin += length + 1;
+                    return true;
+                }
+                if(!eof)
+                {
+                    refill();
+                    continue;
+                }
+                if(begin < end)
+                {
+                    // last line without a newline
+                    line = std::string_view(start,end - begin);
+                    begin = end;
+                    return true;
+                }
+                return false;
+            }
+        }
+
+        // back to the start of the file for the next epoch
+        void rewind()
+        {
+            open();
+        }
+
+        uint64_t bytes_read() const { return bytes_read_; }
+        std::size_t buffer_bytes() const { return buffer.size(); }
+};
+
+// the vocabulary of a corpus which is too large to map, one streaming pass
+inline Vocabulary stream_vocabulary(const std::string& path,char terminator = '.',std::size_t chunk_bytes = 1 << 20)
+{
+    std::array<bool,256> seen{};
+    ChunkedCorpusReader reader(path,chunk_bytes);
+    std::string_view line;
+    while(reader.next(line))
+    {
+        for(char ch : line)
+        {
+            seen[static_cast<unsigned char>(ch)] = true;
+        }
+    }
+    std::string chars;
+    for(int c = 0;c < 256;c++)
+    {
+        if(seen[c]) chars.push_back(static_cast<char>(c));
+    }
+    return Vocabulary::from_text(chars,terminator);
+}
+
+// Minibatches generated straight from the corpus file
+// the context windows are built on the fly while the words are read (the same
+// rows build_dataset gives) and go through a shuffle buffer of a fixed number
+// of examples: a batch row is a random example of the buffer, whose slot is
+// then refilled from the stream. The memory is one chunk of the file plus the
+// shuffle buffer plus the prefetched batches, whatever the size of the corpus.
+// An epoch ends when the file is read and the buffer is empty, the next epoch
+// starts reading the file again
+template<typename Index = int32_t>
+class StreamingDataLoader
+{
+    public:
+        using Stats = typename Prefetcher<Index>::Stats;
+
+    private:
+        ChunkedCorpusReader reader;
+        Vocabulary vocab;
+        int block_size;
+        std::size_t capacity;
+        FastRng rng;
+        std::vector<Index> examples; // capacity rows of block_size inputs and the target
+        std::size_t filled = 0;
+        bool exhausted = false;
+        std::vector<Index> word;     // the word which is being turned into examples
+        std::vector<Index> context;
+        std::size_t position = 0;
+        uint64_t epoch = 0;
+        uint64_t number = 0;
+        Prefetcher<Index> prefetcher; // last, so it starts after everything else is ready
+
+        Index* slot(std::size_t i) { return examples.data() + i * (block_size + 1); }
+
+        // the next example of the stream into out (inputs followed by the target)
+        bool stream_example(Index* out)
+        {
+            while(position == word.size())
+            {
+                std::string_view line;
+                if(exhausted || !reader.next(line))
+                {
+                    exhausted = true;
+                    return false;
+                }
+                word.resize(line.size());
+                vocab.encode(line,std::span<Index>(word));
+                std::fill(context.begin(),context.end(),Index{0});
+                position = 0;
+            }
+            std::copy(context.begin(),context.end(),out);
+            Index target = word[position++];
+            out[block_size] = target;
+            if(block_size > 0)
+            {
+                std::copy(context.begin() + 1,context.end(),context.begin());
+                context.back() = target;
+            }
+            return true;
+        }
+
+        void top_up()
+        {
+            while(filled < capacity && stream_example(slot(filled)))
+            {
+                filled++;
+            }
+        }
+
+        void next_example(Index* x,Index& y)
+        {
+            if(filled < capacity && !exhausted)
+            {
+                top_up();
+            }
+            if(filled == 0)
+            {
+                reader.rewind();
+                exhausted = false;
+                epoch++;
+                top_up();
+                if(filled == 0)
+                {
+                    throw std::runtime_error("The corpus has no examples");
+                }
+            }
+            std::size_t r = static_cast<std::size_t>(rng.uniform(filled));
+            Index* picked = slot(r);
+            std::copy(picked,picked + block_size,x);
+            y = picked[block_size];
+            if(!stream_example(picked))
+            {
+                // the stream is done for this epoch, the buffer drains
+                filled--;
+                std::copy(slot(filled),slot(filled) + block_size + 1,picked);
+            }
+        }
+
+        void fill(Batch<Index>& batch)
+        {
+            for(std::size_t b = 0;b < batch.size;b++)
+            {
+                next_example(batch.X.data() + b * block_size,batch.Y[b]);
+            }
+            batch.number = number++;
+            batch.epoch = epoch;
+        }
+
+    public:
+        StreamingDataLoader(const std::string& path,const Vocabulary& vocab,int block_size,
+            std::size_t batch_size,std::size_t shuffle_buffer = 1 << 16,uint64_t seed = 42,
+            std::size_t prefetch = 2,std::size_t chunk_bytes = 1 << 20)
+            : reader(path,chunk_bytes),vocab(vocab),block_size(block_size),
+              capacity(std::max<std::size_t>(shuffle_buffer,1)),rng(seed),
+              examples(capacity * (block_size + 1)),context(block_size),
+              prefetcher([this](Batch<Index>& batch){ fill(batch); },batch_size,block_size,prefetch)
+        {
+        }
+
+        const Batch<Index>& next() { return prefetcher.next(); }
+        Stats stats() { return prefetcher.stats(); }
+
+        // the shuffle buffer, which does not depend on the corpus size
+        std::size_t shuffle_buffer_bytes() const
+        {
+            return examples.size() * sizeof(Index);
+        }
+};
+
+#endif
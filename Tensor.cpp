@@ -1,48 +1,303 @@
 #include "Tensor.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
 #include <unordered_set>
 
-Tensor::Tensor()
-    : impl(std::make_shared<Impl>(0.0f)) {}
+std::atomic<bool> GradMode::enabled_{true};
 
+// releasing the last tensor of a long chain would otherwise free the chain
+// recursively, one stack frame per node. The first node freed on a thread
+// collects the inputs of every node which dies after it and releases them
+// from a loop, the nested destructors only hand their inputs over
+template<typename S>
+static thread_local std::vector<std::shared_ptr<BasicImpl<S>>>* pending_release = nullptr;
 
-Tensor::Tensor(float val) : impl(std::make_shared<Impl>(val)) {}
+template<typename S>
+BasicImpl<S>::~BasicImpl() {
+    GraphMemory::node_destroyed();
+    GraphMemory::holds(-static_cast<int64_t>(held_edges), -static_cast<int64_t>(held_closure_bytes));
+    if (profiled) Profiler::node_destroyed(profile_key);
+    if (prev.empty() && !backward_fn) return;
 
-float Tensor::value() const {
-    return impl->val;
+    if (pending_release<S> != nullptr) {
+        for (auto& node : prev) pending_release<S>->push_back(std::move(node));
+        // a closure may own nodes as well (a checkpointed block owns its inputs)
+        backward_fn = nullptr;
+        return;
+    }
+    std::vector<std::shared_ptr<BasicImpl>> release = std::move(prev);
+    pending_release<S> = &release;
+    backward_fn = nullptr;
+    while (!release.empty()) {
+        // moved out first, the destructor it may run appends to the vector
+        std::shared_ptr<BasicImpl> node = std::move(release.back());
+        release.pop_back();
+        node.reset();
+    }
+    pending_release<S> = nullptr;
+}
+
+template<typename S>
+BasicTensor<S>::BasicTensor()
+    : impl(std::make_shared<BasicImpl<S>>(S{})) {}
+
+
+template<typename S>
+BasicTensor<S>::BasicTensor(compute_type val) : impl(std::make_shared<BasicImpl<S>>(static_cast<S>(val))) {}
+
+template<typename S>
+typename BasicTensor<S>::compute_type BasicTensor<S>::value() const {
+    return impl->val();
 }
 
 
 
-float Tensor::grad() const {
-    return impl->grad;
+template<typename S>
+typename BasicTensor<S>::grad_type BasicTensor<S>::grad() const {
+    return impl->grad();
+}
+
+template<typename S>
+void BasicTensor<S>::backward() {
+    ProfileScope scope("backward");
+    impl->grad() = grad_type(1);
+    run_backward({impl});
 }
 
-void Tensor::backward() {
-    impl->grad = 1.0f;
+// every backward_fn is run through here, timed when the profiler is on
+template<typename S>
+static inline void call_backward(BasicImpl<S>* node) {
+    if (!node->backward_fn) return;
+    if (!Profiler::enabled()) {
+        node->backward_fn();
+        return;
+    }
+    uint64_t start = Profiler::now_ns();
+    node->backward_fn();
+    Profiler::record_backward(node->profile_key, start, Profiler::now_ns());
+}
 
-    std::vector<std::shared_ptr<Impl>> topo_order;
-    std::unordered_set<Impl*> visited;
+// gradients of a shared parent are accumulated by several nodes, every
+// parent is protected by one of these locks while a backward_fn writes to it
+static constexpr std::size_t backward_stripes = 256;
+static std::mutex backward_locks[backward_stripes];
 
-    std::function<void(std::shared_ptr<Impl>)> dfs;
-    dfs = [&](std::shared_ptr<Impl> node) {
-        // visited.count() checks whether the the raw pointer is already in the set
-        if (!node || visited.count(node.get())) return;
-        visited.insert(node.get()); // used to get the raw pointer
-        for (auto& prev : node->prev) {
-            dfs(prev);
+static std::size_t stripe_of(const void* node) {
+    return (reinterpret_cast<std::uintptr_t>(node) >> 6) % backward_stripes;
+}
+
+// holds the stripes of a node's parents while its backward_fn runs and
+// releases them when the backward_fn throws as well. Always locked in the
+// same order so two nodes cannot deadlock
+struct StripeLocks {
+    const std::vector<std::size_t>& held;
+
+    explicit StripeLocks(std::vector<std::size_t>& stripes) : held(stripes) {
+        std::sort(stripes.begin(), stripes.end());
+        stripes.erase(std::unique(stripes.begin(), stripes.end()), stripes.end());
+        for (std::size_t s : held) backward_locks[s].lock();
+    }
+    ~StripeLocks() {
+        for (std::size_t s : held) backward_locks[s].unlock();
+    }
+    StripeLocks(const StripeLocks&) = delete;
+    StripeLocks& operator=(const StripeLocks&) = delete;
+};
+
+// the graph in reverse topological order with the parents (prev) as indices
+template<typename S>
+struct BackwardGraph {
+    std::vector<std::shared_ptr<BasicImpl<S>>> nodes;
+    std::vector<std::size_t> edge_begin; // edges of node i are [edge_begin[i], edge_begin[i+1])
+    std::vector<std::size_t> edges;
+    std::vector<std::atomic<int>> deps; // consumers which still have to run
+
+    explicit BackwardGraph(std::vector<std::shared_ptr<BasicImpl<S>>> order)
+        : nodes(std::move(order)), edge_begin(nodes.size() + 1, 0), deps(nodes.size()) {
+        std::unordered_map<BasicImpl<S>*, std::size_t> index;
+        index.reserve(nodes.size());
+        for (std::size_t i = 0; i < nodes.size(); i++) index[nodes[i].get()] = i;
+        for (std::size_t i = 0; i < nodes.size(); i++) {
+            edge_begin[i] = edges.size();
+            for (auto& prev : nodes[i]->prev) {
+                // pruned by the walk, see run_backward, the closures do not
+                // write into a parent which requires no gradient
+                if (!prev || !prev->requires_grad) continue;
+                std::size_t p = index[prev.get()];
+                edges.push_back(p);
+                deps[p].fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        edge_begin[nodes.size()] = edges.size();
+    }
+};
+
+// dependency counting on the work stealing pool, a node is ready as soon as
+// every node which uses it has pushed its gradient into it. A thread keeps
+// going depth first with the newest ready node and hands the others to the pool
+template<typename S>
+static void run_backward_tasks(BackwardGraph<S>& graph) {
+    ThreadPool& pool = Parallel::pool();
+    TaskGroup group(pool);
+    std::function<void(std::size_t)> run_chunk;
+    run_chunk = [&](std::size_t start) {
+        Parallel::BackwardScope backward_scope;
+        std::vector<std::size_t> stack{start};
+        std::vector<std::size_t> held;
+        while (!stack.empty()) {
+            std::size_t i = stack.back();
+            stack.pop_back();
+            BasicImpl<S>* node = graph.nodes[i].get();
+            if (node->backward_fn) {
+                held.clear();
+                for (std::size_t e = graph.edge_begin[i]; e < graph.edge_begin[i + 1]; e++) {
+                    held.push_back(stripe_of(graph.nodes[graph.edges[e]].get()));
+                }
+                StripeLocks locks(held);
+                call_backward(node);
+            }
+            for (std::size_t e = graph.edge_begin[i]; e < graph.edge_begin[i + 1]; e++) {
+                std::size_t p = graph.edges[e];
+                if (graph.deps[p].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    stack.push_back(p);
+                }
+            }
+            while (stack.size() > 1) {
+                std::size_t j = stack.front();
+                stack.erase(stack.begin());
+                group.run([&run_chunk, j]() { run_chunk(j); });
+            }
         }
-        topo_order.push_back(node);
     };
 
-    dfs(impl);
+    // the roots are collected before anything runs, otherwise a node which
+    // becomes ready while scanning would be started twice
+    std::vector<std::size_t> roots;
+    for (std::size_t i = 0; i < graph.nodes.size(); i++) {
+        if (graph.deps[i].load(std::memory_order_relaxed) == 0) roots.push_back(i);
+    }
+    for (std::size_t i : roots) {
+        group.run([&run_chunk, i]() { run_chunk(i); });
+    }
+    group.wait();
+}
+
+// deterministic mode: the ready nodes are run in waves where no two nodes of
+// a wave write to the same parent, so no locks are needed and every parent
+// receives its gradients in an order which only depends on the graph
+template<typename S>
+static void run_backward_waves(BackwardGraph<S>& graph) {
+    const std::size_t none = static_cast<std::size_t>(-1);
+    std::vector<std::size_t> claimed(graph.nodes.size(), none);
+    std::vector<std::size_t> ready, batch, deferred;
+    for (std::size_t i = 0; i < graph.nodes.size(); i++) {
+        if (graph.deps[i].load(std::memory_order_relaxed) == 0) ready.push_back(i);
+    }
+
+    for (std::size_t wave = 0; !ready.empty(); wave++) {
+        batch.clear();
+        deferred.clear();
+        for (std::size_t i : ready) {
+            bool conflict = false;
+            for (std::size_t e = graph.edge_begin[i]; e < graph.edge_begin[i + 1] && !conflict; e++) {
+                conflict = claimed[graph.edges[e]] == wave;
+            }
+            if (conflict) {
+                deferred.push_back(i);
+                continue;
+            }
+            for (std::size_t e = graph.edge_begin[i]; e < graph.edge_begin[i + 1]; e++) {
+                claimed[graph.edges[e]] = wave;
+            }
+            batch.push_back(i);
+        }
+
+        Parallel::parallel_for(0, batch.size(), 64, [&](std::size_t lo, std::size_t hi) {
+            Parallel::BackwardScope backward_scope;
+            for (std::size_t k = lo; k < hi; k++) {
+                call_backward(graph.nodes[batch[k]].get());
+            }
+        });
+
+        for (std::size_t i : batch) {
+            for (std::size_t e = graph.edge_begin[i]; e < graph.edge_begin[i + 1]; e++) {
+                std::size_t p = graph.edges[e];
+                if (graph.deps[p].fetch_sub(1, std::memory_order_relaxed) == 1) deferred.push_back(p);
+            }
+        }
+        // the topological position decides who goes first in the next wave
+        std::sort(deferred.begin(), deferred.end());
+        ready.swap(deferred);
+    }
+}
+
+template<typename S>
+void BasicTensor<S>::run_backward(const std::vector<std::shared_ptr<BasicImpl<S>>>& roots) {
+    std::vector<std::shared_ptr<BasicImpl<S>>> topo_order;
+    std::unordered_set<BasicImpl<S>*> visited;
+
+    // depth first search with an explicit stack since a long chain would
+    // overflow the call stack, a node is added after all of its prev (post
+    // order). The stack points at the shared_ptr in the parent's prev (or in
+    // roots), those do not move while the graph is walked
+    std::vector<std::pair<const std::shared_ptr<BasicImpl<S>>*, std::size_t>> stack;
+    auto visit = [&](const std::shared_ptr<BasicImpl<S>>& node) {
+        // a node which requires no gradient is pruned with everything behind
+        // it: a constant (folded op, comparison) or a leaf which asks for
+        // none. insert() tells whether the raw pointer was already in the set
+        if (node && node->requires_grad && visited.insert(node.get()).second) {
+            stack.emplace_back(&node, 0);
+        }
+    };
+
+    for (auto& root : roots) {
+        visit(root);
+        while (!stack.empty()) {
+            auto& [node, next] = stack.back();
+            const auto& prev = (*node)->prev;
+            if (next < prev.size()) {
+                visit(prev[next++]);
+                continue;
+            }
+            topo_order.push_back(*node);
+            stack.pop_back();
+        }
+    }
 
     // reverse topological order to propagate gradients
     std::reverse(topo_order.begin(), topo_order.end());
-    for (auto& node : topo_order) {
-        if (node->backward_fn) node->backward_fn();
+
+    // a backward which is started from inside a backward function (a
+    // checkpointed block recomputing its graph) stays on its thread
+    if (Parallel::inside_backward() || topo_order.size() < Parallel::min_parallel_nodes || Parallel::num_threads() == 1) {
+        for (auto& node : topo_order) {
+            call_backward(node.get());
+        }
+        return;
+    }
+
+    BackwardGraph<S> graph(std::move(topo_order));
+    if (Parallel::deterministic()) {
+        run_backward_waves(graph);
+    } else {
+        run_backward_tasks(graph);
     }
 }
 
+// the element types of DType.h, the members above are compiled once per type
+template class BasicImpl<float>;
+template class BasicImpl<double>;
+template class BasicImpl<bfloat16>;
+template class BasicImpl<float16>;
+template class BasicTensor<float>;
+template class BasicTensor<double>;
+template class BasicTensor<bfloat16>;
+template class BasicTensor<float16>;
+
 
 // Use pass-by-value to support lvalues and rvalues equally
 // Tensor operator+(Tensor lhs, Tensor rhs) {
@@ -57,8 +312,8 @@ void Tensor::backward() {
 //     // so they point to the same location
 //     out.impl->prev = {lhs.impl, rhs.impl};
 //     out.impl->backward_fn = [lhs_impl = lhs.impl, rhs_impl = rhs.impl, out_impl = out.impl]() {
-//         lhs_impl->grad += out_impl->grad;
-//         rhs_impl->grad += out_impl->grad;
+//         lhs_impl->grad() += out_impl->grad();
+//         rhs_impl->grad() += out_impl->grad();
 //     };
 //     return out;
 // }
@@ -91,8 +346,8 @@ void Tensor::backward() {
 
 //     // since the parameters persist impl pointers point to the correct memory location
 //     out.impl->backward_fn = [lhs_impl = lhs.impl, rhs_impl = rhs.impl, out_impl = out.impl]() {
-//         lhs_impl->grad += rhs_impl->val * out_impl->grad;
-//         rhs_impl->grad += lhs_impl->val * out_impl->grad;
+//         lhs_impl->grad() += rhs_impl->val() * out_impl->grad();
+//         rhs_impl->grad() += lhs_impl->val() * out_impl->grad();
 //     };
 //     return out;
 // }
@@ -4,10 +4,15 @@
 #include <vector>
 #include <type_traits>
 #include <cmath>
+#include <cstdint>
 #include <exception>
 #include <functional>
 #include <numbers>
+#include "DType.h"
+#include "GradMode.h"
+#include "GraphMemory.h"
 #include "Logger.h"
+#include "Profiler.h"
 
 // 3. Logical (for boolean arrays)
 // & (logical AND)
@@ -26,72 +31,250 @@
 
 // if using template functions then declare and define in 
 
-class Impl {
+// S is the element type (DType.h), the gradient is accumulated in
+// accumulate_t<S> so a bfloat16 node keeps a float gradient
+template<typename S>
+class BasicImpl {
+public:
+    using value_type = S;
+    using grad_type = accumulate_t<S>;
+
+private:
+    // value and gradient of a node which is not bound to a parameter buffer
+    S own_val;
+    grad_type own_grad{};
+    S* val_ptr = &own_val;
+    grad_type* grad_ptr = &own_grad;
+    std::shared_ptr<void> storage; // keeps the buffer alive the pointers point into
+
 public:
-    float val;
-    float grad = 0.0f;
     std::function<void()> backward_fn;
-    std::vector<std::shared_ptr<Impl>> prev;
+    std::vector<std::shared_ptr<BasicImpl>> prev;
+    uint32_t profile_key = 0; // the op and call site which created the node
+    bool requires_grad = true; // a leaf asks for a gradient, see GradMode.h
+    bool profiled = false;     // created while the profiler was on
+    uint8_t rounded_to = 0;    // dtype_id of the type round_to rounded the value to, 0 if none
+
+private:
+    // what set_backward counted in GraphMemory, taken out again by the destructor
+    uint32_t held_edges = 0;
+    uint32_t held_closure_bytes = 0;
+
+public:
+    BasicImpl(S v) : own_val(v) {
+        GraphMemory::node_created();
+        if (Profiler::enabled()) {
+            // make_shared puts the node and its two counts (plus a vtable pointer) in one block
+            profile_key = Profiler::node_created(sizeof(BasicImpl) + 16);
+            profiled = true;
+        }
+    }
+    // frees the graph behind the node without recursion, see Tensor.cpp
+    ~BasicImpl();
+    // the pointers point into the node itself
+    BasicImpl(const BasicImpl&) = delete;
+    BasicImpl& operator=(const BasicImpl&) = delete;
+
+    S& val() { return *val_ptr; }
+    grad_type& grad() { return *grad_ptr; }
+
+    // a backward_fn adds to the gradient of an input through here, an input
+    // which requires no gradient (a frozen leaf) is left at zero
+    template<typename G>
+    void accumulate(G g) {
+        if (requires_grad) *grad_ptr += g;
+    }
+
+    // moves the value and the gradient to the given slots of a flat
+    // buffer, owner is whatever keeps that buffer alive
+    void bind(S* val_slot,grad_type* grad_slot,std::shared_ptr<void> owner) {
+        *val_slot = *val_ptr;
+        *grad_slot = *grad_ptr;
+        val_ptr = val_slot;
+        grad_ptr = grad_slot;
+        storage = std::move(owner);
+    }
 
-    Impl(float v) : val(v) {}
+    // every op sets its backward through here after prev, so GraphMemory
+    // and the profiler see what the node holds on to besides itself
+    template<typename F>
+    void set_backward(F&& fn) {
+        // no input needs a gradient (or the grad mode is off): the op is
+        // folded into a constant, it keeps its value and drops the rest
+        if (!GradMode::enabled() || !inputs_require_grad()) {
+            std::vector<std::shared_ptr<BasicImpl>>().swap(prev);
+            requires_grad = false;
+            return;
+        }
+        requires_grad = true;
+        backward_fn = std::forward<F>(fn);
+        // std::function stores a closure of more than two pointers on the heap
+        uint32_t closure = sizeof(std::decay_t<F>) > 2 * sizeof(void*) ? sizeof(std::decay_t<F>) : 0;
+        uint32_t edges = static_cast<uint32_t>(prev.size());
+        GraphMemory::holds(static_cast<int64_t>(edges) - held_edges,
+            static_cast<int64_t>(closure) - held_closure_bytes);
+        held_edges = edges;
+        held_closure_bytes = closure;
+        if (Profiler::enabled()) {
+            Profiler::allocated(closure + prev.capacity() * sizeof(std::shared_ptr<BasicImpl>));
+        }
+    }
+
+    bool inputs_require_grad() const {
+        for (const auto& p : prev) {
+            if (p && p->requires_grad) return true;
+        }
+        return false;
+    }
+
+    // the inputs were moved to the node which absorbed this one (Fusion.h),
+    // its edges are counted there
+    void clear_prev() {
+        prev.clear();
+        GraphMemory::holds(-static_cast<int64_t>(held_edges), 0);
+        held_edges = 0;
+    }
 };
+
+using Impl = BasicImpl<float>;
+
 // this is required since this Impl is given to be owned by someone
 //atleast but i do not want (this) pointer to  be owned by someone
 // everytime
 template<typename>
 inline constexpr bool always_false = false;
 
-class Tensor {
-    std::shared_ptr<Impl> impl; // if this shared pointer has no owner then it
+class Checkpoint;
+
+template<typename S>
+class BasicTensor;
+
+template<typename E>
+class Expr;
+
+class Fusion;
+
+template<typename T>
+struct is_tensor : std::false_type {};
+
+template<typename S>
+struct is_tensor<BasicTensor<S>> : std::true_type {};
+
+template<typename T>
+inline constexpr bool is_tensor_v = is_tensor<T>::value;
+
+// a scalar node of the graph with element type S (float, double, bfloat16 or
+// float16, see DType.h), Tensor is BasicTensor<float>. The ops compute in
+// compute_type, which is S itself or float for the 16 bit types, and round the
+// result to S. A graph has one element type, the ops only take tensors of
+// their own type and numbers
+template<typename S>
+class BasicTensor {
+    static_assert(is_dtype_v<S>,"BasicTensor supports float, double, bfloat16 and float16");
+
+public:
+    using value_type = S;
+    using compute_type = accumulate_t<S>;
+    using grad_type = typename BasicImpl<S>::grad_type;
+
+private:
+    std::shared_ptr<BasicImpl<S>> impl; // if this shared pointer has no owner then it
     //  going to get destroyed
 
+    // the checkpoint needs to build nodes by hand and run
+    // the backward of a recomputed graph
+    friend class Checkpoint;
+
+    // an expression (Expression.h) turns into one node of its own
+    template<typename>
+    friend class Expr;
+
+    // the fusion pass rewires the graph behind a tensor
+    friend class Fusion;
+
+    // runs the backward functions of everything reachable from the roots
+    // in reverse topological order, the gradients of the roots have to be seeded
+    static void run_backward(const std::vector<std::shared_ptr<BasicImpl<S>>>& roots);
+
 public:
-    Tensor(float val);
-    Tensor();  // Default constructor
+    BasicTensor(compute_type val);
+    BasicTensor();  // Default constructor
         // Shallow copy constructor
-    Tensor(const Tensor& other) : impl(other.impl) {}
+    BasicTensor(const BasicTensor& other) : impl(other.impl) {}
 
     // Shallow copy assignment
-    Tensor& operator=(const Tensor& other) {
+    BasicTensor& operator=(const BasicTensor& other) {
         if (this != &other) {
             impl = other.impl;
         }
         return *this;
     }
 
-    float value() const;
-    float grad() const;
+    compute_type value() const;
+    grad_type grad() const;
     void backward();
 
+    // a leaf which does not ask for a gradient, ops on constants only are folded
+    static BasicTensor constant(compute_type val) {
+        BasicTensor out(val);
+        out.impl->requires_grad = false;
+        return out;
+    }
+
+    // whether backward reaches the node, set it on leaves (a frozen
+    // parameter, data), a node computed by an op gets it from its inputs.
+    // Nothing is propagated behind a node which requires no gradient, what
+    // its consumers push into its own grad() is left there unused
+    bool requires_grad() const { return impl->requires_grad; }
+    BasicTensor& requires_grad(bool on) {
+        impl->requires_grad = on;
+        return *this;
+    }
+
+    void zero_grad() {
+        impl->grad() = grad_type{};
+    }
+
+    // the value and the gradient live in the given slots from now on, every
+    // copy of this tensor sees them since they share the node
+    void bind(S* val_slot,grad_type* grad_slot,std::shared_ptr<void> owner) {
+        impl->bind(val_slot,grad_slot,std::move(owner));
+    }
+
     template<typename T>
-    Tensor operator+(T&& rhs)
+    typename std::enable_if<
+        std::is_same_v<std::decay_t<T>,BasicTensor> || std::is_arithmetic_v<std::decay_t<T>>,
+        BasicTensor
+    >::type
+    operator+(T&& rhs)
     {
-        Tensor out{};
+        ProfileOp profile("add");
+        BasicTensor out{};
         try
         {
-            if constexpr(std::is_same_v<std::decay_t<T>,Tensor>)
+            if constexpr(std::is_same_v<std::decay_t<T>,BasicTensor>)
             {            // Tensors can be lost but the actual content 
                 // of the tensor needs to be shared
-                out.impl->val = this->value() +  rhs.value();
+                out.impl->val() = this->value() +  rhs.value();
                 out.impl->prev = {this->impl,rhs.impl}; // transfering the ownership
                 // of the actual content to a data structure
-                // since we take the copy of the *this pointer 
-                // so we do not access the updated gradients by previous backprop
-                // which is flowing backwards
-                out.impl->backward_fn = [object = *this, rhs_impl = rhs.impl, out_impl = out.impl]() {
-                    object.impl->grad += out_impl->grad;
-                    rhs_impl->grad += out_impl->grad;
-                };
+                // the closure lives in out and prev keeps the inputs alive, so
+                // it takes plain pointers, a shared_ptr to out would be a cycle
+                // and the node (with everything before it) would never be freed
+                out.impl->set_backward([self = this->impl.get(), rhs_impl = rhs.impl.get(), out_impl = out.impl.get()]() {
+                    self->accumulate(out_impl->grad());
+                    rhs_impl->accumulate(out_impl->grad());
+                });
 
                 Logger::info("Successfully added the tensor with another tensor");
             }
             else if constexpr(std::is_arithmetic_v<std::decay_t<T>>)
             {
-                out.impl->val = this->value() + rhs;
+                out.impl->val() = this->value() + rhs;
                 out.impl->prev = {this->impl}; // transfering the ownership
-                out.impl->backward_fn = [object = *this, out_impl = out.impl]() {
-                    object.impl->grad += out_impl->grad;
-                };
+                out.impl->set_backward([self = this->impl.get(), out_impl = out.impl.get()]() {
+                    self->accumulate(out_impl->grad());
+                });
                 Logger::info("Successfully added the tensor with another number");
             }
             else
@@ -114,30 +297,35 @@ public:
 
 
     template<typename T>
-    Tensor operator-(T&& rhs)
+    typename std::enable_if<
+        std::is_same_v<std::decay_t<T>,BasicTensor> || std::is_arithmetic_v<std::decay_t<T>>,
+        BasicTensor
+    >::type
+    operator-(T&& rhs)
     {
-        Tensor out{};
+        ProfileOp profile("sub");
+        BasicTensor out{};
         try
         {
-            if constexpr(std::is_same_v<std::decay_t<T>,Tensor>)
+            if constexpr(std::is_same_v<std::decay_t<T>,BasicTensor>)
             // Tensors can be lost but the actual content 
             // of the tensor needs to be shared
             {
-                out.impl->val = this->value() -  rhs.value();
+                out.impl->val() = this->value() -  rhs.value();
                 out.impl->prev = {this->impl,rhs.impl}; // transfering the ownership
-                out.impl->backward_fn = [object = *this, rhs_impl = rhs.impl, out_impl = out.impl]() {
-                    object.impl->grad += out_impl->grad;
-                    rhs_impl->grad -= out_impl->grad;
-                };
+                out.impl->set_backward([self = this->impl.get(), rhs_impl = rhs.impl.get(), out_impl = out.impl.get()]() {
+                    self->accumulate(out_impl->grad());
+                    rhs_impl->accumulate(-out_impl->grad());
+                });
                 Logger::info("successfully substracted a tensor from a tensor");
             }
             else if constexpr(std::is_arithmetic_v<std::decay_t<T>>)
             {
-                out.impl->val = this->value() -  rhs;
+                out.impl->val() = this->value() -  rhs;
                 out.impl->prev = {this->impl}; // transfering the ownership
-                out.impl->backward_fn = [object = *this, out_impl = out.impl]() {
-                    object.impl->grad += out_impl->grad;
-                };
+                out.impl->set_backward([self = this->impl.get(), out_impl = out.impl.get()]() {
+                    self->accumulate(out_impl->grad());
+                });
                 Logger::info("successfully substracted a number from a tensor");
             }
             else
@@ -160,26 +348,31 @@ public:
 
 
     template<typename T>
-    Tensor operator*(T&& other) {
-        Tensor out{};
+    typename std::enable_if<
+        std::is_same_v<std::decay_t<T>,BasicTensor> || std::is_arithmetic_v<std::decay_t<T>>,
+        BasicTensor
+    >::type
+    operator*(T&& other) {
+        ProfileOp profile("mul");
+        BasicTensor out{};
         try {
-            if constexpr (std::is_same_v<std::decay_t<T>, Tensor>) {
+            if constexpr (std::is_same_v<std::decay_t<T>, BasicTensor>) {
                 // Case 1: Multiply by another Tensor
-                out.impl->val = this->value() * other.value();
+                out.impl->val() = this->value() * other.value();
                 out.impl->prev = {this->impl, other.impl};
-                out.impl->backward_fn = [object = *this, other_impl = other.impl, out_impl = out.impl]() {
-                    object.impl->grad += other_impl->val * out_impl->grad;
-                    other_impl->grad += object.value() * out_impl->grad;
-                };
+                out.impl->set_backward([self = this->impl.get(), other_impl = other.impl.get(), out_impl = out.impl.get()]() {
+                    self->accumulate(other_impl->val() * out_impl->grad());
+                    other_impl->accumulate(self->val() * out_impl->grad());
+                });
                 Logger::info("Successfully multiplied a tensor with another tensor");
 
             } else if constexpr (std::is_arithmetic_v<std::decay_t<T>>) {
                 // Case 2: Multiply by a number
-                out.impl->val = this->value() * other;
+                out.impl->val() = this->value() * other;
                 out.impl->prev = {this->impl};
-                out.impl->backward_fn = [object = *this, number = other, out_impl = out.impl]() {
-                    object.impl->grad += number * out_impl->grad;
-                };
+                out.impl->set_backward([self = this->impl.get(), number = other, out_impl = out.impl.get()]() {
+                    self->accumulate(number * out_impl->grad());
+                });
                 Logger::info("Successfully multiplied a tensor with a number");
 
             } else {
@@ -202,34 +395,35 @@ public:
 
     template<typename T>
     typename std::enable_if<
-        std::is_same_v<std::decay_t<T>,Tensor> || std::is_arithmetic_v<std::decay_t<T>>,
-        Tensor
+        std::is_same_v<std::decay_t<T>,BasicTensor> || std::is_arithmetic_v<std::decay_t<T>>,
+        BasicTensor
     >::type
     operator/(T&& other)
     {
-        Tensor out{};
+        ProfileOp profile("div");
+        BasicTensor out{};
         try
         {   
-            if constexpr(std::is_same_v<std::decay_t<T>,Tensor>)
+            if constexpr(std::is_same_v<std::decay_t<T>,BasicTensor>)
             {
-                out.impl->val = this->value() / other.value();
+                out.impl->val() = this->value() / other.value();
                 out.impl->prev = {this->impl,other.impl};
-                out.impl->backward_fn = [object = *this,out_impl = out.impl,other_impl = other.impl](){
-                    object.impl->grad += out_impl->grad / other_impl->val;
-                    other_impl->grad += -1  * out_impl->grad / std::pow(other_impl->val,2);
-                };
+                out.impl->set_backward([self = this->impl.get(),out_impl = out.impl.get(),other_impl = other.impl.get()](){
+                    self->accumulate(out_impl->grad() / other_impl->val());
+                    other_impl->accumulate(-1  * out_impl->grad() / std::pow(other_impl->val(),2));
+                });
 
                 Logger::info("Successfully divided a tensor by a tensor");
             }
             else if constexpr(std::is_arithmetic_v<std::decay_t<T>>)
             {
-                out.impl->val = this->value() / other;
+                out.impl->val() = this->value() / other;
                 out.impl->prev = {this->impl};
                 // do not use &out the tensor get's updated by others and the wrong gradient is passed
-                out.impl->backward_fn = [object = *this,out_impl = out.impl,number = other]()
+                out.impl->set_backward([self = this->impl.get(),out_impl = out.impl.get(),number = other]()
                 {
-                    object.impl->grad += out_impl->grad / number;
-                };
+                    self->accumulate(out_impl->grad() / number);
+                });
             Logger::info("Successfully divided a tensor by a number");
             }
             else
@@ -252,8 +446,8 @@ public:
 
     template<typename T>
     typename std::enable_if<
-        std::is_same_v<std::decay_t<T>,Tensor> || std::is_arithmetic_v<std::decay_t<T>>,
-        Tensor&
+        std::is_same_v<std::decay_t<T>,BasicTensor> || std::is_arithmetic_v<std::decay_t<T>>,
+        BasicTensor&
     >::type
     operator+=(T&& rhs)
     {
@@ -261,7 +455,7 @@ public:
         {
             // Tensors can be lost but the actual content 
             // of the tensor needs to be shared
-            // this->impl->val = this->value() +  rhs.value();
+            // this->impl->val() = this->value() +  rhs.value();
             // this->impl->prev.push_back(rhs.impl); // transfering the ownership
             // of the actual content to a data structure
             
@@ -285,8 +479,8 @@ public:
             // std::function<void()> prev_backward = this->impl->backward_fn;
             // this->impl->backward_fn = [this, rhs_impl = rhs.impl,prev_backward]() {
             //     if(prev_backward) prev_backward();
-            //     this->impl->grad += this->impl->grad;
-            //     rhs_impl->grad += this->impl->grad;
+            //     this->impl->grad() += this->impl->grad();
+            //     rhs_impl->grad() += this->impl->grad();
             // };
             Logger::info("Successfully added a tensor with itself");
         }
@@ -305,8 +499,8 @@ public:
 
     template<typename T>
     typename std::enable_if<
-        std::is_same_v<std::decay_t<T>,Tensor> || std::is_arithmetic_v<std::decay_t<T>>,
-        Tensor&
+        std::is_same_v<std::decay_t<T>,BasicTensor> || std::is_arithmetic_v<std::decay_t<T>>,
+        BasicTensor&
     >::type
     operator-=(T&& rhs)
     {
@@ -338,8 +532,8 @@ public:
 
     template<typename T>
     typename std::enable_if<
-        std::is_same_v<std::decay_t<T>,Tensor> || std::is_arithmetic_v<std::decay_t<T>>,
-        Tensor&
+        std::is_same_v<std::decay_t<T>,BasicTensor> || std::is_arithmetic_v<std::decay_t<T>>,
+        BasicTensor&
     >::type
     operator*=(T&& other)
     {   
@@ -370,8 +564,8 @@ public:
 
     template<typename T>
     typename std::enable_if<
-        std::is_same_v<std::decay_t<T>,Tensor> || std::is_arithmetic_v<std::decay_t<T>>,
-        Tensor
+        std::is_same_v<std::decay_t<T>,BasicTensor> || std::is_arithmetic_v<std::decay_t<T>>,
+        BasicTensor
     >::type
     operator/=(T&& other)
     {
@@ -401,18 +595,19 @@ public:
     }
 
     template<typename T>    
-    Tensor operator==(T&& other)
+    BasicTensor operator==(T&& other)
     {
-        Tensor out{};
+        BasicTensor out{};
+        out.impl->requires_grad = false; // a comparison has no gradient
         try
         {
-            if constexpr(std::is_same_v<std::decay_t<T>,Tensor>)
+            if constexpr(std::is_same_v<std::decay_t<T>,BasicTensor>)
             {
-                out.impl->val = (this->value() == other.value());
+                out.impl->val() = (this->value() == other.value());
             }
             else if constexpr(std::is_arithmetic_v<std::decay_t<T>>)
             {
-                out.impl->val = (this->value() == other);
+                out.impl->val() = (this->value() == other);
             }
             else
             {
@@ -434,18 +629,19 @@ public:
     }
 
     template<typename T>
-    Tensor operator!=(T&& other)
+    BasicTensor operator!=(T&& other)
     {
-        Tensor out{};
+        BasicTensor out{};
+        out.impl->requires_grad = false; // a comparison has no gradient
         try
         {
-            if constexpr(std::is_same_v<std::decay_t<T>,Tensor>)
+            if constexpr(std::is_same_v<std::decay_t<T>,BasicTensor>)
             {
-                out.impl->val = (this->value() != other.value());
+                out.impl->val() = (this->value() != other.value());
             }
             else if constexpr(std::is_arithmetic_v<std::decay_t<T>>)
             {
-                out.impl->val = (this->value() != other);
+                out.impl->val() = (this->value() != other);
             }
             else
             {
@@ -468,18 +664,19 @@ public:
 
     // < (less than)
     template<typename T>
-    Tensor operator<(T&& other)
+    BasicTensor operator<(T&& other)
     {
-        Tensor out{};
+        BasicTensor out{};
+        out.impl->requires_grad = false; // a comparison has no gradient
         try
         {
-            if constexpr(std::is_same_v<std::decay_t<T>,Tensor>)
+            if constexpr(std::is_same_v<std::decay_t<T>,BasicTensor>)
             {
-                out.impl->val = (this->value() < other.value());
+                out.impl->val() = (this->value() < other.value());
             }
             else if constexpr(std::is_arithmetic_v<std::decay_t<T>>)
             {
-                out.impl->val = (this->value() < other);
+                out.impl->val() = (this->value() < other);
             }
             else
             {
@@ -502,18 +699,19 @@ public:
 
     // <= (less than or equal)
     template<typename T>
-    Tensor operator<=(T&& other)
+    BasicTensor operator<=(T&& other)
     {
-        Tensor out{};
+        BasicTensor out{};
+        out.impl->requires_grad = false; // a comparison has no gradient
         try
         {
-            if constexpr(std::is_same_v<std::decay_t<T>,Tensor>)
+            if constexpr(std::is_same_v<std::decay_t<T>,BasicTensor>)
             {
-                out.impl->val = (this->value() <= other.value());
+                out.impl->val() = (this->value() <= other.value());
             }
             else if constexpr(std::is_arithmetic_v<std::decay_t<T>>)
             {
-                out.impl->val = (this->value() <= other);
+                out.impl->val() = (this->value() <= other);
             }
             else
             {
@@ -536,18 +734,19 @@ public:
 
     // > (greater than)
     template<typename T>
-    Tensor operator>(T&& other)
+    BasicTensor operator>(T&& other)
     {
-        Tensor out{};
+        BasicTensor out{};
+        out.impl->requires_grad = false; // a comparison has no gradient
         try
         {
-            if constexpr(std::is_same_v<std::decay_t<T>,Tensor>)
+            if constexpr(std::is_same_v<std::decay_t<T>,BasicTensor>)
             {
-                out.impl->val = (this->value() > other.value());
+                out.impl->val() = (this->value() > other.value());
             }
             else if constexpr(std::is_arithmetic_v<std::decay_t<T>>)
             {
-                out.impl->val = (this->value() > other);
+                out.impl->val() = (this->value() > other);
             }
             else
             {
@@ -570,18 +769,19 @@ public:
 
     // >= (greater than or equal)
     template<typename T>
-    Tensor operator>=(T&& other)
+    BasicTensor operator>=(T&& other)
     {
-        Tensor out{};
+        BasicTensor out{};
+        out.impl->requires_grad = false; // a comparison has no gradient
         try
         {
-            if constexpr(std::is_same_v<std::decay_t<T>,Tensor>)
+            if constexpr(std::is_same_v<std::decay_t<T>,BasicTensor>)
             {
-                out.impl->val = (this->value() >= other.value());
+                out.impl->val() = (this->value() >= other.value());
             }
             else if constexpr(std::is_arithmetic_v<std::decay_t<T>>)
             {
-                out.impl->val = (this->value() >= other);
+                out.impl->val() = (this->value() >= other);
             }
             else
             {
@@ -602,17 +802,19 @@ public:
         return out;        
     }
 
-    Tensor pow(int num)
+    BasicTensor pow(int num)
     {
-        Tensor out{};
-        double data_ = std::pow(this->value(),num);
+        ProfileOp profile("pow");
+        BasicTensor out{};
+        compute_type data_ = static_cast<compute_type>(std::pow(this->value(),num));
         try
         {
-            out.impl->val = data_;
+            out.impl->val() = data_;
             out.impl->prev = {this->impl};
-            out.impl->backward_fn = [object = *this,num,out_impl = out.impl](){
-                object.impl->grad += num * std::pow(object.value(),num-1) * out_impl->grad;
-            };
+            out.impl->set_backward([self = this->impl.get(),num,out_impl = out.impl.get()](){
+                compute_type x = self->val();
+                self->accumulate(num * static_cast<compute_type>(std::pow(x,num-1)) * out_impl->grad());
+            });
             Logger::info("Successfully powered a tensor");
         }
         catch(const std::exception& e)
@@ -628,16 +830,17 @@ public:
         return out;
     }
 
-    Tensor operator-() 
+    BasicTensor operator-() 
     {
-        Tensor out{};
+        ProfileOp profile("neg");
+        BasicTensor out{};
         try
         {
-            out.impl->val = -1.0 * this->value();
+            out.impl->val() = -1.0 * this->value();
             out.impl->prev = {this->impl};
-            out.impl->backward_fn = [object = *this,out_impl = out.impl](){
-                object.impl->grad -= 1.0 * out_impl->grad;
-            };
+            out.impl->set_backward([self = this->impl.get(),out_impl = out.impl.get()](){
+                self->accumulate(-1.0 * out_impl->grad());
+            });
 
             Logger::info("Successfully negated the tensor");
         }
@@ -654,19 +857,20 @@ public:
         return out;
     }
 
-    Tensor sigmoid()
+    BasicTensor sigmoid()
     {
-        double data_ = 1.0f/(1.0f + std::pow(std::numbers::e,-(this->value())));
-        Tensor out{};
+        ProfileOp profile("sigmoid");
+        compute_type data_ = compute_type(1) / (compute_type(1) + std::exp(-this->value()));
+        BasicTensor out{};
         try
         {
-            out.impl->val = data_;
+            out.impl->val() = data_;
             out.impl->prev ={this->impl};
             // if we pass the value of the out it might be updated by something else
             // so tthe gradients might not be calculated properly
-            out.impl->backward_fn = [object = *this,data_,out_impl=out.impl](){
-                object.impl->grad += out_impl->grad * data_*(1-data_);
-            };
+            out.impl->set_backward([self = this->impl.get(),data_,out_impl = out.impl.get()](){
+                self->accumulate(out_impl->grad() * data_*(1-data_));
+            });
             Logger::info("Succesfully sigmoiding a tensor");
         }
         catch(const std::exception& e)
@@ -682,18 +886,19 @@ public:
         return out;
     }
 
-    Tensor exp()
+    BasicTensor exp()
     {
-        double data_ = this->impl->val;
-        Tensor out{}; // keeping the out outside otherwise it will not be identified
+        ProfileOp profile("exp");
+        compute_type data_ = this->value();
+        BasicTensor out{}; // keeping the out outside otherwise it will not be identified
         // by the file while compiling because of the scoping of the local variables
         try
         {
-            out.impl->val = std::exp(data_);
+            out.impl->val() = std::exp(data_);
             out.impl->prev = {this->impl};
-            out.impl->backward_fn = [object = *this,out_impl = out.impl](){
-                object.impl->grad += out_impl->val * out_impl->grad;
-            };
+            out.impl->set_backward([self = this->impl.get(),out_impl = out.impl.get()](){
+                self->accumulate(out_impl->val() * out_impl->grad());
+            });
             Logger::info("Successfully exponentiated a tensor");
         }
         catch(const std::exception& e)
@@ -710,17 +915,18 @@ public:
         return out;
     }
 
-    Tensor log()
+    BasicTensor log()
     {
-        double data_ = this->impl->val;
-        Tensor out{};
+        ProfileOp profile("log");
+        compute_type data_ = this->value();
+        BasicTensor out{};
         try
         {
-            out.impl->val = std::log(data_);
+            out.impl->val() = std::log(data_);
             out.impl->prev = {this->impl};
-            out.impl->backward_fn = [object = *this,data_,out_impl = out.impl](){
-                object.impl->grad += 1/(data_) * out_impl->grad;
-            };
+            out.impl->set_backward([self = this->impl.get(),data_,out_impl = out.impl.get()](){
+                self->accumulate(1/(data_) * out_impl->grad());
+            });
             Logger::info("Successfully log a tensor");
         }
         catch(const std::exception& e)
@@ -736,18 +942,19 @@ public:
         return out;
     }
 
-    Tensor tanh()
+    BasicTensor tanh()
     {
-        double x = this->value();
-        double t = (std::exp(2*x)-1)/(std::exp(2*x)+1);
-        Tensor out{};
+        ProfileOp profile("tanh");
+        // std::tanh, (exp(2x) - 1) / (exp(2x) + 1) is inf / inf in float for x > 44
+        compute_type t = std::tanh(this->value());
+        BasicTensor out{};
         try
         {
-            out.impl->val = t;
+            out.impl->val() = t;
             out.impl->prev = {this->impl};
-            out.impl->backward_fn = [object = *this,t,out_impl = out.impl](){
-                object.impl->grad += (1 - (t*t)) * out_impl->grad;
-            };
+            out.impl->set_backward([self = this->impl.get(),t,out_impl = out.impl.get()](){
+                self->accumulate((1 - (t*t)) * out_impl->grad());
+            });
             Logger::info("Successfully done the tanh function");
         }
         catch(const std::exception& e)
@@ -764,6 +971,69 @@ public:
         return out;
     }
 
+    BasicTensor sqrt()
+    {
+        ProfileOp profile("sqrt");
+        compute_type s = std::sqrt(this->value());
+        BasicTensor out{};
+        try
+        {
+            out.impl->val() = s;
+            out.impl->prev = {this->impl};
+            out.impl->set_backward([self = this->impl.get(),s,out_impl = out.impl.get()](){
+                self->accumulate(0.5 / s * out_impl->grad());
+            });
+            Logger::info("Successfully done the square root");
+        }
+        catch(const std::exception& e)
+        {
+            Logger::error(std::string(e.what()));
+            std::cerr << e.what() << std::endl;
+        }
+        catch(...)
+        {
+            Logger::error("Error while doing the square root");
+            std::cerr << "Error while doing the square root" << std::endl;
+        }
+
+        return out;
+    }
+
+    // the value rounded to the element type D and the gradient rounded the
+    // same way on its way back, what a D copy of the tensor is in a mixed
+    // precision graph while the node itself keeps S (see Autocast)
+    template<typename D>
+    BasicTensor round_to()
+    {
+        static_assert(is_dtype_v<D>,"round_to supports float, double, bfloat16 and float16");
+        // the output of a cast to D already is a D, its value stays as it is
+        // and its own backward rounds the gradient, so no second node
+        if (impl->rounded_to == dtype_id<D>()) return *this;
+        ProfileOp profile("cast");
+        BasicTensor out{};
+        try
+        {
+            out.impl->rounded_to = dtype_id<D>();
+            out.impl->val() = static_cast<compute_type>(static_cast<D>(this->value()));
+            out.impl->prev = {this->impl};
+            out.impl->set_backward([self = this->impl.get(),out_impl = out.impl.get()](){
+                self->accumulate(static_cast<compute_type>(static_cast<D>(out_impl->grad())));
+            });
+            Logger::info("Successfully rounded a tensor");
+        }
+        catch(const std::exception& e)
+        {
+            Logger::error(std::string(e.what()));
+            std::cerr << e.what() << std::endl;
+        }
+        catch(...)
+        {
+            Logger::error("Error while rounding a tensor");
+            std::cerr << "Error while rounding a tensor" << std::endl;
+        }
+        return out;
+    }
+
     std::string shape()
     {
         return "()";
@@ -775,7 +1045,7 @@ public:
     //     return os;
     // }
 
-    friend std::ostream& operator<<(std::ostream& os,const Tensor& tensor)
+    friend std::ostream& operator<<(std::ostream& os,const BasicTensor& tensor)
     {
         os << tensor.value();
         return os;
@@ -784,80 +1054,80 @@ public:
     template<typename T1,class T2>
     typename std::enable_if<
         std::is_arithmetic_v<std::decay_t<T1>> &&
-         std::is_same_v<std::decay_t<T2>,Tensor>,
-        Tensor
+         is_tensor_v<std::decay_t<T2>>,
+        std::decay_t<T2>
     >::type
     friend operator+(T1&& number,T2&& tensor);
 
     template<typename T1,class T2>
     typename std::enable_if<
         std::is_arithmetic_v<std::decay_t<T1>> &&
-         std::is_same_v<std::decay_t<T2>,Tensor>,
-        Tensor
+         is_tensor_v<std::decay_t<T2>>,
+        std::decay_t<T2>
     >::type
     friend operator-(T1&& number,T2&& tensor); 
 
     template<typename T1,class T2>
     typename std::enable_if<
         std::is_arithmetic_v<std::decay_t<T1>> &&
-         std::is_same_v<std::decay_t<T2>,Tensor>,
-        Tensor
+         is_tensor_v<std::decay_t<T2>>,
+        std::decay_t<T2>
     >::type
     friend operator*(T1&& number,T2&& tensor);
 
     template<typename T1,class T2>
     typename std::enable_if<
         std::is_arithmetic_v<std::decay_t<T1>> &&
-         std::is_same_v<std::decay_t<T2>,Tensor>,
-        Tensor
+         is_tensor_v<std::decay_t<T2>>,
+        std::decay_t<T2>
     >::type
     friend operator/(T1&& number,T2&& tensor);
 
     template<typename T1,class T2>
     typename std::enable_if<
         std::is_arithmetic_v<std::decay_t<T1>> &&
-        std::is_same_v<std::decay_t<T2>,Tensor>,
-        Tensor
+        is_tensor_v<std::decay_t<T2>>,
+        std::decay_t<T2>
     >::type
     friend operator==(T1&& number,T2&& tensor);
 
     template<typename T1,class T2>
     typename std::enable_if<
         std::is_arithmetic_v<std::decay_t<T1>> &&
-        std::is_same_v<std::decay_t<T2>,Tensor>,
-        Tensor
+        is_tensor_v<std::decay_t<T2>>,
+        std::decay_t<T2>
     >::type
     friend operator!=(T1&& number,T2&& tensor);
 
     template<typename T1,class T2>
     typename std::enable_if<
         std::is_arithmetic_v<std::decay_t<T1>> &&
-        std::is_same_v<std::decay_t<T2>,Tensor>,
-        Tensor
+        is_tensor_v<std::decay_t<T2>>,
+        std::decay_t<T2>
     >::type
     friend operator>(T1&& number,T2&& tensor);
 
     template<typename T1,class T2>
     typename std::enable_if<
         std::is_arithmetic_v<std::decay_t<T1>> &&
-        std::is_same_v<std::decay_t<T2>,Tensor>,
-        Tensor
+        is_tensor_v<std::decay_t<T2>>,
+        std::decay_t<T2>
     >::type
     friend operator<(T1&& number,T2&& tensor);
 
     template<typename T1,class T2>
     typename std::enable_if<
         std::is_arithmetic_v<std::decay_t<T1>> &&
-        std::is_same_v<std::decay_t<T2>,Tensor>,
-        Tensor
+        is_tensor_v<std::decay_t<T2>>,
+        std::decay_t<T2>
     >::type
     friend operator<=(T1&& number,T2&& tensor);
 
     template<typename T1,class T2>
     typename std::enable_if<
         std::is_arithmetic_v<std::decay_t<T1>> &&
-        std::is_same_v<std::decay_t<T2>,Tensor>,
-        Tensor
+        is_tensor_v<std::decay_t<T2>>,
+        std::decay_t<T2>
     >::type
     friend operator>=(T1&& number,T2&& tensor);
 };
@@ -866,21 +1136,21 @@ public:
 // in the header file is recommemded
 template<typename T1,class T2>
 typename std::enable_if<
-    std::is_arithmetic_v<std::decay_t<T1>> && std::is_same_v<std::decay_t<T2>,Tensor>,
-    Tensor
+    std::is_arithmetic_v<std::decay_t<T1>> && is_tensor_v<std::decay_t<T2>>,
+    std::decay_t<T2>
 >::type
 operator+(T1&& number,T2&& tensor)
 {
-    Tensor out{};
+    ProfileOp profile("add");
+    std::decay_t<T2> out{};
     try
     {
-        out.impl->val = number + tensor.value();
+        out.impl->val() = number + tensor.value();
         out.impl->prev = {tensor.impl};
-        // the out object might not exist later so 
-        // it is good to use the shared pointer
-        out.impl->backward_fn = [tensor_impl = tensor.impl,out_impl = out.impl](){
-            tensor_impl->grad += out_impl->grad;
-        };    
+        // prev owns the tensor and out owns the closure
+        out.impl->set_backward([tensor_impl = tensor.impl.get(),out_impl = out.impl.get()](){
+            tensor_impl->accumulate(out_impl->grad());
+        });    
 
         Logger::info("Added a tensor to a number");
     }
@@ -900,21 +1170,21 @@ operator+(T1&& number,T2&& tensor)
 template<typename T1,class T2>
 typename std::enable_if<
     std::is_arithmetic_v<std::decay_t<T1>> 
-    && std::is_same_v<std::decay_t<T2>,Tensor>,
-    Tensor
+    && is_tensor_v<std::decay_t<T2>>,
+    std::decay_t<T2>
 >::type
 operator-(T1&& number,T2&& tensor)
 {
-        Tensor out{};
+    ProfileOp profile("sub");
+        std::decay_t<T2> out{};
     try
     {
-        out.impl->val = number - tensor.value();
+        out.impl->val() = number - tensor.value();
         out.impl->prev = {tensor.impl};
-        // the out object might not exist later so 
-        // it is good to use the shared pointer
-        out.impl->backward_fn = [tensor_impl = tensor.impl,out_impl = out.impl](){
-            tensor_impl->grad -= out_impl->grad;
-        };    
+        // prev owns the tensor and out owns the closure
+        out.impl->set_backward([tensor_impl = tensor.impl.get(),out_impl = out.impl.get()](){
+            tensor_impl->accumulate(-out_impl->grad());
+        });    
 
         Logger::info("subtracting a tensor to a number");
     }
@@ -934,21 +1204,21 @@ operator-(T1&& number,T2&& tensor)
 template<typename T1,class T2>
 typename std::enable_if<
     std::is_arithmetic_v<std::decay_t<T1>> 
-    && std::is_same_v<std::decay_t<T2>,Tensor>,
-    Tensor
+    && is_tensor_v<std::decay_t<T2>>,
+    std::decay_t<T2>
 >::type
 operator*(T1&& number,T2&& tensor)
 {
-    Tensor out{};
+    ProfileOp profile("mul");
+    std::decay_t<T2> out{};
     try
     {
-        out.impl->val = number * tensor.value();
+        out.impl->val() = number * tensor.value();
         out.impl->prev = {tensor.impl};
-        // the out object might not exist later so 
-        // it is good to use the shared pointer
-        out.impl->backward_fn = [tensor_impl = tensor.impl,number,out_impl = out.impl](){
-            tensor_impl->grad += number * out_impl->grad;
-        };    
+        // prev owns the tensor and out owns the closure
+        out.impl->set_backward([tensor_impl = tensor.impl.get(),number,out_impl = out.impl.get()](){
+            tensor_impl->accumulate(number * out_impl->grad());
+        });    
 
         Logger::info("subtracting a tensor to a number");
     }
@@ -968,21 +1238,21 @@ operator*(T1&& number,T2&& tensor)
 template<typename T1,class T2>
 typename std::enable_if<
     std::is_arithmetic_v<std::decay_t<T1>> 
-    && std::is_same_v<std::decay_t<T2>,Tensor>,
-    Tensor
+    && is_tensor_v<std::decay_t<T2>>,
+    std::decay_t<T2>
 >::type
 operator/(T1&& number,T2&& tensor)
 {
-    Tensor out{};
+    ProfileOp profile("div");
+    std::decay_t<T2> out{};
     try
     {
-        out.impl->val = number / tensor.value();
+        out.impl->val() = number / tensor.value();
         out.impl->prev = {tensor.impl};
-        // the out object might not exist later so 
-        // it is good to use the shared pointer
-        out.impl->backward_fn = [tensor_impl = tensor.impl,value = tensor.value(),out_impl = out.impl](){
-            tensor_impl->grad += -1 * out_impl->grad / (std::exp(value,2));
-        };    
+        // prev owns the tensor and out owns the closure
+        out.impl->set_backward([tensor_impl = tensor.impl.get(),value = tensor.value(),number,out_impl = out.impl.get()](){
+            tensor_impl->accumulate(-1 * number * out_impl->grad() / std::pow(value,2));
+        });    
 
         Logger::info("subtracting a tensor to a number");
     }
@@ -1006,15 +1276,16 @@ operator/(T1&& number,T2&& tensor)
 template<typename T1,class T2>
 typename std::enable_if<
     std::is_arithmetic_v<std::decay_t<T1>> &&
-    std::is_same_v<std::decay_t<T2>,Tensor>,
-    Tensor
+    is_tensor_v<std::decay_t<T2>>,
+    std::decay_t<T2>
 >::type
 operator==(T1&& number,T2&& tensor)
 {
-    Tensor out{};
+    std::decay_t<T2> out{};
+    out.impl->requires_grad = false; // a comparison has no gradient
     try
     {
-        out.impl->val = (number == tensor.value());
+        out.impl->val() = (number == tensor.value());
         Logger::info("Successfully compared a number with a tensor using the == operator");
     }
     catch(const std::exception& e)
@@ -1033,15 +1304,16 @@ operator==(T1&& number,T2&& tensor)
 template<typename T1,class T2>
 typename std::enable_if<
     std::is_arithmetic_v<std::decay_t<T1>> &&
-    std::is_same_v<std::decay_t<T2>,Tensor>,
-    Tensor
+    is_tensor_v<std::decay_t<T2>>,
+    std::decay_t<T2>
 >::type
 operator!=(T1&& number,T2&& tensor)
 {
-    Tensor out{};
+    std::decay_t<T2> out{};
+    out.impl->requires_grad = false; // a comparison has no gradient
     try
     {
-        out.impl->val = (number != tensor.value());
+        out.impl->val() = (number != tensor.value());
         Logger::info("Successfully compared a number with a tensor using the != operator");
     }
     catch(const std::exception& e)
@@ -1060,16 +1332,17 @@ operator!=(T1&& number,T2&& tensor)
 template<typename T1,class T2>
 typename std::enable_if<
     std::is_arithmetic_v<std::decay_t<T1>> &&
-    std::is_same_v<std::decay_t<T2>,Tensor>,
-    Tensor
+    is_tensor_v<std::decay_t<T2>>,
+    std::decay_t<T2>
 >::type
 operator>(T1&& number,T2&& tensor)
 {
-    Tensor out{};
+    std::decay_t<T2> out{};
+    out.impl->requires_grad = false; // a comparison has no gradient
 
     try
     {
-        out.impl->val = (number > tensor.value());
+        out.impl->val() = (number > tensor.value());
         Logger::info("Successfully compared a number with a tensor using the > operator");
     }
     catch(const std::exception& e)
@@ -1088,16 +1361,17 @@ operator>(T1&& number,T2&& tensor)
 template<typename T1,class T2>
 typename std::enable_if<
     std::is_arithmetic_v<std::decay_t<T1>> &&
-    std::is_same_v<std::decay_t<T2>,Tensor>,
-    Tensor
+    is_tensor_v<std::decay_t<T2>>,
+    std::decay_t<T2>
 >::type
 operator<(T1&& number,T2&& tensor)
 {
-    Tensor out{};
+    std::decay_t<T2> out{};
+    out.impl->requires_grad = false; // a comparison has no gradient
 
     try
     {
-        out.impl->val = (number < tensor.value());
+        out.impl->val() = (number < tensor.value());
         Logger::info("Successfully compared a number with a tensor using the > operator");
     }
     catch(const std::exception& e)
@@ -1116,15 +1390,16 @@ operator<(T1&& number,T2&& tensor)
 template<typename T1,class T2>
 typename std::enable_if<
     std::is_arithmetic_v<std::decay_t<T1>> &&
-    std::is_same_v<std::decay_t<T2>,Tensor>,
-    Tensor
+    is_tensor_v<std::decay_t<T2>>,
+    std::decay_t<T2>
 >::type
 operator<=(T1&& number,T2&& tensor)
 {
-    Tensor out{};
+    std::decay_t<T2> out{};
+    out.impl->requires_grad = false; // a comparison has no gradient
     try
     {
-        out.impl->val = (number <= tensor.value());
+        out.impl->val() = (number <= tensor.value());
         Logger::info("Successfully compared a number with a tensor using the <= operator");
     }
     catch(const std::exception& e)
@@ -1143,16 +1418,17 @@ operator<=(T1&& number,T2&& tensor)
 template<typename T1,class T2>
 typename std::enable_if<
     std::is_arithmetic_v<std::decay_t<T1>> &&
-    std::is_same_v<std::decay_t<T2>,Tensor>,
-    Tensor
+    is_tensor_v<std::decay_t<T2>>,
+    std::decay_t<T2>
 >::type
 operator>=(T1&& number,T2&& tensor)
 {
-    Tensor out{};
+    std::decay_t<T2> out{};
+    out.impl->requires_grad = false; // a comparison has no gradient
 
     try
     {
-        out.impl->val = (number >= tensor.value());
+        out.impl->val() = (number >= tensor.value());
         Logger::info("Successfully compared a number with a tensor using the >= operator");
     }
     catch(const std::exception& e)
@@ -1166,4 +1442,6 @@ operator>=(T1&& number,T2&& tensor)
         std::cerr << "Error while comparing a number with a tensor using the >= operator" << std::endl;
     }
     return out;
-}
\ No newline at end of file
+}
+
+using Tensor = BasicTensor<float>;
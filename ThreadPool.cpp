@@ -0,0 +1,10 @@
+#include "ThreadPool.h"
+// static members have to be defined in exactly one translation unit
+thread_local ThreadPool* ThreadPool::current_pool = nullptr;
+thread_local std::size_t ThreadPool::current_index = 0;
+
+std::mutex Parallel::mutex;
+std::size_t Parallel::threads = 0;
+bool Parallel::deterministic_ = false;
+std::unique_ptr<ThreadPool> Parallel::pool_;
+thread_local bool Parallel::inside_backward_ = false;
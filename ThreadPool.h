@@ -0,0 +1,334 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Profiler.h"
+
+// Work stealing thread pool
+// every worker has its own deque, it pushes and pops at the back (newest
+// task first, which keeps the data hot in its cache) and when it runs out
+// of work it steals from the front of the other deques (oldest task first)
+class ThreadPool
+{
+        struct Queue
+        {
+            std::mutex mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::vector<std::thread> workers;
+        std::mutex sleep_mutex;
+        std::condition_variable wake;
+        std::atomic<std::size_t> queued{0};
+        std::atomic<std::size_t> next_queue{0};
+        bool stopping = false;
+
+        // which pool and which deque the current thread belongs to
+        static thread_local ThreadPool* current_pool;
+        static thread_local std::size_t current_index;
+
+        bool pop(std::size_t index,std::function<void()>& task)
+        {
+            Queue& queue = *queues[index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if(queue.tasks.empty()) return false;
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+            queued--;
+            return true;
+        }
+
+        bool steal(std::size_t thief,std::function<void()>& task)
+        {
+            for(std::size_t k = 1;k <= queues.size();k++)
+            {
+                Queue& queue = *queues[(thief + k) % queues.size()];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if(queue.tasks.empty()) continue;
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+                queued--;
+                return true;
+            }
+            return false;
+        }
+
+        void worker_loop(std::size_t index)
+        {
+            current_pool = this;
+            current_index = index;
+            std::function<void()> task;
+            while(true)
+            {
+                if(pop(index,task) || steal(index,task))
+                {
+                    task();
+                    task = nullptr;
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(sleep_mutex);
+                wake.wait(lock,[this](){ return stopping || queued.load() > 0; });
+                if(stopping && queued.load() == 0) return;
+            }
+        }
+
+    public:
+        explicit ThreadPool(std::size_t threads)
+        {
+            threads = std::max<std::size_t>(threads,1);
+            for(std::size_t i = 0;i < threads;i++)
+            {
+                queues.push_back(std::make_unique<Queue>());
+            }
+            for(std::size_t i = 0;i < threads;i++)
+            {
+                workers.emplace_back(&ThreadPool::worker_loop,this,i);
+            }
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for(auto& worker : workers)
+            {
+                worker.join();
+            }
+        }
+
+        std::size_t size() const
+        {
+            return workers.size();
+        }
+
+        // a task submitted from a worker goes to its own deque,
+        // from outside of the pool the deques are filled round robin
+        void submit(std::function<void()> task)
+        {
+            std::size_t index = current_pool == this ? current_index
+                : next_queue.fetch_add(1) % queues.size();
+            {
+                std::lock_guard<std::mutex> lock(queues[index]->mutex);
+                queues[index]->tasks.push_back(std::move(task));
+                queued++;
+            }
+            {
+                // taking the lock makes sure a worker which is just about
+                // to sleep sees the new task before waiting
+                std::lock_guard<std::mutex> lock(sleep_mutex);
+            }
+            wake.notify_one();
+        }
+
+        // lets a thread which waits for tasks help instead of blocking
+        // returns false if there was nothing to run
+        bool try_run_one()
+        {
+            std::function<void()> task;
+            std::size_t index = current_pool == this ? current_index : 0;
+            if((current_pool == this && pop(index,task)) || steal(index,task))
+            {
+                task();
+                return true;
+            }
+            return false;
+        }
+
+        bool in_worker() const
+        {
+            return current_pool == this;
+        }
+};
+
+// a set of tasks which can be waited for, the waiting thread
+// runs pending tasks of the pool so waiting from inside a task does not deadlock
+class TaskGroup
+{
+        ThreadPool& pool;
+        std::atomic<std::size_t> pending{0};
+        std::mutex error_mutex;
+        std::exception_ptr error;
+
+    public:
+        explicit TaskGroup(ThreadPool& pool) : pool(pool) {}
+
+        ~TaskGroup()
+        {
+            // the tasks capture this group so it has to outlive them
+            while(pending.load() > 0)
+            {
+                if(!pool.try_run_one()) std::this_thread::yield();
+            }
+        }
+
+        void run(std::function<void()> task)
+        {
+            pending++;
+            pool.submit([this,task = std::move(task)](){
+                try
+                {
+                    task();
+                }
+                catch(...)
+                {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if(!error) error = std::current_exception();
+                }
+                pending--;
+            });
+        }
+
+        void wait()
+        {
+            while(pending.load() > 0)
+            {
+                if(!pool.try_run_one()) std::this_thread::yield();
+            }
+            if(error)
+            {
+                std::exception_ptr e = error;
+                error = nullptr;
+                std::rethrow_exception(e);
+            }
+        }
+};
+
+// global settings of the parallel execution, configured like the Logger
+class Parallel
+{
+        static std::mutex mutex;
+        static std::size_t threads;
+        static bool deterministic_;
+        static std::unique_ptr<ThreadPool> pool_;
+        static thread_local bool inside_backward_;
+
+        // 0 means one thread per hardware thread, resolved on use so it
+        // also works while other static objects are being initialised
+        static std::size_t resolved_threads()
+        {
+            if(threads == 0) return std::max<std::size_t>(std::thread::hardware_concurrency(),1);
+            return threads;
+        }
+
+    public:
+        // graphs smaller than this are cheaper to run on one thread
+        static constexpr std::size_t min_parallel_nodes = 2048;
+        // reductions smaller than this are summed on one thread
+        static constexpr std::size_t min_parallel_reduce = 4096;
+        // block size of the deterministic reductions, fixed so that the
+        // reduction tree is the same on every machine
+        static constexpr std::size_t reduction_block = 64;
+
+        static void set_num_threads(std::size_t n)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            n = std::max<std::size_t>(n,1);
+            if(n != resolved_threads())
+            {
+                pool_.reset();
+            }
+            threads = n;
+        }
+
+        static std::size_t num_threads()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return resolved_threads();
+        }
+
+        // in deterministic mode the results do not depend on the
+        // scheduling of the threads or on the number of threads
+        static void set_deterministic(bool on)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            deterministic_ = on;
+        }
+
+        static bool deterministic()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return deterministic_;
+        }
+
+        // set while the current thread runs backward functions, see BackwardScope
+        static bool inside_backward()
+        {
+            return inside_backward_;
+        }
+
+        // marks the current thread as running backward functions. A backward
+        // task holds the locks of the parents it writes to, so parallel_for
+        // runs inline there: waiting for its chunks would let the thread pick
+        // up another backward task which needs one of the held locks
+        class BackwardScope
+        {
+                bool saved;
+
+            public:
+                BackwardScope() : saved(inside_backward_) { inside_backward_ = true; }
+                ~BackwardScope() { inside_backward_ = saved; }
+                BackwardScope(const BackwardScope&) = delete;
+                BackwardScope& operator=(const BackwardScope&) = delete;
+        };
+
+        // the pool is created on first use with num_threads() workers
+        static ThreadPool& pool()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(!pool_)
+            {
+                pool_ = std::make_unique<ThreadPool>(resolved_threads());
+            }
+            return *pool_;
+        }
+
+        // calls fn(begin,end) on chunks of at least grain elements, on the
+        // calling thread alone inside a backward function
+        static void parallel_for(std::size_t begin,std::size_t end,std::size_t grain,
+            const std::function<void(std::size_t,std::size_t)>& fn)
+        {
+            grain = std::max<std::size_t>(grain,1);
+            std::size_t n = end > begin ? end - begin : 0;
+            std::size_t workers = num_threads();
+            if(workers == 1 || n <= grain || inside_backward_)
+            {
+                if(n > 0) fn(begin,end);
+                return;
+            }
+            std::size_t chunks = std::min(workers * 4,(n + grain - 1) / grain);
+            std::size_t chunk = (n + chunks - 1) / chunks;
+            TaskGroup group(pool());
+            // ops in the chunks belong to the call site of the caller
+            uint32_t site = Profiler::enabled() ? Profiler::current() : 0;
+            for(std::size_t lo = begin + chunk;lo < end;lo += chunk)
+            {
+                std::size_t hi = std::min(end,lo + chunk);
+                group.run([&fn,lo,hi,site](){
+                    ProfileSite profile_site(site);
+                    fn(lo,hi);
+                });
+            }
+            // the calling thread does the first chunk itself
+            fn(begin,std::min(end,begin + chunk));
+            group.wait();
+        }
+};
+
+#endif
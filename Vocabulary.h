@@ -0,0 +1,169 @@
+#ifndef VOCABULARY_H
+#define VOCABULARY_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <map>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Character vocabulary backed by two 256 entry lookup tables
+// encoding and decoding a character is one array access and, unlike
+// encoder[ch] on a std::map, an unknown character is never inserted
+class Vocabulary
+{
+    std::array<int16_t,256> to_id;
+    std::array<char,256> to_char{};
+    int size_ = 0;
+
+    public:
+        Vocabulary()
+        {
+            to_id.fill(-1);
+        }
+
+        // the ids are given in the order of the characters
+        static Vocabulary from_chars(std::string_view chars)
+        {
+            Vocabulary vocab;
+            for(char ch : chars)
+            {
+                vocab.add(ch);
+            }
+            return vocab;
+        }
+
+        // one pass over the text (the mapped corpus for example), the
+        // terminator gets id 0 and every other character which appears gets
+        // the next id in sorted order, which is how ctoi was built from a std::set
+        static Vocabulary from_text(std::string_view text,char terminator = '.')
+        {
+            std::array<bool,256> seen{};
+            for(char ch : text)
+            {
+                seen[static_cast<unsigned char>(ch)] = true;
+            }
+            seen[static_cast<unsigned char>('\n')] = false;
+            seen[static_cast<unsigned char>('\r')] = false;
+            seen[static_cast<unsigned char>(terminator)] = false;
+
+            Vocabulary vocab;
+            vocab.add(terminator);
+            for(int c = 0;c < 256;c++)
+            {
+                if(seen[c]) vocab.add(static_cast<char>(c));
+            }
+            return vocab;
+        }
+
+        static Vocabulary from_map(const std::map<char,int>& encoder)
+        {
+            Vocabulary vocab;
+            for(const auto& [ch,ix] : encoder)
+            {
+                if(ix < 0 || ix > 255)
+                {
+                    throw std::runtime_error("Encoder ids have to be between 0 and 255");
+                }
+                vocab.to_id[static_cast<unsigned char>(ch)] = static_cast<int16_t>(ix);
+                vocab.to_char[ix] = ch;
+                vocab.size_ = std::max(vocab.size_,ix + 1);
+            }
+            return vocab;
+        }
+
+        // adds the character with the next free id, returns its id
+        int add(char ch)
+        {
+            int16_t& id = to_id[static_cast<unsigned char>(ch)];
+            if(id == -1)
+            {
+                if(size_ == 256)
+                {
+                    throw std::runtime_error("Vocabulary can only hold 256 characters");
+                }
+                id = static_cast<int16_t>(size_);
+                to_char[size_] = ch;
+                size_++;
+            }
+            return id;
+        }
+
+        int size() const { return size_; }
+        bool contains(char ch) const { return to_id[static_cast<unsigned char>(ch)] != -1; }
+
+        // -1 for a character which is not in the vocabulary
+        int encode(char ch) const { return to_id[static_cast<unsigned char>(ch)]; }
+
+        char decode(int id) const
+        {
+            if(id < 0 || id >= size_)
+            {
+                throw std::runtime_error("Id " + std::to_string(id) + " is not in the vocabulary");
+            }
+            return to_char[id];
+        }
+
+        // writes the ids of the text into out and returns the part which was written
+        template<typename Index>
+        std::span<Index> encode(std::string_view text,std::span<Index> out) const
+        {
+            if(out.size() < text.size())
+            {
+                throw std::runtime_error("Output is too small to encode the text");
+            }
+            int16_t unknown = 0;
+            for(std::size_t i = 0;i < text.size();i++)
+            {
+                int16_t id = to_id[static_cast<unsigned char>(text[i])];
+                unknown |= id; // only negative if some id was -1
+                out[i] = static_cast<Index>(id);
+            }
+            if(unknown < 0)
+            {
+                throw std::runtime_error("Text contains a character which is not in the vocabulary");
+            }
+            return out.first(text.size());
+        }
+
+        template<typename Index = int32_t>
+        std::vector<Index> encode(std::string_view text) const
+        {
+            std::vector<Index> ids(text.size());
+            encode(text,std::span<Index>(ids));
+            return ids;
+        }
+
+        template<typename Index>
+        std::string decode(std::span<const Index> ids) const
+        {
+            std::string text(ids.size(),'\0');
+            for(std::size_t i = 0;i < ids.size();i++)
+            {
+                text[i] = decode(static_cast<int>(ids[i]));
+            }
+            return text;
+        }
+
+        // characters in id order, enough to build the same vocabulary again
+        std::string chars() const
+        {
+            return std::string(to_char.data(),size_);
+        }
+
+        std::map<char,int> to_map() const
+        {
+            std::map<char,int> encoder;
+            for(int id = 0;id < size_;id++)
+            {
+                encoder[to_char[id]] = id;
+            }
+            return encoder;
+        }
+};
+
+#endif
@@ -0,0 +1,490 @@
+// Micro benchmarks of the autograd engine, the matrix ops and the data pipeline
+//
+//     make bench && ./bench --out bench.json --commit $(git rev-parse --short HEAD)
+//     ./bench --filter matmul
+//     ./bench --filter checkpoint --threads 4
+//
+// the JSON of two runs can be compared case by case on median_ns
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "Bench.h"
+#include "Checkpoint.h"
+#include "DataLoader.h"
+#include "Expression.h"
+#include "Fusion.h"
+#include "Matrix.h"
+#include "Tensor.h"
+
+static std::mt19937 gen(42);
+
+static Matrix<Tensor> random_matrix(int rows,int columns)
+{
+    std::normal_distribution<float> normal(0.0f,1.0f);
+    std::shared_ptr<Tensor[]> data = Matrix<Tensor>::allocate(rows * columns);
+    for(int i = 0;i < rows * columns;i++)
+    {
+        data[i] = Tensor{normal(gen)};
+    }
+    return {rows,columns,data};
+}
+
+static Matrix<Tensor> random_vector(int size)
+{
+    std::normal_distribution<float> normal(0.0f,1.0f);
+    std::vector<Tensor> values(size);
+    for(int i = 0;i < size;i++)
+    {
+        values[i] = Tensor{normal(gen)};
+    }
+    return {size,values};
+}
+
+static void bench_scalar_ops(Bench& bench)
+{
+    const int n = 1000;
+    Tensor a{1.5f};
+    Tensor b{0.5f};
+    bench.run("tensor/add x1000",n,[&](){
+        for(int i = 0;i < n;i++)
+        {
+            Tensor c = a + b;
+            do_not_optimize(c);
+        }
+    });
+    bench.run("tensor/mul x1000",n,[&](){
+        for(int i = 0;i < n;i++)
+        {
+            Tensor c = a * b;
+            do_not_optimize(c);
+        }
+    });
+    bench.run("tensor/tanh x1000",n,[&](){
+        for(int i = 0;i < n;i++)
+        {
+            Tensor c = a.tanh();
+            do_not_optimize(c);
+        }
+    });
+    bench.run("tensor/exp x1000",n,[&](){
+        for(int i = 0;i < n;i++)
+        {
+            Tensor c = a.exp();
+            do_not_optimize(c);
+        }
+    });
+    bench.run("tensor/leaf x1000",n,[&](){
+        for(int i = 0;i < n;i++)
+        {
+            Tensor c{static_cast<float>(i)};
+            do_not_optimize(c);
+        }
+    });
+}
+
+static void bench_backward(Bench& bench)
+{
+    for(int n : {1000,10000,100000})
+    {
+        // t = t * 1.0001 + x, two nodes per link
+        Tensor root;
+        Tensor x{0.5f};
+        bench.run("backward/chain " + std::to_string(n),2.0 * n,0.0,[&](){
+            root = Tensor{};
+            Tensor t{1.0f};
+            for(int i = 0;i < n;i++)
+            {
+                t = t * 1.0001f + x;
+            }
+            root = t;
+        },[&](){
+            root.backward();
+        });
+    }
+    for(int n : {1000,10000,100000})
+    {
+        // n products of independent leaves added up by a balanced tree
+        Tensor root;
+        bench.run("backward/wide " + std::to_string(n),2.0 * n,0.0,[&](){
+            root = Tensor{};
+            std::vector<Tensor> level(n);
+            for(int i = 0;i < n;i++)
+            {
+                Tensor a{1.0f + i % 7};
+                level[i] = a * 0.5f;
+            }
+            while(level.size() > 1)
+            {
+                std::vector<Tensor> next((level.size() + 1) / 2);
+                for(std::size_t i = 0;i < next.size();i++)
+                {
+                    next[i] = 2 * i + 1 < level.size() ? level[2 * i] + level[2 * i + 1] : level[2 * i];
+                }
+                level.swap(next);
+            }
+            root = level[0];
+        },[&](){
+            root.backward();
+        });
+    }
+}
+
+// freeing a graph, the last tensor of a chain releases every node before it
+static void bench_release(Bench& bench)
+{
+    for(int n : {10000,100000})
+    {
+        Tensor root;
+        bench.run("graph/release chain " + std::to_string(n),2.0 * n,0.0,[&](){
+            Tensor t{1.0f};
+            Tensor x{0.5f};
+            for(int i = 0;i < n;i++)
+            {
+                t = t * 1.0001f + x;
+            }
+            root = t;
+        },[&](){
+            root = Tensor{};
+        });
+    }
+}
+
+static void bench_matrix(Bench& bench)
+{
+    struct Shape { int m,k,n; };
+    for(Shape s : {Shape{8,8,8},Shape{32,30,64},Shape{32,64,27},Shape{64,64,64}})
+    {
+        Matrix<Tensor> a = random_matrix(s.m,s.k);
+        Matrix<Tensor> b = random_matrix(s.k,s.n);
+        double flops = 2.0 * s.m * s.k * s.n;
+        bench.run("matmul/" + std::to_string(s.m) + "x" + std::to_string(s.k) + "x" + std::to_string(s.n),
+            flops / 2,flops,nullptr,[&](){
+                Matrix<Tensor> c = a.matmul(b);
+                do_not_optimize(c);
+            });
+    }
+
+    for(int n : {16,64})
+    {
+        Matrix<Tensor> a = random_matrix(n,n);
+        Matrix<Tensor> b = random_matrix(n,n);
+        Matrix<Tensor> row = random_matrix(1,n);
+        std::string size = std::to_string(n) + "x" + std::to_string(n);
+        bench.run("elementwise/add " + size,n * n,[&](){
+            Matrix<Tensor> c = a + b;
+            do_not_optimize(c);
+        });
+        bench.run("elementwise/mul " + size,n * n,[&](){
+            Matrix<Tensor> c = a * b;
+            do_not_optimize(c);
+        });
+        bench.run("broadcast/add row " + size,n * n,[&](){
+            Matrix<Tensor> c = a + row;
+            do_not_optimize(c);
+        });
+        bench.run("elementwise/pow " + size,n * n,[&](){
+            Matrix<Tensor> c = a.pow(2);
+            do_not_optimize(c);
+        });
+        Matrix<Tensor> flat = random_vector(n * n);
+        bench.run("reduce/sum " + std::to_string(n * n),n * n,[&](){
+            Tensor t = flat.sum();
+            do_not_optimize(t);
+        });
+        bench.run("reduce/sum dim0 " + size,n * n,[&](){
+            Matrix<Tensor> c = a.sum(0,true);
+            do_not_optimize(c);
+        });
+        bench.run("reduce/sum dim1 " + size,n * n,[&](){
+            Matrix<Tensor> c = a.sum(1,true);
+            do_not_optimize(c);
+        });
+    }
+    Matrix<Tensor> v = random_vector(4096);
+    bench.run("reduce/mean 4096",4096,[&](){
+        Tensor t = v.mean();
+        do_not_optimize(t);
+    });
+}
+
+// the element types of DType.h: a scalar graph per type and dense (not
+// autograd) matrices, where bfloat16 halves the bytes and sums in float
+template<typename S>
+static void bench_dtype(Bench& bench)
+{
+    const int n = 1000;
+    std::string name = dtype_name<S>();
+    BasicTensor<S> a{0.75};
+    bench.run("dtype/" + name + " tanh chain backward x1000",n,[&](){
+        BasicTensor<S> x = a;
+        for(int i = 0;i < n;i++)
+        {
+            x = (x * 0.5 + 0.1).tanh();
+        }
+        x.backward();
+        do_not_optimize(x);
+    });
+
+    const int m = 128;
+    std::normal_distribution<float> normal(0.0f,1.0f);
+    std::shared_ptr<S[]> values = Matrix<S>::allocate(m * m);
+    for(int i = 0;i < m * m;i++)
+    {
+        values[i] = static_cast<S>(normal(gen));
+    }
+    Matrix<S> dense(m,m,values);
+    double flops = 2.0 * m * m * m;
+    bench.run("dtype/" + name + " dense matmul 128",flops / 2,flops,nullptr,[&](){
+        Matrix<S> c = dense.matmul(dense);
+        do_not_optimize(c);
+    });
+}
+
+// the same chain op by op (three nodes a step) and as one fused node a step
+static void bench_expression(Bench& bench)
+{
+    const int n = 1000;
+    Tensor a{0.75f};
+    Tensor w{0.5f};
+    bench.run("expr/eager (x * w + 0.1).tanh() backward x1000",n,[&](){
+        Tensor x = a;
+        for(int i = 0;i < n;i++)
+        {
+            x = (x * w + 0.1f).tanh();
+        }
+        x.backward();
+        do_not_optimize(x);
+    });
+    bench.run("expr/fused (x * w + 0.1).tanh() backward x1000",n,[&](){
+        Tensor x = a;
+        for(int i = 0;i < n;i++)
+        {
+            x = (expr(x) * w + 0.1f).tanh();
+        }
+        x.backward();
+        do_not_optimize(x);
+    });
+}
+
+// backward of (x - mean) / std * gamma + beta over a batch, as built and after the fusion pass
+static void bench_fusion(Bench& bench)
+{
+    const int rows = 64;
+    const int columns = 64;
+    Matrix<Tensor> x = random_matrix(rows,columns);
+    Matrix<Tensor> mean = random_matrix(1,columns);
+    Matrix<Tensor> std = random_matrix(1,columns);
+    Matrix<Tensor> gamma = random_matrix(1,columns);
+    Matrix<Tensor> beta = random_matrix(1,columns);
+    for(int fuse = 0;fuse < 2;fuse++)
+    {
+        bench.run(std::string("fusion/") + (fuse ? "fused" : "eager") + " normalize 64x64 backward",rows * columns,[&](){
+            Tensor total{0.0f};
+            {
+                Matrix<Tensor> y = (x - mean) / std * gamma + beta;
+                for(int i = 0;i < rows * columns;i++)
+                {
+                    total = total + y.flat(i);
+                }
+            }
+            if(fuse) Fusion::run(total);
+            total.backward();
+            do_not_optimize(total);
+        });
+    }
+}
+
+// the same forward recording the graph, under NoGradScope (every op folded)
+// and on a constant input (folded from the start)
+static void bench_grad_mode(Bench& bench)
+{
+    const int n = 1000;
+    Tensor a{0.75f};
+    auto chain = [&](Tensor x){
+        for(int i = 0;i < n;i++)
+        {
+            x = (x * 0.5f + 0.1f).tanh();
+        }
+        return x;
+    };
+    bench.run("nograd/graph tanh chain forward x1000",n,[&](){
+        Tensor x = chain(a);
+        do_not_optimize(x);
+    });
+    bench.run("nograd/no_grad tanh chain forward x1000",n,[&](){
+        NoGradScope no_grad;
+        Tensor x = chain(a);
+        do_not_optimize(x);
+    });
+    bench.run("nograd/constant tanh chain forward x1000",n,[&](){
+        Tensor x = chain(Tensor::constant(0.75f));
+        do_not_optimize(x);
+    });
+}
+
+// forward and backward through four matmul layers as they are and as
+// checkpointed blocks, which keep only their outputs until backward
+static void bench_checkpoint(Bench& bench)
+{
+    const int batch = 16;
+    const int width = 32;
+    const int layers = 4;
+    Matrix<Tensor> x = random_matrix(batch,width);
+    std::vector<Matrix<Tensor>> weights;
+    std::vector<std::vector<Tensor>> params(layers);
+    for(int l = 0;l < layers;l++)
+    {
+        weights.push_back(random_matrix(width,width));
+        for(int i = 0;i < width * width;i++)
+        {
+            params[l].push_back(weights[l].flat(i));
+        }
+    }
+    int64_t peak[2] = {0,0};
+    for(int recompute = 0;recompute < 2;recompute++)
+    {
+        std::string name = std::string("checkpoint/") + (recompute ? "recompute" : "eager") + " 4 matmul 16x32x32 backward";
+        bool ran = bench.run(name,layers,[&](){
+            Tensor total{0.0f};
+            {
+                Matrix<Tensor> h = x;
+                for(int l = 0;l < layers;l++)
+                {
+                    if(recompute)
+                    {
+                        h = checkpoint([&weights,l](Matrix<Tensor>& in){ return in.matmul(weights[l]); },h,params[l]);
+                    }
+                    else
+                    {
+                        h = h.matmul(weights[l]);
+                    }
+                }
+                for(int i = 0;i < batch * width;i++)
+                {
+                    total = total + h.flat(i);
+                }
+            }
+            total.backward();
+            do_not_optimize(total);
+        });
+        if(ran) peak[recompute] = bench.results().back().peak_nodes;
+    }
+    if(peak[0] > 0 && peak[1] > 0)
+    {
+        std::printf("checkpoint: peak nodes %lld -> %lld (-%.1f%%)\n",static_cast<long long>(peak[0]),
+            static_cast<long long>(peak[1]),100.0 * (1.0 - static_cast<double>(peak[1]) / peak[0]));
+    }
+
+    // the sum of a block adds up min_parallel_reduce elements and more, so
+    // its recompute runs a parallel op inside the parallel backward
+    const int side = 128;
+    const int blocks = 8;
+    Matrix<Tensor> a = random_matrix(side,side);
+    Matrix<Tensor> scale = random_matrix(side,side);
+    std::vector<Tensor> scale_params;
+    for(int i = 0;i < side * side;i++)
+    {
+        scale_params.push_back(scale.flat(i));
+    }
+    bench.run("checkpoint/recompute 8 sum 128x128 backward",blocks,[&](){
+        Tensor total{0.0f};
+        for(int b = 0;b < blocks;b++)
+        {
+            Matrix<Tensor> out = checkpoint([&scale](Matrix<Tensor>& in){ return (in * scale).sum(0,true); },a,scale_params);
+            for(int i = 0;i < side;i++)
+            {
+                total = total + out.flat(i);
+            }
+        }
+        total.backward();
+        do_not_optimize(total);
+    });
+}
+
+static void bench_data(Bench& bench)
+{
+    std::vector<std::string> words;
+    bench.run("data/read_file names.txt",1,[&](){
+        words = read_file("names.txt");
+        do_not_optimize(words);
+    });
+    std::map<char,int> encoder;
+    for(const std::string& word : words)
+    {
+        for(char ch : word)
+        {
+            encoder.emplace(ch,0);
+        }
+    }
+    int id = 1;
+    for(auto& [ch,ix] : encoder)
+    {
+        ix = id++;
+    }
+    double examples = 0;
+    for(const std::string& word : words)
+    {
+        examples += word.size();
+    }
+    bench.run("data/build_dataset block 3",examples,[&](){
+        auto dataset = build_dataset(words,3,encoder);
+        do_not_optimize(dataset);
+    });
+    bench.run("data/build_flat_dataset block 3",examples,[&](){
+        auto dataset = build_flat_dataset<int32_t>(words,3,encoder);
+        do_not_optimize(dataset);
+    });
+}
+
+int main(int argc,char** argv)
+{
+    std::string out = "bench.json";
+    std::string commit = "unknown";
+    std::string filter;
+    BenchOptions options;
+    for(int i = 1;i + 1 < argc;i += 2)
+    {
+        std::string key = argv[i];
+        std::string value = argv[i + 1];
+        if(key == "--out") out = value;
+        else if(key == "--commit") commit = value;
+        else if(key == "--filter") filter = value;
+        else if(key == "--min-seconds") options.min_seconds = std::stod(value);
+        else if(key == "--min-reps") options.min_reps = std::stoi(value);
+        else if(key == "--warmup") options.warmup_reps = std::stoi(value);
+        else if(key == "--perf") options.perf = value != "0";
+        else if(key == "--threads") Parallel::set_num_threads(std::stoul(value));
+    }
+    // the ops log every call otherwise
+    Logger::basicConfig("Logger.txt",Logger::Loggermode::OPTIMIZED);
+
+    if(options.perf)
+    {
+        const PerfCounters& counters = PerfCounters::thread();
+        if(!counters.hardware())
+        {
+            std::printf("hardware counters unavailable, IPC is not reported: %s\n",
+                counters.error().empty() ? "no events" : counters.error().c_str());
+        }
+    }
+
+    Bench bench(options,filter);
+    bench_scalar_ops(bench);
+    bench_backward(bench);
+    bench_release(bench);
+    bench_matrix(bench);
+    bench_dtype<float>(bench);
+    bench_dtype<double>(bench);
+    bench_dtype<bfloat16>(bench);
+    bench_expression(bench);
+    bench_fusion(bench);
+    bench_grad_mode(bench);
+    bench_checkpoint(bench);
+    bench_data(bench);
+    bench.write_json(out,commit);
+    std::printf("wrote %zu results to %s\n",bench.results().size(),out.c_str());
+    return 0;
+}
@@ -0,0 +1,231 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <memory>
+#include <new>
+#include <random>
+#include <thread>
+#include <vector>
+#include "Checkpoint.h"
+#include "Module.h"
+#include "Optimizer.h"
+
+// regression tests of the autograd engine, `make test` builds and runs them,
+// the exit code is the number of failed checks
+
+// every allocation through operator new is counted, a graph that has been
+// released has to give back all of its nodes and closures
+static std::atomic<long> live_allocations{0};
+
+void* operator new(std::size_t bytes)
+{
+    void* block = std::malloc(bytes == 0 ? 1 : bytes);
+    if(block == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    live_allocations.fetch_add(1,std::memory_order_relaxed);
+    return block;
+}
+
+void operator delete(void* block) noexcept
+{
+    if(block != nullptr)
+    {
+        live_allocations.fetch_sub(1,std::memory_order_relaxed);
+        std::free(block);
+    }
+}
+
+void operator delete(void* block,std::size_t) noexcept
+{
+    operator delete(block);
+}
+
+static int failures = 0;
+
+static void check(bool ok,const char* what)
+{
+    std::printf("%s %s\n",ok ? "ok  " : "FAIL",what);
+    if(!ok)
+    {
+        failures++;
+    }
+}
+
+// runs fn on a thread of its own, a test which does not finish in time has
+// deadlocked and the process ends since the thread cannot be stopped
+static void within(int seconds,const char* what,const std::function<void()>& fn)
+{
+    std::packaged_task<void()> task(fn);
+    std::future<void> done = task.get_future();
+    std::thread runner(std::move(task));
+    if(done.wait_for(std::chrono::seconds(seconds)) != std::future_status::ready)
+    {
+        check(false,what);
+        std::fflush(stdout);
+        std::_Exit(failures);
+    }
+    runner.join();
+    done.get();
+    check(true,what);
+}
+
+static bool close(float a,float b)
+{
+    return std::fabs(a - b) <= 1e-4f * std::max(1.0f,std::fabs(b));
+}
+
+static Matrix<Tensor> input(int rows,int columns)
+{
+    std::vector<Tensor> values;
+    for(int i = 0;i < rows * columns;i++)
+    {
+        values.push_back(Tensor{0.1f * static_cast<float>(i % 7) - 0.3f});
+    }
+    return {rows,columns,values};
+}
+
+// the graph of a training step is freed once the loss goes out of scope,
+// a backward closure that owns its own node would keep every step alive
+static void test_step_graph_is_released()
+{
+    std::mt19937 gen(1);
+    Sequential model;
+    model.add(std::make_shared<Linear>(4,8,gen));
+    model.add(std::make_shared<Tanh>());
+    model.add(std::make_shared<Linear>(8,3,gen));
+    model.flatten();
+    Matrix<Tensor> x = input(2,4);
+
+    auto step = [&]()
+    {
+        model.zero_grad();
+        Matrix<Tensor> y = model(x);
+        Tensor loss{0.0f};
+        for(int i = 0;i < 2 * 3;i++)
+        {
+            loss = loss + y.flat(i) * y.flat(i);
+        }
+        loss.backward();
+    };
+    // the first step warms up the allocator caches
+    step();
+    long before = live_allocations.load();
+    step();
+    check(live_allocations.load() == before,"a released step leaves no live graph nodes");
+}
+
+// a backward function which runs a parallel op, here the sum of a recomputed
+// checkpoint block, while the parallel backward holds the locks of its parents
+static void test_parallel_op_inside_backward()
+{
+    const int n = 128;
+    Parallel::set_num_threads(4);
+    Matrix<Tensor> x = input(n,n);
+    Matrix<Tensor> w = input(n,n);
+    std::vector<Tensor> params;
+    for(int i = 0;i < n * n;i++)
+    {
+        params.push_back(w.flat(i));
+    }
+    // counts the chunks of a parallel_for run by the blocks while they are recomputed
+    std::atomic<int> recomputes{0};
+    std::atomic<int> chunks{0};
+    auto layer = [&](Matrix<Tensor>& in){
+        if(Parallel::inside_backward())
+        {
+            recomputes++;
+            Parallel::parallel_for(0,n,1,[&](std::size_t,std::size_t){ chunks++; });
+        }
+        return (in * w).sum(0,true);
+    };
+    // the blocks get ready at about the same time and queue up behind each other
+    within(60,"a parallel op inside a parallel backward finishes",[&](){
+        for(int rep = 0;rep < 16;rep++)
+        {
+            std::vector<Matrix<Tensor>> outs;
+            for(int block = 0;block < 8;block++)
+            {
+                outs.push_back(checkpoint(layer,x,params));
+            }
+            Tensor total{0.0f};
+            for(int i = 0;i < n;i++)
+            {
+                for(Matrix<Tensor>& out : outs)
+                {
+                    total = total + out.flat(i);
+                }
+            }
+            total.backward();
+        }
+    });
+    check(close(x.flat(1).grad(),128 * w.flat(1).value()) && close(w.flat(1).grad(),128 * x.flat(1).value()),
+        "the gradients of the checkpointed blocks add up");
+    check(recomputes > 0 && chunks == recomputes,"a parallel_for inside a backward function runs inline");
+    Parallel::set_num_threads(1);
+}
+
+// a leaf which asks for no gradient is left alone by the backward, also when
+// it is shared by many nodes of a parallel backward
+static void test_frozen_leaf_gets_no_gradient()
+{
+    Tensor a(2.0f);
+    Tensor b(3.0f);
+    b.requires_grad(false);
+    Tensor product = a * b;
+    product.backward();
+    check(a.grad() == 3.0f && b.grad() == 0.0f,"a frozen leaf gets no gradient");
+
+    Parallel::set_num_threads(4);
+    for(bool deterministic : {false,true})
+    {
+        Parallel::set_deterministic(deterministic);
+        Tensor w(0.5f);
+        w.requires_grad(false);
+        std::vector<Tensor> xs;
+        Tensor total{0.0f};
+        for(int i = 0;i < 4096;i++)
+        {
+            xs.push_back(Tensor{1.0f});
+            total = total + xs.back() * w;
+        }
+        total.backward();
+        check(w.grad() == 0.0f && xs.front().grad() == 0.5f,
+            deterministic ? "a frozen leaf gets no gradient in wave mode" : "a frozen leaf gets no gradient in task mode");
+    }
+    Parallel::set_deterministic(false);
+    Parallel::set_num_threads(1);
+}
+
+// with momentum and dampening the first SGD step seeds the velocity with
+// the undamped gradient like torch.optim.SGD, later steps dampen it
+static void test_sgd_first_step_seeds_velocity()
+{
+    Tensor w(1.0f);
+    std::shared_ptr<ParameterBuffer> buffer = ParameterBuffer::flatten({w});
+    OptimizerOptions options;
+    options.lr = 0.1f;
+    options.momentum = 0.9f;
+    options.dampening = 0.5f;
+    SGD sgd(buffer,options);
+    w.backward();
+    sgd.step();
+    check(close(w.value(),0.9f),"the first SGD step moves by lr * gradient");
+    sgd.step();
+    check(close(w.value(),0.9f - 0.1f * (0.9f + 0.5f)),"the second SGD step dampens the gradient");
+}
+
+int main()
+{
+    Logger::basicConfig("Logger.txt",Logger::Loggermode::OPTIMIZED);
+    test_step_graph_is_released();
+    test_parallel_op_inside_backward();
+    test_frozen_leaf_gets_no_gradient();
+    test_sgd_first_step_seeds_velocity();
+    return failures;
+}
@@ -0,0 +1,344 @@
+// Character level MLP on names.txt (Bengio et al. 2003, like makemore part 3)
+//
+// the end to end workload to measure the library against: the dataset comes
+// from the binary cache, minibatches from the background DataLoader and the
+// parameters live in one flat buffer updated by the optimizer
+//
+//     make train_mlp && ./train_mlp --steps 200 --batch 32 --hidden 64
+//     ./train_mlp --steps 20 --profile trace.json   per op table and a Chrome trace
+//     ./train_mlp --steps 5 --memory-debug 1         live nodes by op after every step
+//     ./train_mlp --steps 50 --perf 1                 cycles, IPC, cache misses per phase
+//     ./train_mlp --amp fp16                          mixed precision with loss scaling (or bf16)
+//     ./train_mlp --fuse 1                            fuse the chains of the graph before backward
+//     ./train_mlp --plan-memory 1                     plan the Matrix buffers of step 0, replay the plan after
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include "DatasetCache.h"
+#include "DataLoader.h"
+#include "Fusion.h"
+#include "GraphMemory.h"
+#include "MemoryPlanner.h"
+#include "MixedPrecision.h"
+#include "Module.h"
+#include "Optimizer.h"
+#include "PerfCounters.h"
+#include "Profiler.h"
+#include "ThreadPool.h"
+
+struct Config
+{
+    std::string data = "names.txt";
+    std::string cache = "names.cache";
+    int block_size = 3;
+    int embedding_dim = 10;
+    int hidden = 64;
+    int batch = 32;
+    int steps = 200;
+    float lr = 0.1f;
+    std::string optimizer = "sgd";
+    int eval_examples = 2048; // of the train and the dev split for the final loss
+    int threads = 1;
+    uint64_t seed = 42;
+    std::string profile; // where the Chrome trace of the training steps goes, off if empty
+    int memory_debug = 0;
+    int perf = 0; // hardware counters per phase (and per scope with --profile)
+    std::string amp = "off"; // bf16 or fp16 autocast of the forward pass
+    int fuse = 0; // the fusion pass over the graph of every step, counted in backward
+    int plan_memory = 0; // capture the first step with the MemoryPlanner and replay it in the others
+};
+
+static Config parse_args(int argc,char** argv)
+{
+    Config config;
+    std::map<std::string,std::string> values;
+    for(int i = 1;i + 1 < argc;i += 2)
+    {
+        values[argv[i]] = argv[i + 1];
+    }
+    auto text = [&](const char* key,std::string& out){ if(values.count(key)) out = values[key]; };
+    auto number = [&](const char* key,int& out){ if(values.count(key)) out = std::stoi(values[key]); };
+    text("--data",config.data);
+    text("--cache",config.cache);
+    text("--optimizer",config.optimizer);
+    text("--profile",config.profile);
+    text("--amp",config.amp);
+    number("--block",config.block_size);
+    number("--embedding",config.embedding_dim);
+    number("--hidden",config.hidden);
+    number("--batch",config.batch);
+    number("--steps",config.steps);
+    number("--eval",config.eval_examples);
+    number("--threads",config.threads);
+    number("--memory-debug",config.memory_debug);
+    number("--perf",config.perf);
+    number("--fuse",config.fuse);
+    number("--plan-memory",config.plan_memory);
+    if(values.count("--lr")) config.lr = std::stof(values["--lr"]);
+    if(values.count("--seed")) config.seed = std::stoull(values["--seed"]);
+    return config;
+}
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// mean loss over the first examples of the split, in eval mode and without a graph
+static float evaluate(Embedding& embedding,Sequential& mlp,const DatasetSplit<int32_t>& split,int examples,int block_size)
+{
+    NoGradScope no_grad;
+    mlp.eval();
+    examples = static_cast<int>(std::min<std::size_t>(examples,split.size));
+    const int chunk = 256;
+    std::vector<int32_t> X(chunk * block_size);
+    std::vector<int32_t> Y(chunk);
+    double total = 0.0;
+    for(int start = 0;start < examples;start += chunk)
+    {
+        int n = std::min(chunk,examples - start);
+        for(int i = 0;i < n;i++)
+        {
+            const int32_t* row = split.row(start + i);
+            std::copy(row,row + block_size,X.begin() + i * block_size);
+            Y[i] = split.target(start + i);
+        }
+        Matrix<Tensor> emb = embedding.lookup(X.data(),n,block_size);
+        Matrix<Tensor> logits = mlp.forward(emb);
+        total += static_cast<double>(cross_entropy(logits,Y.data()).value()) * n;
+    }
+    mlp.train();
+    return static_cast<float>(total / std::max(examples,1));
+}
+
+int main(int argc,char** argv)
+{
+    Config config = parse_args(argc,argv);
+    // the ops log every call otherwise, which would be most of what is measured
+    Logger::basicConfig("Logger.txt",Logger::Loggermode::OPTIMIZED);
+    Parallel::set_num_threads(config.threads);
+
+    auto start = Clock::now();
+    auto dataset = CachedDataset<int32_t>::load_or_build(config.data,config.cache,config.block_size,config.seed);
+    double load_seconds = seconds_since(start);
+    int vocab_size = dataset.vocab().size();
+    std::printf("data: %zu train / %zu dev / %zu test examples, vocab %d, %s in %.3f s\n",
+        dataset.train().size,dataset.dev().size,dataset.test().size,vocab_size,
+        dataset.from_cache() ? "loaded" : "built",load_seconds);
+
+    std::mt19937 gen(static_cast<std::mt19937::result_type>(config.seed));
+    auto embedding = std::make_shared<Embedding>(vocab_size,config.embedding_dim,gen);
+    auto mlp = std::make_shared<Sequential>();
+    mlp->add(std::make_shared<Linear>(config.block_size * config.embedding_dim,config.hidden,gen,false));
+    mlp->add(std::make_shared<BatchNorm1d>(config.hidden));
+    mlp->add(std::make_shared<Tanh>());
+    mlp->add(std::make_shared<Linear>(config.hidden,vocab_size,gen));
+    Sequential model;
+    model.add(embedding);
+    model.add(mlp);
+    auto params = model.flatten();
+    std::printf("model: %zu parameters, hidden %d, embedding %d, batch %d\n",
+        params->size(),config.hidden,config.embedding_dim,config.batch);
+
+    std::unique_ptr<Optimizer> optimizer;
+    if(config.optimizer == "adamw")
+    {
+        optimizer = std::make_unique<AdamW>(params,OptimizerOptions{.lr = config.lr,.weight_decay = 0.01f});
+    }
+    else if(config.optimizer == "adam")
+    {
+        optimizer = std::make_unique<Adam>(params,OptimizerOptions{.lr = config.lr});
+    }
+    else
+    {
+        optimizer = std::make_unique<SGD>(params,OptimizerOptions{.lr = config.lr});
+    }
+
+    DataLoader<DatasetSplit<int32_t>> loader(dataset.train(),config.batch,config.seed);
+    double forward_seconds = 0.0;
+    double backward_seconds = 0.0;
+    double optimizer_seconds = 0.0;
+    float last_loss = 0.0f;
+    // counters are read at the same points as the clock, one sample per phase
+    PerfCounters* counters = config.perf != 0 ? &PerfCounters::thread() : nullptr;
+    PerfSample forward_perf;
+    PerfSample backward_perf;
+    PerfSample optimizer_perf;
+    if(counters && !counters->hardware())
+    {
+        std::printf("hardware counters unavailable: %s\n",
+            counters->error().empty() ? "no events" : counters->error().c_str());
+    }
+
+    AutocastType amp = AutocastType::NONE;
+    if(config.amp == "bf16") amp = AutocastType::BFLOAT16;
+    else if(config.amp == "fp16") amp = AutocastType::FLOAT16;
+    else if(config.amp != "off")
+    {
+        std::fprintf(stderr,"--amp takes off, bf16 or fp16\n");
+        return 1;
+    }
+    // bfloat16 has the range of float, only float16 gradients need the scaling
+    FusionReport fusion;
+    LossScaler scaler(LossScalerOptions{.enabled = amp == AutocastType::FLOAT16});
+    std::unique_ptr<MemoryPlanner> planner;
+    if(config.plan_memory != 0)
+    {
+        planner = std::make_unique<MemoryPlanner>();
+    }
+
+    if(!config.profile.empty())
+    {
+        Profiler::start(ProfilerOptions{.perf_counters = config.perf != 0});
+    }
+    GraphMemory::set_debug(config.memory_debug != 0);
+    GraphMemory::Snapshot idle = GraphMemory::snapshot();
+    std::printf("memory before training: %s\n",idle.format().c_str());
+    auto train_start = Clock::now();
+    for(int step = 0;step < config.steps;step++)
+    {
+        ProfileScope step_scope("train_step");
+        GraphMemory::reset_peak();
+        // the graph of the step before is gone here, so every step is captured
+        // or replayed from its first to its last buffer
+        if(planner)
+        {
+            if(step == 0)
+            {
+                planner->capture_begin();
+            }
+            else
+            {
+                if(step == 1)
+                {
+                    planner->capture_end();
+                    planner->plan();
+                }
+                else
+                {
+                    planner->replay_end();
+                }
+                planner->replay_begin();
+            }
+        }
+        // learning rate decay for the last quarter, like the notebook
+        if(step == config.steps * 3 / 4)
+        {
+            for(ParamGroup& group : optimizer->groups())
+            {
+                group.options.lr *= 0.1f;
+            }
+        }
+        const Batch<int32_t>& batch = loader.next();
+
+        PerfSample p0,p1,p2,p3;
+        if(counters) counters->read(p0);
+        auto t0 = Clock::now();
+        Tensor loss;
+        {
+            AutocastScope autocast(amp);
+            Matrix<Tensor> emb = embedding->lookup(batch.X.data(),static_cast<int>(batch.size),config.block_size);
+            Matrix<Tensor> logits = mlp->forward(emb);
+            loss = cross_entropy(logits,batch.Y.data());
+        }
+        auto t1 = Clock::now();
+        if(counters) counters->read(p1);
+        if(config.fuse != 0)
+        {
+            fusion += Fusion::run(loss);
+        }
+        optimizer->zero_grad();
+        scaler.scale(loss).backward();
+        auto t2 = Clock::now();
+        if(counters) counters->read(p2);
+        scaler.step(*optimizer);
+        auto t3 = Clock::now();
+        if(counters && counters->read(p3))
+        {
+            forward_perf += p1 - p0;
+            backward_perf += p2 - p1;
+            optimizer_perf += p3 - p2;
+        }
+
+        forward_seconds += std::chrono::duration<double>(t1 - t0).count();
+        backward_seconds += std::chrono::duration<double>(t2 - t1).count();
+        optimizer_seconds += std::chrono::duration<double>(t3 - t2).count();
+        last_loss = loss.value();
+        if(step % std::max(config.steps / 10,1) == 0 || GraphMemory::debug())
+        {
+            // the graph of the step is still alive here, the peak is the whole step
+            GraphMemory::Snapshot memory = GraphMemory::snapshot();
+            std::printf("step %6d  loss %.4f  %s\n",step,last_loss,memory.format().c_str());
+            std::printf("%s",GraphMemory::dump().c_str());
+        }
+    }
+    double train_seconds = seconds_since(train_start);
+    if(planner)
+    {
+        if(config.steps == 1)
+        {
+            planner->capture_end();
+            planner->plan();
+        }
+        else if(config.steps > 1)
+        {
+            planner->replay_end();
+        }
+    }
+    GraphMemory::set_debug(false);
+    // every graph of the steps is gone again, anything above idle is a leak
+    std::printf("memory after training: %s\n",GraphMemory::snapshot().format().c_str());
+    if(!config.profile.empty())
+    {
+        Profiler::stop();
+        std::printf("\n%s\n",Profiler::report().c_str());
+        Profiler::write_chrome_trace(config.profile);
+        std::printf("trace written to %s\n",config.profile.c_str());
+    }
+    auto data_stats = loader.stats();
+
+    float train_loss = evaluate(*embedding,*mlp,dataset.train(),config.eval_examples,config.block_size);
+    float dev_loss = evaluate(*embedding,*mlp,dataset.dev(),config.eval_examples,config.block_size);
+
+    double step_total = forward_seconds + backward_seconds + optimizer_seconds;
+    std::printf("\nsteps: %d in %.3f s, %.2f steps/s, %.0f examples/s\n",config.steps,train_seconds,
+        config.steps / train_seconds,static_cast<double>(config.steps) * config.batch / train_seconds);
+    std::printf("forward   %8.3f s  %5.1f%%\n",forward_seconds,100.0 * forward_seconds / step_total);
+    std::printf("backward  %8.3f s  %5.1f%%\n",backward_seconds,100.0 * backward_seconds / step_total);
+    std::printf("optimizer %8.3f s  %5.1f%%\n",optimizer_seconds,100.0 * optimizer_seconds / step_total);
+    std::printf("data wait %8.3f s\n",data_stats.wait_seconds);
+    if(amp != AutocastType::NONE)
+    {
+        std::printf("autocast %s, loss scale %g, %llu steps skipped on overflow\n",autocast_name(amp),
+            scaler.current_scale(),static_cast<unsigned long long>(scaler.skipped_steps()));
+    }
+    if(config.fuse != 0)
+    {
+        std::printf("%s\n",fusion.format().c_str());
+    }
+    if(planner)
+    {
+        MemoryPlanner::Report plan = planner->report();
+        std::printf("memory plan: %zu buffers (%zu planned) in %zu slabs, %.2f MB planned vs %.2f MB naive"
+            " (live peak %.2f MB), replay %zu hits %zu fallbacks\n",
+            plan.buffers,plan.planned_buffers,plan.slabs,plan.planned_bytes / 1e6,plan.naive_bytes / 1e6,
+            plan.live_peak_bytes / 1e6,plan.replay_hits,plan.replay_fallbacks);
+    }
+    if(counters && counters->available())
+    {
+        std::printf("per step counters:\n");
+        std::printf("forward   %s\n",forward_perf.per(config.steps).format().c_str());
+        std::printf("backward  %s\n",backward_perf.per(config.steps).format().c_str());
+        std::printf("optimizer %s\n",optimizer_perf.per(config.steps).format().c_str());
+    }
+    std::printf("loss: last batch %.4f, train %.4f, dev %.4f (%d examples each)\n",
+        last_loss,train_loss,dev_loss,config.eval_examples);
+    return 0;
+}